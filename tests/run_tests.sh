@@ -0,0 +1,312 @@
+#!/bin/sh
+# Regression tests of zopfli-pnginator.
+#
+# Usage: tests/run_tests.sh [path/to/zopfli-pnginator]
+#
+# Without a path the tool is compiled with $CC (default gcc), $CFLAGS and
+# $LIBS (default -lzopfli -lz -lm). Decode and behavior checks need node.
+
+set -u
+cd "$(dirname "$0")/.." || exit 1
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+if [ $# -gt 0 ]; then
+  TOOL=$1
+else
+  TOOL=$WORK/zopfli-pnginator
+  ${CC:-gcc} -std=c17 -O2 -Wall -Wextra -pedantic ${CFLAGS:-} \
+    zopfli-pnginator.c ${LIBS:--lzopfli -lz -lm} -o "$TOOL" || exit 1
+fi
+
+FAILURES=0
+fail() {
+  echo "FAIL: $*"
+  FAILURES=$((FAILURES + 1))
+}
+
+# Packs with the given options, the input and output come last
+pack() {
+  "$TOOL" "$@" >"$WORK/pack.log" 2>&1
+}
+
+# expect_hacks accept|reject targets hacks
+expect_hacks() {
+  if pack --format_hack_targets="$2" --format_hacks="$3" "$WORK/hello.js" \
+    "$WORK/hacks.png.html"; then
+    result=accept
+  else
+    result=reject
+  fi
+  [ "$result" = "$1" ] || fail "format hacks '$3' for '$2': $result, not $1"
+}
+
+# Tolerances of the modelled decoders, see PNG_DECODER_CATALOGUE
+test_format_hacks() {
+  printf 'console.log("hello")\n' >"$WORK/hello.js"
+  for decoder in chromium firefox; do
+    expect_hacks accept $decoder iend,jawh_crc,idat_crc,adler32
+    expect_hacks reject $decoder iend,jawh_crc,idat_crc,adler32,ihdr_crc
+    expect_hacks reject $decoder ihdr_crc
+  done
+  expect_hacks accept webkit iend,jawh_crc,idat_crc
+  expect_hacks reject webkit iend,idat_crc,adler32
+  expect_hacks reject webkit ihdr_crc
+  expect_hacks reject chromium,webkit iend,jawh_crc,idat_crc,adler32
+  expect_hacks accept chromium,firefox,webkit iend,jawh_crc
+
+  # Structural rules hold for every decoder
+  expect_hacks reject chromium idat_crc
+  expect_hacks reject chromium iend,adler32
+  expect_hacks accept chromium iend
+
+  # Default is the largest set that every target tolerates
+  pack --format_hack_targets=webkit "$WORK/hello.js" "$WORK/hacks.png.html"
+  grep -q "Format hacks: iend jawh_crc idat_crc (" "$WORK/pack.log" ||
+    fail "default format hacks for webkit"
+  pack --format_hack_targets=chromium "$WORK/hello.js" "$WORK/hacks.png.html"
+  grep -q "Format hacks: iend jawh_crc idat_crc adler32 (" "$WORK/pack.log" ||
+    fail "default format hacks for chromium"
+}
+
+# expect_behavior input.js [options]: the decoded program prints what the
+# input prints
+expect_behavior() {
+  input=$1
+  shift
+  if ! pack "$@" --bootstrap_benchmark="$WORK/harness.js" "$input" \
+    "$WORK/behavior.png.html"; then
+    fail "packing $(basename "$input") with $*"
+    return
+  fi
+  node "$input" >"$WORK/expected.out" 2>&1
+  if ! node tests/unpack.js "$WORK/harness.js" "$WORK/decoded.js" ||
+    ! node "$WORK/decoded.js" >"$WORK/decoded.out" 2>&1 ||
+    ! cmp -s "$WORK/expected.out" "$WORK/decoded.out"; then
+    fail "behavior of $(basename "$input") with $*"
+  fi
+}
+
+# Function declarations are moved as a whole, including braces in default
+# parameter values
+test_reorder_units() {
+  cat >"$WORK/reorder.js" <<'END'
+function b(o={}){return 'b'+Object.keys(o).length}
+function a(){return 'a'}
+var c=function(){return 'c'};
+function d(x={y:{}},z=`${1}`){return 'd'+Object.keys(x).length+z}
+console.log(a(),b({x:1}),c(),d())
+END
+  expect_behavior "$WORK/reorder.js" --reorder_units
+  expect_behavior "$WORK/reorder.js" --reorder_units --minify
+}
+
+# Non-ASCII characters and \0 keep their meaning after backslashes and in
+# templates, whether they are escaped (fast path) or decoded as UTF-8
+test_text_encoding() {
+  # \303\251 is e acute, \302\240 a no-break space and \342\200\250 U+2028
+  {
+    printf 'var a="caf\\\303\251",b="x\\\\\303\251";\n'
+    printf 'var c=`t\\\303\251${1}\303\251`;\n'
+    printf 'var\302\240d=/caf\\\303\251/.test("caf\303\251");\n'
+    printf 'var e="line\\\342\200\250continued";\n'
+    printf 'console.log(a,b,c,d,e,a.length,e.length)\n'
+  } >"$WORK/text.js"
+  {
+    printf 'function t(s){return s.raw.join("|")}\n'
+    printf 'console.log(String.raw`\303\251\\\303\251`,'
+    printf 't`a${1}\303\251${2}\\\303\251`)\n'
+  } >"$WORK/tagged.js"
+  printf 'console.log("a\\\000b".length,"c\000".charCodeAt(1)/*\000*/)\n' \
+    >"$WORK/nul.js"
+  printf 'console.log(String.raw`\000`.length)\n' >"$WORK/tagged_nul.js"
+
+  for options in "" --fast_path; do
+    expect_behavior "$WORK/text.js" $options
+    expect_behavior "$WORK/nul.js" $options
+  done
+  expect_behavior "$WORK/tagged.js"
+  if pack --fast_path "$WORK/tagged.js" "$WORK/tagged.png.html"; then
+    fail "escaping non-ASCII characters in tagged templates"
+  fi
+  if pack "$WORK/tagged_nul.js" "$WORK/tagged.png.html"; then
+    fail "escaping NUL in tagged templates"
+  fi
+}
+
+# Re-optimized files keep their own format hacks, other files in directories
+# are skipped
+test_reoptimize() {
+  mkdir -p "$WORK/reoptimize"
+  printf 'console.log("reoptimize", [1, 2, 3].map(x => x * 2))\n' \
+    >"$WORK/reoptimize.js"
+  pack --no_format_hacks "$WORK/reoptimize.js" "$WORK/reoptimize/plain.png"
+  pack "$WORK/reoptimize.js" "$WORK/reoptimize/hacked.png"
+  cp "$WORK/reoptimize/hacked.png" "$WORK/hacked.png"
+  printf 'not an output\n' >"$WORK/reoptimize/README"
+
+  pack --reoptimize "$WORK/reoptimize" ||
+    fail "re-optimizing a directory with other files"
+  tail -c 12 "$WORK/reoptimize/plain.png" | od -c | grep -q "I   E   N   D" ||
+    fail "re-optimizing a file without format hacks added hacks"
+  [ "$(wc -c <"$WORK/reoptimize/hacked.png")" -le \
+    "$(wc -c <"$WORK/hacked.png")" ] ||
+    fail "re-optimizing a file with format hacks dropped hacks"
+  if pack --reoptimize "$WORK/reoptimize/README"; then
+    fail "re-optimizing a file given explicitly that is not an output"
+  fi
+}
+
+# Stage images are only left next to an output that was written
+test_stages() {
+  printf 'stage\n' >"$WORK/stage.bin"
+  printf 'L[0].then(b=>console.log(b.length))\n' >"$WORK/staged.js"
+  pack --stage="$WORK/stage.bin" "$WORK/staged.js" "$WORK/staged.png.html" &&
+    [ -f "$WORK/staged.stage1.png" ] || fail "packing with a stage"
+
+  # Non-ASCII characters in tagged templates fail with the fast path
+  printf 'L[0].then(b=>console.log(String.raw`\303\251`))\n' \
+    >"$WORK/failing.js"
+  if pack --fast_path --stage="$WORK/stage.bin" "$WORK/failing.js" \
+    "$WORK/failing.png.html"; then
+    fail "packing a failing output with a stage"
+  fi
+  [ ! -f "$WORK/failing.stage1.png" ] ||
+    fail "stage image left behind by a failed output"
+}
+
+# --deterministic output does not depend on the number of threads
+test_deterministic() {
+  i=0
+  while [ $i -lt 40 ]; do
+    printf 'function f%d(value){var total=%d;for(var i=0;i<value;i++)' $i $i
+    printf 'total+=i*%d;return "f%d:"+total}\n' $i $i
+    i=$((i + 1))
+  done >"$WORK/threads.js"
+  printf 'console.log(f1(3),f7(5),f39(2))\n' >>"$WORK/threads.js"
+
+  for options in "" --anneal_parse --minify --rename_identifiers \
+    --reorder_units "--minify --rename_identifiers --reorder_units"; do
+    for threads in 1 2 4; do
+      # shellcheck disable=SC2086
+      pack --deterministic --threads=$threads --zopfli_iterations=2 \
+        --anneal_iterations=200 --rename_iterations=20 \
+        --reorder_iterations=20 $options "$WORK/threads.js" \
+        "$WORK/threads$threads.png" ||
+        fail "packing with --threads=$threads $options"
+    done
+    cmp -s "$WORK/threads1.png" "$WORK/threads2.png" &&
+      cmp -s "$WORK/threads1.png" "$WORK/threads4.png" ||
+      fail "--deterministic output depends on the threads with '$options'"
+  done
+}
+
+# Options that would silently drop inputs are rejected
+test_rejected_options() {
+  printf '\000asm\001\000\000\000' >"$WORK/empty.wasm"
+  printf 'segment\n' >"$WORK/segment.bin"
+  if pack --wasm="$WORK/empty.wasm" --segment="$WORK/segment.bin" \
+    "$WORK/hello.js" "$WORK/rejected.png.html"; then
+    fail "--segment with --wasm"
+  fi
+}
+
+# Eight 64 KB segments are ordered without trying every order, and S keeps
+# command line order whatever order they are laid out in
+test_segment_order() {
+  segments=""
+  for index in 1 2 3 4 5 6 7 8; do
+    seq "$index" "$((index * 3))" 10000000 | head -c 65536 \
+      >"$WORK/segment$index.bin"
+    segments="$segments --segment=$WORK/segment$index.bin"
+  done
+  echo 'console.log(S.map(function(s){return s.length+":"+s[0]}).join())' \
+    >"$WORK/segments.js"
+
+  if ! timeout 60 "$TOOL" --no_zopfli $segments "$WORK/segments.js" \
+    "$WORK/segments.png.html" >"$WORK/segments.log" 2>&1; then
+    fail "ordering eight segments"
+    return
+  fi
+  # Runs the unpack code on a canvas holding the payload bytes, laid out in
+  # the reported order, in the red channel
+  layout=$(sed -n 's/^Segments ([0-9]* bytes)://p' "$WORK/segments.log")
+  node -e '
+    var fs = require("fs"), argv = process.argv;
+    var html = fs.readFileSync(argv[1], "latin1");
+    var code = html.slice(html.indexOf("onload=") + 7, html.indexOf(" src=#>"));
+    var parts = [fs.readFileSync(argv[2]), Buffer.from([0])];
+    argv[3].trim().split(" ").forEach(function (path) {
+      parts.push(fs.readFileSync(path));
+    });
+    var payload = Buffer.concat(parts), data = new Uint8Array(
+        4 * payload.length + 8);
+    payload.forEach(function (byte, index) { data[4 * index + 4] = byte; });
+    globalThis.c = {getContext: function () {
+      return {drawImage: function () {},
+              getImageData: function () { return {data: data}; }};
+    }};
+    (1, eval)(code);
+  ' "$WORK/segments.png.html" "$WORK/segments.js" "$layout" \
+    >"$WORK/segments.out" 2>&1
+  expected="65536:49,65536:50,65536:51,65536:52"
+  expected="$expected,65536:53,65536:54,65536:55,65536:56"
+  [ "$(cat "$WORK/segments.out")" = "$expected" ] ||
+    fail "segments in command line order after reordering"
+}
+
+# The bootstrap instantiates the module whatever globals the glue declares,
+# and renaming keeps the glue's imports I and start callback R
+test_wasm_glue() {
+  # Module exporting add(a, b)
+  printf '\000asm\001\000\000\000\001\007\001\140\002\177\177\001\177' \
+    >"$WORK/add.wasm"
+  printf '\003\002\001\000\007\007\001\003add\000\000' >>"$WORK/add.wasm"
+  printf '\012\011\001\007\000\040\000\040\001\152\013' >>"$WORK/add.wasm"
+  cat >"$WORK/glue.js" <<'END'
+var z=5,b=0,p=0,I={};function R(instance){var total=0;
+for(var index=0;index<4;index++)total+=instance.exports.add(index,z);
+console.log("sum",total)}
+END
+
+  if ! pack --rename_identifiers --wasm="$WORK/add.wasm" \
+    --bootstrap_benchmark="$WORK/harness.js" "$WORK/glue.js" \
+    "$WORK/wasm.png.html" ||
+    ! node tests/unpack.js "$WORK/harness.js" "$WORK/glue.out.js"; then
+    fail "packing WebAssembly glue"
+    return
+  fi
+  # Runs the unpack code after its reader on the payload bytes
+  node -e '
+    var fs = require("fs"), argv = process.argv;
+    var html = fs.readFileSync(argv[1], "latin1");
+    var code = html.slice(html.indexOf("onload=") + 7, html.indexOf(" src=#>"));
+    globalThis.self = globalThis;
+    globalThis.b = Array.from(Buffer.concat([fs.readFileSync(argv[2]),
+        Buffer.from([0]), fs.readFileSync(argv[3])]));
+    (1, eval)(code.slice(code.indexOf("for(e=")));
+  ' "$WORK/wasm.png.html" "$WORK/glue.out.js" "$WORK/add.wasm" \
+    >"$WORK/wasm.out" 2>&1
+  [ "$(cat "$WORK/wasm.out")" = "sum 26" ] ||
+    fail "instantiating WebAssembly after glue with globals z, b and p"
+}
+
+test_format_hacks
+test_rejected_options
+test_reoptimize
+test_stages
+test_deterministic
+if command -v node >/dev/null; then
+  test_reorder_units
+  test_text_encoding
+  test_wasm_glue
+  test_segment_order
+else
+  echo "Skipping decode and behavior tests, node is missing"
+fi
+
+if [ $FAILURES -gt 0 ]; then
+  echo "$FAILURES test(s) failed"
+  exit 1
+fi
+echo "All tests passed"
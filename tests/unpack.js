@@ -0,0 +1,25 @@
+// Decodes a packed file with the bootstrap benchmark harness written by
+// --bootstrap_benchmark and saves the javascript the page would evaluate.
+//
+// Usage: node tests/unpack.js harness.js decoded.js
+
+var fs = require('fs');
+var vm = require('vm');
+
+var harness = fs.readFileSync(process.argv[2], 'utf8')
+    .replace(/RUNS = \d+/, 'RUNS = 1');
+var consoleLog = console.log;
+console.log = function () {};
+try {
+  vm.runInThisContext(harness);
+} catch (error) {
+  // A mismatch with the harness's own expectation is reported by the caller,
+  // which compares the behavior of the decoded program instead
+}
+console.log = consoleLog;
+
+if (typeof result != 'string') {
+  console.error('Nothing was decoded');
+  process.exit(1);
+}
+fs.writeFileSync(process.argv[3], result);
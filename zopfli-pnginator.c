@@ -14,19 +14,240 @@ https://github.com/google/zopfli
 https://github.com/madler/zlib
 */
 
+#ifdef __linux__
+// syscall() for the io_uring I/O queue
+#define _DEFAULT_SOURCE
+#endif
+
+#include <limits.h>
 #include <math.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <threads.h>
+#include <time.h>
 #ifdef _WIN32
 #include <winsock.h>
+#include <psapi.h>
 #else
 #include <arpa/inet.h>
+#include <dirent.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
 #endif
 #include "zlib.h"
 #include "zopfli.h"
 
 #define min(a, b) (((a) < (b)) ? (a) : (b))
+#define max(a, b) (((a) > (b)) ? (a) : (b))
+
+// Phases of the packing pipeline for memory accounting
+typedef enum MEMORY_PHASE {
+  MEMORY_PHASE_INPUT,
+  MEMORY_PHASE_SEARCH,
+  MEMORY_PHASE_IMAGE,
+  MEMORY_PHASE_COMPRESSION,
+  MEMORY_PHASE_OUTPUT,
+  MEMORY_PHASE_COUNT
+} MEMORY_PHASE;
+
+const char *MEMORY_PHASE_NAMES[] = {"input", "search", "image", "compression",
+                                    "output"};
+
+// Heap use of the allocations in this file and inside zlib, which go through
+// the counting wrappers below, and its high-water mark per phase. Zopfli has
+// no allocation hooks, its allocations only show in the peak resident set
+// size. Heap use counts the requested bytes, so worst-case sized buffers that
+// are only partly touched can exceed resident size.
+atomic_size_t heap_size;
+atomic_size_t heap_peaks[MEMORY_PHASE_COUNT];
+atomic_int memory_phase;
+
+// Size header in front of each counted allocation, keeping the alignment
+// malloc guarantees
+typedef union ALLOCATION_HEADER {
+  size_t size;
+  max_align_t alignment;
+} ALLOCATION_HEADER;
+
+void raise_heap_peak(MEMORY_PHASE phase, size_t size) {
+  size_t peak = atomic_load(&heap_peaks[phase]);
+  while (size > peak &&
+         !atomic_compare_exchange_weak(&heap_peaks[phase], &peak, size)) {
+  }
+}
+
+// Counts an allocation of the given size. Running out of memory ends the
+// process, allocation results are not checked elsewhere.
+void *count_allocation(ALLOCATION_HEADER *header, size_t size) {
+  if (header == NULL) {
+    printf("Out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  header->size = size;
+  size_t current = atomic_fetch_add(&heap_size, size) + size;
+  raise_heap_peak(atomic_load(&memory_phase), current);
+  return header + 1;
+}
+
+void *counted_malloc(size_t size) {
+  return count_allocation(malloc(sizeof(ALLOCATION_HEADER) + size), size);
+}
+
+// No object may be larger than PTRDIFF_MAX bytes
+void *counted_calloc(size_t count, size_t size) {
+  bool overflow =
+      size != 0 && count > (PTRDIFF_MAX - sizeof(ALLOCATION_HEADER)) / size;
+  return count_allocation(
+      overflow ? NULL : calloc(1, sizeof(ALLOCATION_HEADER) + count * size),
+      count * size);
+}
+
+// Counts the new block before releasing the old one, a moving realloc holds
+// both for a moment
+void *counted_realloc(void *pointer, size_t size) {
+  if (pointer == NULL) {
+    return counted_malloc(size);
+  }
+  ALLOCATION_HEADER *header = (ALLOCATION_HEADER *)pointer - 1;
+  size_t old_size = header->size;
+  void *resized = count_allocation(
+      realloc(header, sizeof(ALLOCATION_HEADER) + size), size);
+  atomic_fetch_sub(&heap_size, old_size);
+  return resized;
+}
+
+void counted_free(void *pointer) {
+  if (pointer == NULL) {
+    return;
+  }
+  ALLOCATION_HEADER *header = (ALLOCATION_HEADER *)pointer - 1;
+  atomic_fetch_sub(&heap_size, header->size);
+  free(header);
+}
+
+// zlib allocation hooks, so that its compressor and decompressor state is
+// counted too. Streams get them from init_zlib_stream.
+voidpf counted_zalloc(voidpf opaque, uInt count, uInt size) {
+  (void)opaque;
+  return counted_calloc(count, size);
+}
+
+void counted_zfree(voidpf opaque, voidpf pointer) {
+  (void)opaque;
+  counted_free(pointer);
+}
+
+void init_zlib_stream(z_stream *stream) {
+  memset(stream, 0, sizeof(z_stream));
+  stream->zalloc = counted_zalloc;
+  stream->zfree = counted_zfree;
+}
+
+// compress2 of zlib with counted allocations
+int zlib_compress(unsigned char *destination, uLongf *destination_size,
+                  const unsigned char *source, uLong source_size, int level) {
+  z_stream stream;
+  init_zlib_stream(&stream);
+  int result = deflateInit(&stream, level);
+  if (result != Z_OK) {
+    return result;
+  }
+  stream.next_in = (unsigned char *)source;
+  stream.avail_in = source_size;
+  stream.next_out = destination;
+  stream.avail_out = *destination_size;
+  result = deflate(&stream, Z_FINISH);
+  *destination_size = stream.total_out;
+  deflateEnd(&stream);
+  return result == Z_STREAM_END ? Z_OK : result == Z_OK ? Z_BUF_ERROR : result;
+}
+
+// uncompress of zlib with counted allocations
+int zlib_uncompress(unsigned char *destination, uLongf *destination_size,
+                    const unsigned char *source, uLong source_size) {
+  z_stream stream;
+  init_zlib_stream(&stream);
+  int result = inflateInit(&stream);
+  if (result != Z_OK) {
+    return result;
+  }
+  stream.next_in = (unsigned char *)source;
+  stream.avail_in = source_size;
+  stream.next_out = destination;
+  stream.avail_out = *destination_size;
+  result = inflate(&stream, Z_FINISH);
+  *destination_size = stream.total_out;
+  inflateEnd(&stream);
+  if (result == Z_STREAM_END) {
+    return Z_OK;
+  }
+  // Input that ends early is corrupt, output that fills up too small
+  return result == Z_NEED_DICT || (result == Z_BUF_ERROR &&
+                                   stream.avail_out > 0)
+             ? Z_DATA_ERROR
+             : result;
+}
+
+// Starts a phase of the pipeline, its high-water mark includes the heap use
+// carried over from the previous one
+void begin_memory_phase(MEMORY_PHASE phase) {
+  atomic_store(&memory_phase, phase);
+  raise_heap_peak(phase, atomic_load(&heap_size));
+}
+
+// Peak resident set size of the process in bytes, 0 if unknown
+size_t peak_resident_size() {
+#ifdef _WIN32
+  PROCESS_MEMORY_COUNTERS counters;
+  return GetProcessMemoryInfo(GetCurrentProcess(), &counters,
+                              sizeof(counters))
+             ? counters.PeakWorkingSetSize
+             : 0;
+#else
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return 0;
+  }
+#ifdef __APPLE__
+  return usage.ru_maxrss;
+#else
+  return (size_t)usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+// Memory model for scheduling: peak memory is a fixed base plus bytes per
+// input byte of the compression backend and of each enabled pass. Measured
+// as peak resident size of 64-bit Linux builds, except zopfli whose working
+// set is derived from its per-position structures (longest match cache,
+// LZ77 stores, cost arrays) and is bounded by its master blocks. Context
+// mixing is dominated by its model tables, see predict_peak_memory.
+// Recalibrate from the measured statistics for other builds.
+const size_t MEMORY_MODEL_BASE = 6 << 20;
+const double MEMORY_MODEL_ZLIB = 6.0;
+const double MEMORY_MODEL_ZOPFLI = 80.0;
+const size_t ZOPFLI_MASTER_BLOCK_SIZE = 1000000;
+const double MEMORY_MODEL_SEARCH = 3.0;
+const double MEMORY_MODEL_TRANSFORM = 75.0;
+const double MEMORY_MODEL_CONTEXT_MIXING = 4.0;
+const double MEMORY_MODEL_ANNEALING = 8.0;
 
 typedef struct PNG_IHDR {
   unsigned int width;
@@ -43,15 +264,144 @@ typedef struct IMAGE {
   size_t size;
   size_t width;
   size_t height;
+  // Number of payload bytes in the image
+  size_t payload_size;
+  // Unpack code matching the payload layout, NULL selects the default
+  // javascript bootstrap by image height
+  char *unpack_code;
 } IMAGE;
 
+// Binary asset packed alongside the javascript
+typedef struct SEGMENT {
+  const char *path;
+  unsigned char *data;
+  size_t size;
+} SEGMENT;
+
+// Follow-on image of two-stage loading: a bare PNG holding a payload that the
+// first stage fetches while its javascript runs, packed and compressed on its
+// own
+typedef struct STAGE {
+  const char *path;
+  char *png_path;
+  size_t size;
+  size_t width;
+  size_t height;
+  unsigned char *png;
+  size_t png_size;
+} STAGE;
+
+// PNG format hacks, each one can be switched individually
+typedef enum FORMAT_HACK {
+  FORMAT_HACK_OMIT_IEND = 1 << 0,
+  FORMAT_HACK_JAWH_CRC_OVERFLOW = 1 << 1,
+  FORMAT_HACK_OMIT_IDAT_CRC = 1 << 2,
+  FORMAT_HACK_OMIT_ADLER32 = 1 << 3,
+  FORMAT_HACK_OMIT_IHDR_CRC = 1 << 4,
+  FORMAT_HACK_ALL = (1 << 5) - 1
+} FORMAT_HACK;
+
+// Browser PNG decoders whose tolerances are modelled by the format hack
+// checker
+typedef enum PNG_DECODER {
+  PNG_DECODER_CHROMIUM = 1 << 0,
+  PNG_DECODER_FIREFOX = 1 << 1,
+  PNG_DECODER_WEBKIT = 1 << 2,
+  PNG_DECODER_ALL = (1 << 3) - 1
+} PNG_DECODER;
+
+typedef struct FORMAT_HACK_INFO {
+  unsigned int hack;
+  const char *name;
+  const char *description;
+  size_t saved_bytes;
+} FORMAT_HACK_INFO;
+
+// Additional output written from the same compressed image data, differing
+// only in chunk framing. Bare variants are plain PNG files without the
+// javascript bootstrap.
+typedef struct PNG_VARIANT {
+  const char *path;
+  unsigned int format_hacks;
+  bool bare;
+  size_t png_size;
+} PNG_VARIANT;
+
+typedef struct PNG_DECODER_INFO {
+  unsigned int decoder;
+  const char *name;
+  const char *rejection;
+  unsigned int tolerated_hacks;
+} PNG_DECODER_INFO;
+
+// Quote styles for string literals
+typedef enum QUOTE_STYLE {
+  QUOTE_STYLE_KEEP,
+  QUOTE_STYLE_SINGLE,
+  QUOTE_STYLE_DOUBLE,
+  QUOTE_STYLE_FEWEST_ESCAPES,
+  QUOTE_STYLE_COUNT
+} QUOTE_STYLE;
+
+// Formatting choices of the minifier, all of them are decided by measured
+// compressed size rather than raw length
+typedef struct MINIFY_CHOICES {
+  QUOTE_STYLE quote_style;
+  bool keyword_spacing;
+  bool short_numbers;
+  bool drop_semicolons;
+} MINIFY_CHOICES;
+
+// Parameters of the context mixing coder, tuned against the javascript
+typedef struct CM_PARAMETERS {
+  // Bit set of the context models used
+  unsigned int models;
+  // Observations after which context statistics adapt at a fixed rate
+  int count_limit;
+  int learning_rate;
+  // Mixer weights are selected by the bits seen of the current byte
+  bool mixer_context;
+} CM_PARAMETERS;
+
 typedef struct USER_OPTIONS {
-  char *javascript_path;
+  char **javascript_paths;
+  size_t javascript_path_count;
+  char **dependencies;
+  size_t dependency_count;
+  char **segment_paths;
+  size_t segment_count;
+  char **stage_paths;
+  size_t stage_count;
+  char *wasm_path;
   char *png_path;
+  PNG_VARIANT *variants;
+  size_t variant_count;
   bool no_zopfli;
   int zopfli_iterations;
   bool no_blocksplitting;
-  bool apply_format_hacks;
+  bool auto_format_hacks;
+  unsigned int format_hacks;
+  unsigned int format_hack_targets;
+  bool minify;
+  bool reorder_units;
+  int reorder_iterations;
+  bool rename_identifiers;
+  int rename_iterations;
+  bool transform;
+  bool context_mixing;
+  bool anneal_parse;
+  bool row_layout;
+  int anneal_iterations;
+  bool reoptimize;
+  int reoptimize_budget;
+  bool deterministic;
+  bool progress;
+  bool fast_path;
+  int fast_path_benchmark_runs;
+  double readback_cost;
+  const char *bootstrap_benchmark_path;
+  int thread_count;
+  bool predict_memory;
   bool no_statistics;
 } USER_OPTIONS;
 
@@ -59,6 +409,47 @@ typedef struct COMPRESSION_STATISTICS {
   size_t javascript_size;
   size_t png_size;
   bool multi_row_image;
+  size_t row_width;
+  unsigned int format_hacks;
+  const char *single_row_bootstrap;
+  char **bundle_order;
+  size_t bundle_count;
+  size_t bundle_saved_bytes;
+  bool bundle_search_truncated;
+  const char **segment_order;
+  size_t segment_count;
+  size_t segment_size;
+  size_t wasm_size;
+  STAGE *stages;
+  size_t stage_count;
+  const char *text_encoding;
+  size_t text_encoding_saved_bytes;
+  const PNG_VARIANT *variants;
+  size_t variant_count;
+  bool minified;
+  MINIFY_CHOICES minify_choices;
+  size_t minify_saved_bytes;
+  size_t reordered_units;
+  size_t reordering_saved_bytes;
+  size_t renamed_identifiers;
+  size_t renaming_saved_bytes;
+  const char *transform;
+  size_t transform_saved_bytes;
+  bool context_mixing;
+  CM_PARAMETERS context_mixing_parameters;
+  size_t context_mixing_saved_bytes;
+  double context_mixing_native_decode_time;
+  size_t annealing_saved_bytes;
+  bool cancelled;
+  bool fast_path;
+  int fast_path_runs;
+  double fast_path_p50;
+  double fast_path_p99;
+  const char *bootstrap_benchmark_path;
+  size_t input_size;
+  size_t predicted_memory;
+  size_t peak_resident_size;
+  size_t heap_peaks[MEMORY_PHASE_COUNT];
 } COMPRESSION_STATISTICS;
 
 // Command line option names
@@ -66,14 +457,55 @@ const char *NO_ZOPFLI = "--no_zopfli";
 const char *ZOPFLI_ITERATIONS = "--zopfli_iterations=";
 const char *NO_BLOCK_SPLITTING = "--no_blocksplitting";
 const char *NO_FORMAT_HACKS = "--no_format_hacks";
+const char *FORMAT_HACKS_OPTION = "--format_hacks=";
+const char *FORMAT_HACK_TARGETS = "--format_hack_targets=";
+const char *DEPENDS = "--depends=";
+const char *SEGMENT_OPTION = "--segment=";
+const char *STAGE_OPTION = "--stage=";
+const char *WASM = "--wasm=";
+const char *VARIANT = "--variant=";
+const char *MINIFY = "--minify";
+const char *REORDER_UNITS = "--reorder_units";
+const char *REORDER_ITERATIONS = "--reorder_iterations=";
+const char *RENAME_IDENTIFIERS = "--rename_identifiers";
+const char *RENAME_ITERATIONS = "--rename_iterations=";
+const char *TRANSFORM = "--transform";
+const char *CONTEXT_MIXING = "--context_mixing";
+const char *ANNEAL_PARSE = "--anneal_parse";
+const char *ROW_LAYOUT = "--row_layout";
+const char *ANNEAL_ITERATIONS = "--anneal_iterations=";
+const char *REOPTIMIZE = "--reoptimize";
+const char *REOPTIMIZE_BUDGET = "--reoptimize_budget=";
+const char *DETERMINISTIC = "--deterministic";
+const char *PROGRESS = "--progress";
+const char *FAST_PATH = "--fast_path";
+const char *FAST_PATH_BENCHMARK = "--fast_path_benchmark=";
+const char *READBACK_COST = "--readback_cost=";
+const char *BOOTSTRAP_BENCHMARK = "--bootstrap_benchmark=";
+const char *THREADS = "--threads=";
+const char *PREDICT_MEMORY = "--predict_memory";
 const char *NO_STATISTICS = "--no_statistics";
 
+const char *QUOTE_STYLE_NAMES[] = {"keep", "single", "double",
+                                   "fewest escapes"};
+
 const unsigned char PNG_HEADER[] = {0x89, 0x50, 0x4e, 0x47,
                                     0x0d, 0x0a, 0x1a, 0x0a};
 
 // Javascript code fits on a single row in the PNG
 const int SINGLE_ROW_MAX_LENGTH = 4096;
 
+// Canvas height unless set explicitly
+const size_t DEFAULT_CANVAS_HEIGHT = 150;
+
+// Largest canvas area of all browsers (Safari), canvases of taller images are
+// limited to this area and the image is read in tiles
+const size_t MAX_CANVAS_AREA = 16777216;
+
+// Largest canvas dimension of all browsers, taller images are not decoded
+// reliably
+const size_t MAX_IMAGE_HEIGHT = 32767;
+
 // p01's single-pixel-row bootstrap (requires an 0x00 end marker on the js
 // string) (edit by Gasman: move drawImage out of getImageData params (it
 // returns undef, which is invalid) and change eval to (1,eval) to force global
@@ -84,363 +516,8223 @@ const char *SINGLE_ROW_IMAGE_HTML_UNPACK =
     "getImageData(0,0,1,1).data[0];)e+=String.fromCharCode(t);(1,eval)(e) "
     "src=#>";
 
+// Single-row bootstrap with one readback (based on p01's single-pixel-row
+// bootstrap): sets the canvas width to the row width, draws the image once
+// and reads the whole row with a single getImageData instead of one per
+// byte (requires an 0x00 end marker on the js string, takes the row width)
+const char *SINGLE_ROW_READBACK_IMAGE_HTML_UNPACK =
+    "<canvas id=c><img "
+    "onload=for(w=c.width=%u,a=c.getContext('2d'),a.drawImage(this,p=0,0),"
+    "e='',d=a.getImageData(0,0,w,1).data;t=d[p];p+=4)e+=String.fromCharCode("
+    "t);(1,eval)(e) src=#>";
+
 // p01's multiple-pixel-row bootstrap (requires a dummy first byte on the js
-// string) (edit by Gasman: set explicit canvas width to support widths above
-// 300; move drawImage out of getImageData params; change eval to (1,eval) to
-// force global evaluation)
+// string, takes the row width and height) (edit by Gasman: set explicit
+// canvas width to support widths above 300; move drawImage out of
+// getImageData params; change eval to (1,eval) to force global evaluation)
 const char *MULTI_ROW_IMAGE_HTML_UNPACK =
     "<canvas id=c><img "
-    "onload=for(w=c.width=4096,a=c.getContext('2d'),a.drawImage(this,p=0,0),"
+    "onload=for(w=c.width=%u,a=c.getContext('2d'),a.drawImage(this,p=0,0),"
     "e='"
     "',d=a.getImageData(0,0,w,%u).data;t=d[p+=4];)e+=String.fromCharCode(t);"
     "(1,"
     "eval)(e) src=#>";
 
-char *read_text_file(const char *file_path) {
-  char *text = NULL;
-  FILE *file = fopen(file_path, "rt");
-
-  if (file != NULL) {
-    fseek(file, 0, SEEK_END);
-    size_t size = ftell(file);
-    rewind(file);
-
-    // Add an additional byte for null terminating the string
-    text = calloc(size + 1, 1);
-
-    if (fread(text, 1, size, file) != size) {
-      printf("Failed to read source file '%s'\n", file_path);
-      free(text);
-      text = NULL;
-    }
-
-    fclose(file);
-  } else {
-    printf("Failed to open javascript source file '%s'\n", file_path);
-  }
+// Multiple-pixel-row bootstrap with binary segments (based on p01's
+// multiple-pixel-row bootstrap): after reading the javascript up to its \0
+// end marker, the following pixels are copied into one Uint8Array per segment
+// without string conversion. Segment sizes are given in layout order and
+// stored in S by their index. Written without spaces and '>' to stay a valid
+// unquoted attribute value.
+const char *SEGMENTS_IMAGE_HTML_UNPACK =
+    "<canvas id=c><img "
+    "onload=for(w=c.width=%u,a=c.getContext('2d'),a.drawImage(this,p=0,0),"
+    "e='"
+    "',d=a.getImageData(0,0,w,%u).data;t=d[p+=4];)e+=String.fromCharCode(t);"
+    "for(S=[],k=0;n=[%s][k];S[[%s][k++]]=z)for(z=new(Uint8Array)(n),i=0;i<n;)"
+    "z[i++]=d[p+=4];(1,"
+    "eval)(e) src=#>";
 
-  return text;
-}
+// Multiple-pixel-row bootstrap for payloads of known size (based on p01's
+// multiple-pixel-row bootstrap): the reader stores the given number of bytes
+// in the array b, the decode code turns them into the javascript e
+const char *PAYLOAD_IMAGE_HTML_UNPACK =
+    "<canvas id=c><img onload=%s%s(1,eval)(e)%s src=#>";
 
-IMAGE *embbed_javascript_in_image(
-    char *javascript, COMPRESSION_STATISTICS *compression_statistics) {
-  // Get string length of our javascript source
-  size_t javascript_length = strlen(javascript);
-  compression_statistics->javascript_size = javascript_length;
+// Payload reader for images up to the default canvas height
+const char *PAYLOAD_READER =
+    "for(w=c.width=%u,a=c.getContext('2d'),a.drawImage(this,p=0,0),d=a."
+    "getImageData(0,0,w,%u).data,b=[];b.length<%lu;)b.push(d[p+=4]);";
 
-  // Create our image
-  IMAGE *image = malloc(sizeof(IMAGE));
+// Payload reader for taller images: draws tiles of the given number of rows
+// at exact row offsets and stitches their pixels together
+const char *TILED_PAYLOAD_READER =
+    "for(w=c.width=%u,h=c.height=%u,a=c.getContext('2d'),b=[],y=0;b.length<"
+    "%lu;y+=h)for(a.drawImage(this,0,-y),d=a.getImageData(0,0,w,h).data,p=y?-"
+    "4:0;b.length<%lu&&(p+=4)<d.length;)b.push(d[p]);";
 
-  // Javascript source either fits on a single image row or needs multiple rows
-  if (javascript_length < SINGLE_ROW_MAX_LENGTH) {
-    // Size of single row in the image is length of javascript + 1 byte for
-    // dummy marker added at the end
-    image->width = javascript_length + 1;
-    image->height = 1;
+// Decode code for plain javascript payloads
+const char *JAVASCRIPT_DECODE_CODE =
+    "for(e='',i=0;i<b.length;)e+=String.fromCharCode(b[i++]);";
 
-    // Image data size is it's width plus 1 byte for 'no filtering' indicator
-    // at the beginning of the row
-    image->size = image->width + 1;
-    image->data = calloc(image->size, 1);
+// Decode code for UTF-8 payloads, byte-wise decoding would garble non-ASCII
+// text
+const char *UTF8_DECODE_CODE =
+    "e=new(TextDecoder)().decode(new(Uint8Array)(b));";
 
-    // Copy javascript string into destination buffer, account for 'no
-    // filtering' \0 indicator at begin of row
-    memcpy(image->data + 1, javascript, javascript_length);
+// Decode code for payloads with binary segments, see
+// SEGMENTS_IMAGE_HTML_UNPACK
+const char *SEGMENTS_DECODE_CODE =
+    "for(e='',p=0;t=b[p++];)e+=String.fromCharCode(t);for(S=[],k=0;n=[%s][k];"
+    "S[[%s][k++]]=z)for(z=new(Uint8Array)(n),i=0;i<n;)z[i++]=b[p++];";
 
-    // Dummy marker \0 at end of javascript string (required by unpacking) is
-    // already there due to calloc
-  } else {
-    // Multi row image has maximum row width
-    image->width = SINGLE_ROW_MAX_LENGTH;
+// Decode code for WebAssembly payloads: the javascript glue up to its \0 end
+// marker, followed by the module bytes. The glue is evaluated inside a
+// function that receives the module bytes, so the glue's globals can not
+// replace them.
+const char *WASM_DECODE_CODE =
+    "for(e='',p=0;t=b[p++];)e+=String.fromCharCode(t);(function(z){";
 
-    // Account for dummy byte required by unpacking to calculate number of rows
-    image->height = (size_t)ceil((javascript_length + 1) /
-                                 (float)SINGLE_ROW_MAX_LENGTH);
+// Runs after the glue: instantiates the module with the imports in I, if the
+// glue defined them, stores the instance in W and passes it to R, if the glue
+// defined it. Closes the function of WASM_DECODE_CODE and calls it with the
+// module bytes.
+const char *WASM_START_CODE =
+    ";WebAssembly.instantiate(z,self.I).then(function(r){W=r.instance;self.R?"
+    "R(W):0})})(new(Uint8Array)(b.slice(p)))";
 
-    // Full data size includes 1 byte 'no filtering' indicator per row
-    image->size = ((image->width) + 1) * (image->height);
-    image->data = calloc(image->size, 1);
+// Catalogue of format hacks. Saved bytes are fixed per hack because each one
+// drops a CRC32, an Adler-32 or a whole (empty) chunk.
+const FORMAT_HACK_INFO FORMAT_HACK_CATALOGUE[] = {
+    {FORMAT_HACK_OMIT_IEND, "iend", "omit IEND chunk", 12},
+    {FORMAT_HACK_JAWH_CRC_OVERFLOW, "jawh_crc",
+     "custom chunk overflowing in CRC32", 4},
+    {FORMAT_HACK_OMIT_IDAT_CRC, "idat_crc", "IDAT chunk w/o CRC32", 4},
+    {FORMAT_HACK_OMIT_ADLER32, "adler32", "zlib stream w/o Adler-32", 4},
+    {FORMAT_HACK_OMIT_IHDR_CRC, "ihdr_crc", "IHDR chunk w/o CRC32", 4}};
 
-    // Start at byte 2 of first row because of 'no filtering' \0 indicator
-    // and dummy byte \0 for unpacking
-    unsigned char *image_ptr = image->data + 2;
+// Decoding tolerances of the major browser PNG decoders. All of them decode
+// progressively and hand out rows as soon as they are inflated, so a file
+// that is truncated after the last row still displays fine.
+//
+// Rules per hack:
+// - iend: Missing IEND is treated like a truncated download. Tolerated by all.
+// - jawh_crc: CRC errors in ancillary chunks only discard the chunk (libpng
+//   default for ancillary chunks, Blink and WebKit skip unknown chunks).
+//   Tolerated by all.
+// - idat_crc: A missing IDAT CRC is only harmless if IDAT is the final chunk
+//   of the file, the CRC is then read as truncation. Tolerated by all.
+// - adler32: Chromium and Firefox set PNG_IGNORE_ADLER32 on libpng, the
+//   trailing Adler-32 is never checked. WebKit on Apple platforms decodes via
+//   ImageIO whose handling is undocumented, hence not tolerated.
+// - ihdr_crc: IHDR is a critical chunk, a missing CRC shifts every following
+//   chunk by 4 bytes. Not tolerated by any decoder.
+const PNG_DECODER_INFO PNG_DECODER_CATALOGUE[] = {
+    {PNG_DECODER_CHROMIUM, "chromium", "not decodable by chromium",
+     FORMAT_HACK_OMIT_IEND | FORMAT_HACK_JAWH_CRC_OVERFLOW |
+         FORMAT_HACK_OMIT_IDAT_CRC | FORMAT_HACK_OMIT_ADLER32},
+    {PNG_DECODER_FIREFOX, "firefox", "not decodable by firefox",
+     FORMAT_HACK_OMIT_IEND | FORMAT_HACK_JAWH_CRC_OVERFLOW |
+         FORMAT_HACK_OMIT_IDAT_CRC | FORMAT_HACK_OMIT_ADLER32},
+    {PNG_DECODER_WEBKIT, "webkit", "not decodable by webkit",
+     FORMAT_HACK_OMIT_IEND | FORMAT_HACK_JAWH_CRC_OVERFLOW |
+         FORMAT_HACK_OMIT_IDAT_CRC}};
 
-    // Handle each row separately
-    for (size_t i = 0; i < javascript_length;) {
-      // Dummy byte for unpacking in first row was already "written", so
-      // width of first row is - 1 Length of last row is only the remaining
-      // bytes available in source data (the rest is already padded with \0)
-      size_t row_length =
-          min(javascript_length - i,
-              (i == 0 ? SINGLE_ROW_MAX_LENGTH - 1 : SINGLE_ROW_MAX_LENGTH));
+const size_t FORMAT_HACK_COUNT =
+    sizeof(FORMAT_HACK_CATALOGUE) / sizeof(FORMAT_HACK_INFO);
+const size_t PNG_DECODER_COUNT =
+    sizeof(PNG_DECODER_CATALOGUE) / sizeof(PNG_DECODER_INFO);
 
-      // Copy the full row from source to destination
-      memcpy(image_ptr, javascript + i, row_length);
+// Checks a combination of format hacks against the modelled decoders. Returns
+// false and a reason if any targeted decoder would fail to decode the image.
+bool check_format_hacks(unsigned int format_hacks, unsigned int targets,
+                        const char **reason) {
+  // Structural rules, independent of the decoder: dropped trailing bytes must
+  // be at the very end of the file so that they read as truncation
+  if ((format_hacks & FORMAT_HACK_OMIT_IDAT_CRC) &&
+      !(format_hacks & FORMAT_HACK_OMIT_IEND)) {
+    *reason = "idat_crc requires iend (IDAT must be the final chunk)";
+    return false;
+  }
 
-      // Walk source data in row size increments
-      i += row_length;
+  if ((format_hacks & FORMAT_HACK_OMIT_ADLER32) &&
+      !(format_hacks & FORMAT_HACK_OMIT_IDAT_CRC)) {
+    *reason = "adler32 requires idat_crc (stream must end with the file)";
+    return false;
+  }
 
-      // Destination data pointer increment accounts for additional byte
-      // from 'no filtering' indicator
-      image_ptr += row_length + 1;
+  for (size_t i = 0; i < PNG_DECODER_COUNT; i++) {
+    const PNG_DECODER_INFO *decoder = &PNG_DECODER_CATALOGUE[i];
+    if ((targets & decoder->decoder) &&
+        (format_hacks & ~decoder->tolerated_hacks)) {
+      *reason = decoder->rejection;
+      return false;
     }
   }
 
-  return image;
+  *reason = NULL;
+  return true;
 }
 
-bool write_png_chunk(char *chunk_identifier, unsigned char *data,
-                    size_t data_size, FILE *outfile, bool no_crc,
-                    bool overflow_data_in_crc) {
-  // Write data size
-  uint32_t data_size_out = htonl(data_size - (overflow_data_in_crc ? 4 : 0));
-  if (fwrite(&data_size_out, 1, 4, outfile) != 4) {
-    return false;
+size_t format_hacks_saved_bytes(unsigned int format_hacks) {
+  size_t saved_bytes = 0;
+  for (size_t i = 0; i < FORMAT_HACK_COUNT; i++) {
+    if (format_hacks & FORMAT_HACK_CATALOGUE[i].hack) {
+      saved_bytes += FORMAT_HACK_CATALOGUE[i].saved_bytes;
+    }
   }
+  return saved_bytes;
+}
 
-  // Write chunk identifier
-  if (fwrite(chunk_identifier, 1, 4, outfile) != 4) {
-    return false;
+// Returns the combination of format hacks that saves the most bytes while
+// being decodable by all targeted decoders
+unsigned int select_safe_format_hacks(unsigned int targets) {
+  unsigned int best_hacks = 0;
+  for (unsigned int hacks = 1; hacks <= FORMAT_HACK_ALL; hacks++) {
+    const char *reason;
+    if (check_format_hacks(hacks, targets, &reason) &&
+        format_hacks_saved_bytes(hacks) >
+            format_hacks_saved_bytes(best_hacks)) {
+      best_hacks = hacks;
+    }
   }
+  return best_hacks;
+}
 
-  // Write actual data (can be null)
-  if (fwrite(data, 1, data_size, outfile) != data_size) {
-    return false;
+// Parses a comma separated list of format hack names into a bit mask.
+// Returns false on unknown names.
+bool parse_format_hacks(const char *list, unsigned int *format_hacks) {
+  *format_hacks = 0;
+  for (size_t length; *list != '\0'; list += length + (list[length] == ',')) {
+    length = strcspn(list, ",");
+    size_t i = 0;
+    while (i < FORMAT_HACK_COUNT &&
+           !(strlen(FORMAT_HACK_CATALOGUE[i].name) == length &&
+             strncmp(FORMAT_HACK_CATALOGUE[i].name, list, length) == 0)) {
+      i++;
+    }
+    if (i == FORMAT_HACK_COUNT) {
+      return false;
+    }
+    *format_hacks |= FORMAT_HACK_CATALOGUE[i].hack;
   }
+  return true;
+}
 
-  if (!no_crc) {
-    // Allocate our CRC32 buffer which contains chunk identifier + data
-    unsigned char *crc_buffer = malloc(4 + data_size);
-
-    // Copy chunk identifier and data into CRC32 buffer
-    memcpy(crc_buffer, chunk_identifier, 4);
-    memcpy(crc_buffer + 4, data, data_size);
-
-    // Calculate CRC32
-    unsigned long crc = crc32(0L, crc_buffer, 4 + data_size);
-
-    // Write CRC32 to file
-    uint32_t crc_out = htonl(crc);
-    if (fwrite(&crc_out, 1, 4, outfile) != 4) {
-      free(crc_buffer);
+// Parses a comma separated list of decoder names into a bit mask. Returns
+// false on unknown names.
+bool parse_png_decoders(const char *list, unsigned int *decoders) {
+  *decoders = 0;
+  for (size_t length; *list != '\0'; list += length + (list[length] == ',')) {
+    length = strcspn(list, ",");
+    size_t i = 0;
+    while (i < PNG_DECODER_COUNT &&
+           !(strlen(PNG_DECODER_CATALOGUE[i].name) == length &&
+             strncmp(PNG_DECODER_CATALOGUE[i].name, list, length) == 0)) {
+      i++;
+    }
+    if (i == PNG_DECODER_COUNT) {
       return false;
     }
-
-    free(crc_buffer);
+    *decoders |= PNG_DECODER_CATALOGUE[i].decoder;
   }
-
   return true;
 }
 
-bool write_image_as_png(IMAGE *image, USER_OPTIONS *user_options,
-                       COMPRESSION_STATISTICS *compression_statistics) {
-  FILE *outfile = fopen(user_options->png_path, "wb+");
-  if (outfile == NULL) {
-    printf("Failed to open destination png file '%s'\n",
-           user_options->png_path);
+// Parses a variant given as [flavour]:[file], the flavour being a comma
+// separated list of format hack names, 'safe' for the largest safe set,
+// 'none' and 'bare' for a plain PNG. Returns false on unknown names.
+bool parse_png_variant(const char *argument, unsigned int targets,
+                       PNG_VARIANT *variant) {
+  const char *separator = strchr(argument, ':');
+  if (separator == NULL || separator[1] == '\0') {
     return false;
   }
+  memset(variant, 0, sizeof(PNG_VARIANT));
+  variant->path = separator + 1;
 
-  // Write PNG header
-  if (fwrite(PNG_HEADER, 1, sizeof(PNG_HEADER), outfile) != sizeof(PNG_HEADER)) {
-    printf("Failed to write destination png file '%s' (PNG header)\n",
-           user_options->png_path);
-    fclose(outfile);
-    return false;
-  }
+  for (size_t length; argument < separator;
+       argument += length + (argument[length] == ',')) {
+    length = strcspn(argument, ",:");
+    char name[16] = {0};
+    if (length >= sizeof(name)) {
+      return false;
+    }
+    memcpy(name, argument, length);
 
-  // Write image header (IHDR) chunk
-  PNG_IHDR png_ihdr = {
-      htonl(image->width), htonl(image->height), 8, 0, 0, 0, 0};
-  if (!write_png_chunk("IHDR", (unsigned char *)&png_ihdr,
-                      2 * sizeof(unsigned int) + 5, outfile, false, false)) {
-    printf("Failed to write destination png file '%s' (IHDR)\n",
-           user_options->png_path);
-    fclose(outfile);
-    return false;
+    unsigned int format_hack = 0;
+    if (strcmp(name, "bare") == 0) {
+      variant->bare = true;
+    } else if (strcmp(name, "safe") == 0) {
+      variant->format_hacks |= select_safe_format_hacks(targets);
+    } else if (strcmp(name, "none") != 0 &&
+               !parse_format_hacks(name, &format_hack)) {
+      return false;
+    }
+    variant->format_hacks |= format_hack;
   }
 
-  // Prepare unpack code
-  char *unpack_code = NULL;
-  if (image->height == 1) {
-    // Unpack code for single row image can be stored as is
-    unpack_code = (char *)SINGLE_ROW_IMAGE_HTML_UNPACK;
-    compression_statistics->multi_row_image = false;
-  } else {
-    // Height of multi row image needs to be substituted in the unpack code
-    size_t max_unpack_code_length = strlen(MULTI_ROW_IMAGE_HTML_UNPACK) + 4;
-    unpack_code = malloc(max_unpack_code_length);
-    snprintf(unpack_code, max_unpack_code_length, MULTI_ROW_IMAGE_HTML_UNPACK,
-             image->height);
-    compression_statistics->multi_row_image = true;
+  // Bare files have no custom chunk to overflow
+  if (variant->bare) {
+    variant->format_hacks &= ~FORMAT_HACK_JAWH_CRC_OVERFLOW;
   }
+  return true;
+}
 
-  // Write custom chunk with unpack code
-  if (!write_png_chunk("jawh", (unsigned char *)unpack_code, strlen(unpack_code),
-                      outfile, user_options->apply_format_hacks,
-                      user_options->apply_format_hacks)) {
-    printf("Failed to write destination png file '%s' (custom chunk)\n",
-           user_options->png_path);
-    fclose(outfile);
-    return false;
+// Decodes one UTF-8 sequence. Returns its length, or 0 if it is invalid,
+// overlong or encodes a surrogate.
+size_t decode_utf8(const unsigned char *text, uint32_t *code_point) {
+  static const uint32_t MIN_CODE_POINTS[] = {0, 0, 0x80, 0x800, 0x10000};
+  size_t length = text[0] < 0x80   ? 1
+                  : text[0] < 0xc0 ? 0
+                  : text[0] < 0xe0 ? 2
+                  : text[0] < 0xf0 ? 3
+                  : text[0] < 0xf8 ? 4
+                                   : 0;
+  if (length <= 1) {
+    *code_point = text[0];
+    return length;
   }
 
-  if (image->height > 1) {
-    free(unpack_code);
+  *code_point = text[0] & (0x7f >> length);
+  for (size_t i = 1; i < length; i++) {
+    if ((text[i] & 0xc0) != 0x80) {
+      return 0;
+    }
+    *code_point = (*code_point << 6) | (text[i] & 0x3f);
+  }
+  if (*code_point < MIN_CODE_POINTS[length] || *code_point > 0x10ffff ||
+      (*code_point >= 0xd800 && *code_point < 0xe000)) {
+    return 0;
   }
+  return length;
+}
 
-  unsigned long compressed_data_size = 0;
-  unsigned char *compressed_data = NULL;
-  if (!user_options->no_zopfli) {
-    // Zopfli
-    ZopfliOptions zopfli_options;
-    ZopfliInitOptions(&zopfli_options);
-    zopfli_options.numiterations = user_options->zopfli_iterations;
-    zopfli_options.blocksplitting = !user_options->no_blocksplitting;
-    ZopfliCompress(&zopfli_options, ZOPFLI_FORMAT_ZLIB, image->data,
-                   image->size, &compressed_data, &compressed_data_size);
-  } else {
-    // ZLIB deflate
-    compressed_data_size = compressBound(image->size);
-    compressed_data = malloc(compressed_data_size);
-    if (compress2(compressed_data, &compressed_data_size, image->data,
-                  image->size, 9 /* level */) != Z_OK) {
-      printf("Failed to deflate image data\n");
-      free(compressed_data);
-      fclose(outfile);
+bool is_ascii(const char *text) {
+  for (; *text != '\0'; text++) {
+    if ((unsigned char)*text >= 0x80) {
       return false;
     }
   }
+  return true;
+}
 
-  if (!write_png_chunk("IDAT", compressed_data, compressed_data_size, outfile,
-                      user_options->apply_format_hacks,
-                      false)) {
-    printf("Failed to write destination png file '%s' (IDAT)\n",
-           user_options->png_path);
-    free(compressed_data);
-    fclose(outfile);
-    return false;
-  }
-
-  free(compressed_data);
-
-  if (!user_options->apply_format_hacks) {
-    // Write end (IEND) chunk
-    if (!write_png_chunk("IEND", NULL, 0, outfile, false, false)) {
-      printf("Failed to write destination png file '%s' (IEND)\n",
-             user_options->png_path);
-      fclose(outfile);
+bool is_valid_utf8(const char *text) {
+  uint32_t code_point;
+  for (size_t length; *text != '\0'; text += length) {
+    length = decode_utf8((const unsigned char *)text, &code_point);
+    if (length == 0) {
       return false;
     }
   }
+  return true;
+}
 
-  compression_statistics->png_size = ftell(outfile);
+// Lays out a payload in rows of the given width after the dummy byte
+// required by unpacking. Returns the image data, which is padded with \0.
+unsigned char *layout_rows(const unsigned char *payload, size_t length,
+                           size_t width, size_t *height) {
+  // Account for dummy byte required by unpacking to calculate number of rows,
+  // in integers as floats lose precision for large payloads
+  *height = (length + width) / width;
 
-  fclose(outfile);
+  // Full data size includes 1 byte 'no filtering' indicator per row
+  unsigned char *data = counted_calloc((width + 1) * *height, 1);
 
-  return true;
-}
+  // Start at byte 2 of first row because of 'no filtering' \0 indicator
+  // and dummy byte \0 for unpacking
+  unsigned char *data_ptr = data + 2;
 
-void print_compression_statistics(
-    COMPRESSION_STATISTICS *compression_statistics) {
-  printf("Embedded image has %s\n", compression_statistics->multi_row_image
-                                        ? "multiple rows"
-                                        : "single row");
-  printf("Input Javascript size: %lu bytes\n",
-         compression_statistics->javascript_size);
-  printf("Output PNG file size: %li bytes\n", compression_statistics->png_size);
-  printf("PNG is %3.2f percent of javascript\n",
-         compression_statistics->png_size /
-             (float)compression_statistics->javascript_size * 100.0f);
+  // Handle each row separately
+  for (size_t i = 0; i < length;) {
+    // Dummy byte for unpacking in first row was already "written", so
+    // width of first row is - 1 Length of last row is only the remaining
+    // bytes available in source data (the rest is already padded with \0)
+    size_t row_length = min(length - i, (i == 0 ? width - 1 : width));
+
+    // Copy the full row from source to destination
+    memcpy(data_ptr, payload + i, row_length);
+
+    // Walk source data in row size increments
+    i += row_length;
+
+    // Destination data pointer increment accounts for additional byte
+    // from 'no filtering' indicator
+    data_ptr += row_length + 1;
+  }
+
+  return data;
 }
 
-void print_usage_information() {
-  printf("Usage: zopfli-pnginator [options] infile.js outfile.png.html\n");
-  printf("\n");
-  printf("Options:\n");
-  printf("%s: Use standard zlib deflate instead of zopfli.\n", NO_ZOPFLI);
-  printf("%s[number]: Number of zopfli iterations. More ", ZOPFLI_ITERATIONS);
-  printf("iterations take\n  more time but can provide slightly better ");
-  printf("compression. Default is 10.\n");
-  printf("%s: Do not use block splitting.\n", NO_BLOCK_SPLITTING);
-  printf("%s: Do not apply PNG format hacks (omit IEND ", NO_FORMAT_HACKS);
-  printf("chunk, custom chunk\n  overflowing in CRC32, IDAT chunk w/o ");
-  printf("CRC32).\n");
-  printf("%s: Do not show statistics.\n", NO_STATISTICS);
+// Bits a row boundary costs when it falls into a match, which is split in
+// two. Matches whose distance is a multiple of the row width are split the
+// same way at their source and stay intact.
+const size_t ROW_BOUNDARY_MATCH_BITS = 20;
+
+// Bits of the 'no filtering' indicator starting each row
+const size_t ROW_FILTER_BYTE_BITS = 9;
+
+// Narrowest row width the layout optimizer tries
+const size_t MIN_ROW_WIDTH = 2048;
+
+// Row widths with the cheapest boundaries that are compressed to pick one
+const size_t ROW_WIDTH_CANDIDATES = 8;
+
+size_t count_digits(size_t value) {
+  size_t digits = 1;
+  for (; value >= 10; value /= 10) {
+    digits++;
+  }
+  return digits;
 }
 
-void process_command_line(USER_OPTIONS *user_options, int argc, char *argv[]) {
-  if (argc < 3) {
-    print_usage_information();
-    return;
+// Greedy LZ77 matches of the payload (hash chains over 3 byte prefixes). For
+// each position stores the start and distance of the match covering it,
+// literals and match starts are their own start.
+void find_payload_matches(const unsigned char *payload, size_t length,
+                          size_t *match_starts, uint16_t *match_distances) {
+  const size_t hash_size = 1 << 15;
+  size_t *heads = counted_malloc(sizeof(size_t) * hash_size);
+  size_t *previous = counted_malloc(sizeof(size_t) * (length + 1));
+  for (size_t i = 0; i < hash_size; i++) {
+    heads[i] = SIZE_MAX;
   }
 
-  for (int i = 1; i < argc; i++) {
-    if (strncmp(argv[i], NO_ZOPFLI, strlen(NO_ZOPFLI)) == 0) {
-      user_options->no_zopfli = true;
-      continue;
+  for (size_t i = 0; i < length;) {
+    size_t best_length = 0;
+    size_t best_distance = 0;
+    if (i + 3 <= length) {
+      size_t hash =
+          ((payload[i] << 10) ^ (payload[i + 1] << 5) ^ payload[i + 2]) &
+          (hash_size - 1);
+      size_t max_length = min(length - i, (size_t)258);
+      size_t chain = 0;
+      for (size_t candidate = heads[hash];
+           candidate != SIZE_MAX && i - candidate <= 32768 && chain < 64;
+           candidate = previous[candidate], chain++) {
+        size_t match_length = 0;
+        while (match_length < max_length &&
+               payload[candidate + match_length] == payload[i + match_length]) {
+          match_length++;
+        }
+        if (match_length > best_length) {
+          best_length = match_length;
+          best_distance = i - candidate;
+        }
+      }
+      previous[i] = heads[hash];
+      heads[hash] = i;
     }
 
-    if (strncmp(argv[i], ZOPFLI_ITERATIONS, strlen(ZOPFLI_ITERATIONS)) == 0) {
-      char iterations[strlen(argv[i]) - strlen(ZOPFLI_ITERATIONS)];
-      strncpy(iterations, argv[i] + strlen(ZOPFLI_ITERATIONS),
-              sizeof(iterations));
-      user_options->zopfli_iterations = atoi(iterations);
-      continue;
+    if (best_length < 3) {
+      best_length = 1;
+      best_distance = 0;
     }
-
-    if (strncmp(argv[i], NO_BLOCK_SPLITTING, strlen(NO_BLOCK_SPLITTING)) == 0) {
-      user_options->no_blocksplitting = true;
-      continue;
+    for (size_t j = i; j < i + best_length; j++) {
+      match_starts[j] = i;
+      match_distances[j] = best_distance;
     }
 
-    if (strncmp(argv[i], NO_FORMAT_HACKS, strlen(NO_FORMAT_HACKS)) == 0) {
-      user_options->apply_format_hacks = false;
-      continue;
+    // Positions inside the match are hashed too, so that later matches find
+    // them
+    for (size_t j = i + 1; j < i + best_length && j + 3 <= length; j++) {
+      size_t hash =
+          ((payload[j] << 10) ^ (payload[j + 1] << 5) ^ payload[j + 2]) &
+          (hash_size - 1);
+      previous[j] = heads[hash];
+      heads[hash] = j;
     }
+    i += best_length;
+  }
 
-    if (strncmp(argv[i], NO_STATISTICS, strlen(NO_STATISTICS)) == 0) {
-      user_options->no_statistics = true;
-      continue;
-    }
+  counted_free(previous);
+  counted_free(heads);
+}
 
-    if (user_options->javascript_path == NULL) {
-      user_options->javascript_path = argv[i];
-    } else {
-      user_options->png_path = argv[i];
+// Estimated bits a row width adds: matches split by row boundaries, the
+// filter bytes and the digits of width and height in the unpack code
+size_t row_width_cost(const size_t *match_starts,
+                      const uint16_t *match_distances, size_t length,
+                      size_t width) {
+  size_t height = (length + width) / width;
+  size_t bits = height * ROW_FILTER_BYTE_BITS +
+                8 * (count_digits(width) + count_digits(height));
+
+  // Row k starts with payload byte k * width - 1 because of the dummy byte
+  for (size_t boundary = width - 1; boundary < length; boundary += width) {
+    if (match_starts[boundary] < boundary &&
+        match_distances[boundary] % width != 0) {
+      bits += ROW_BOUNDARY_MATCH_BITS;
     }
   }
+  return bits;
 }
 
-int main(int argc, char *argv[]) {
-  printf("zopfli-pnginator\n\n");
+// Compressed size of the rows (zlib at maximum level) plus the digits of
+// width and height in the unpack code
+size_t compressed_rows_size(const unsigned char *payload, size_t length,
+                            size_t width) {
+  size_t height = 0;
+  unsigned char *data = layout_rows(payload, length, width, &height);
+  uLongf compressed_size = compressBound((width + 1) * height);
+  unsigned char *compressed = counted_malloc(compressed_size);
+  if (zlib_compress(compressed, &compressed_size, data, (width + 1) * height,
+                    9 /* level */) != Z_OK) {
+    compressed_size = SIZE_MAX / 2;
+  }
+  counted_free(compressed);
+  counted_free(data);
+  return compressed_size + count_digits(width) + count_digits(height);
+}
 
-  USER_OPTIONS user_options = {NULL, NULL, false, 10, false, true, false};
+// Chooses the row width of a multi row image so that row boundaries fall
+// between matches. Widths are ranked by the matches their boundaries split,
+// the best ones are compressed against the maximum width. Taller images must
+// not change to the tiled bootstrap or exceed the image height limit.
+size_t select_row_width(const unsigned char *payload, size_t length) {
+  size_t default_height =
+      (length + SINGLE_ROW_MAX_LENGTH) / SINGLE_ROW_MAX_LENGTH;
+  if (default_height < 2) {
+    return SINGLE_ROW_MAX_LENGTH;
+  }
+
+  size_t *match_starts = counted_malloc(sizeof(size_t) * length);
+  uint16_t *match_distances = counted_malloc(sizeof(uint16_t) * length);
+  find_payload_matches(payload, length, match_starts, match_distances);
+
+  // Cheapest widths in ascending order of cost
+  size_t *candidates = counted_malloc(sizeof(size_t) * ROW_WIDTH_CANDIDATES);
+  size_t *costs = counted_malloc(sizeof(size_t) * ROW_WIDTH_CANDIDATES);
+  size_t candidate_count = 0;
+  for (size_t width = MIN_ROW_WIDTH; width < (size_t)SINGLE_ROW_MAX_LENGTH;
+       width++) {
+    size_t height = (length + width) / width;
+    if (height > MAX_IMAGE_HEIGHT ||
+        (height > DEFAULT_CANVAS_HEIGHT) !=
+            (default_height > DEFAULT_CANVAS_HEIGHT)) {
+      continue;
+    }
+
+    size_t cost =
+        row_width_cost(match_starts, match_distances, length, width);
+    size_t position = candidate_count;
+    while (position > 0 && costs[position - 1] > cost) {
+      position--;
+    }
+    if (position == ROW_WIDTH_CANDIDATES) {
+      continue;
+    }
+    candidate_count = min(candidate_count + 1, ROW_WIDTH_CANDIDATES);
+    memmove(candidates + position + 1, candidates + position,
+            sizeof(size_t) * (candidate_count - 1 - position));
+    memmove(costs + position + 1, costs + position,
+            sizeof(size_t) * (candidate_count - 1 - position));
+    candidates[position] = width;
+    costs[position] = cost;
+  }
+  counted_free(match_distances);
+  counted_free(match_starts);
+
+  size_t best_width = SINGLE_ROW_MAX_LENGTH;
+  size_t best_size = compressed_rows_size(payload, length, best_width);
+  for (size_t i = 0; i < candidate_count; i++) {
+    size_t size = compressed_rows_size(payload, length, candidates[i]);
+    if (size < best_size) {
+      best_size = size;
+      best_width = candidates[i];
+    }
+  }
+
+  counted_free(costs);
+  counted_free(candidates);
+  return best_width;
+}
+
+// Embeds javascript (or any payload bytes) in a single row or multi row
+// image. Multi row images have the maximum row width unless the row layout
+// is optimized.
+IMAGE *embbed_data_in_image(const unsigned char *javascript,
+                            size_t javascript_length, bool multi_row,
+                            bool row_layout) {
+  // Create our image
+  IMAGE *image = counted_malloc(sizeof(IMAGE));
+  image->payload_size = javascript_length;
+  image->unpack_code = NULL;
+
+  // Javascript source either fits on a single image row or needs multiple rows
+  if (!multi_row) {
+    // Size of single row in the image is length of javascript + 1 byte for
+    // dummy marker added at the end
+    image->width = javascript_length + 1;
+    image->height = 1;
+
+    // Image data size is it's width plus 1 byte for 'no filtering' indicator
+    // at the beginning of the row
+    image->size = image->width + 1;
+    image->data = counted_calloc(image->size, 1);
+
+    // Copy javascript string into destination buffer, account for 'no
+    // filtering' \0 indicator at begin of row
+    memcpy(image->data + 1, javascript, javascript_length);
+
+    // Dummy marker \0 at end of javascript string (required by unpacking) is
+    // already there due to calloc
+  } else {
+    image->width = row_layout ? select_row_width(javascript, javascript_length)
+                              : (size_t)SINGLE_ROW_MAX_LENGTH;
+    image->data = layout_rows(javascript, javascript_length, image->width,
+                              &image->height);
+    image->size = (image->width + 1) * image->height;
+  }
+
+  return image;
+}
+
+IMAGE *embbed_javascript_in_image(
+    char *javascript, USER_OPTIONS *user_options,
+    COMPRESSION_STATISTICS *compression_statistics) {
+  // Get string length of our javascript source
+  size_t javascript_length = strlen(javascript);
+  compression_statistics->javascript_size = javascript_length;
+
+  return embbed_data_in_image((unsigned char *)javascript, javascript_length,
+                              javascript_length >= SINGLE_ROW_MAX_LENGTH,
+                              user_options->row_layout);
+}
+
+// Creates the unpack code for a multi row image whose payload is turned into
+// the javascript by the given decode code, the start code runs after it.
+// Payloads taller than the default canvas are read in tiles.
+char *create_payload_unpack_code(const IMAGE *image, const char *decode_code,
+                                 const char *start_code) {
+  const char *reader_format = PAYLOAD_READER;
+  unsigned int width = image->width;
+  unsigned int rows = image->height;
+  if (image->height > DEFAULT_CANVAS_HEIGHT) {
+    reader_format = TILED_PAYLOAD_READER;
+    rows = min(image->height, MAX_CANVAS_AREA / image->width);
+  }
+
+  size_t reader_length =
+      snprintf(NULL, 0, reader_format, width, rows, image->payload_size,
+               image->payload_size) +
+      1;
+  char *reader = counted_malloc(reader_length);
+  snprintf(reader, reader_length, reader_format, width, rows,
+           image->payload_size, image->payload_size);
+
+  size_t unpack_code_length =
+      snprintf(NULL, 0, PAYLOAD_IMAGE_HTML_UNPACK, reader, decode_code,
+               start_code) +
+      1;
+  char *unpack_code = counted_malloc(unpack_code_length);
+  snprintf(unpack_code, unpack_code_length, PAYLOAD_IMAGE_HTML_UNPACK, reader,
+           decode_code, start_code);
+  counted_free(reader);
+  return unpack_code;
+}
+
+// Creates the default javascript unpack code for an image
+char *create_unpack_code(const IMAGE *image) {
+  char *unpack_code = NULL;
+  if (image->height == 1) {
+    // Unpack code for single row image can be stored as is
+    unpack_code = counted_malloc(strlen(SINGLE_ROW_IMAGE_HTML_UNPACK) + 1);
+    strcpy(unpack_code, SINGLE_ROW_IMAGE_HTML_UNPACK);
+  } else if (image->height <= DEFAULT_CANVAS_HEIGHT) {
+    // Size of multi row image needs to be substituted in the unpack code
+    size_t max_unpack_code_length = strlen(MULTI_ROW_IMAGE_HTML_UNPACK) + 20;
+    unpack_code = counted_malloc(max_unpack_code_length);
+    snprintf(unpack_code, max_unpack_code_length, MULTI_ROW_IMAGE_HTML_UNPACK,
+             (unsigned int)image->width, (unsigned int)image->height);
+  } else {
+    // Taller images exceed the canvas and are read in tiles
+    unpack_code = create_payload_unpack_code(image, JAVASCRIPT_DECODE_CODE, "");
+  }
+  return unpack_code;
+}
+
+size_t single_row_readback_unpack_code_length(size_t width) {
+  return snprintf(NULL, 0, SINGLE_ROW_READBACK_IMAGE_HTML_UNPACK,
+                  (unsigned int)width);
+}
+
+// Single-row images take the one readback bootstrap if the canvas readbacks
+// it saves at start-up (the per-pixel bootstrap draws and reads once per
+// pixel) are worth its extra bytes, at the given cost in bytes per readback
+bool use_single_row_readback(size_t width, double readback_cost) {
+  double extra_bytes = (double)single_row_readback_unpack_code_length(width) -
+                       (double)strlen(SINGLE_ROW_IMAGE_HTML_UNPACK);
+  return (width - 1) * readback_cost >= extra_bytes;
+}
+
+// Sets the unpack code of a single-row image by the readback cost
+void select_single_row_bootstrap(
+    IMAGE *image, USER_OPTIONS *user_options,
+    COMPRESSION_STATISTICS *compression_statistics) {
+  compression_statistics->single_row_bootstrap = "per pixel";
+  if (use_single_row_readback(image->width, user_options->readback_cost)) {
+    size_t unpack_code_length =
+        single_row_readback_unpack_code_length(image->width) + 1;
+    image->unpack_code = counted_malloc(unpack_code_length);
+    snprintf(image->unpack_code, unpack_code_length,
+             SINGLE_ROW_READBACK_IMAGE_HTML_UNPACK,
+             (unsigned int)image->width);
+    compression_statistics->single_row_bootstrap = "one readback";
+  }
+}
+
+void init_zopfli_options(ZopfliOptions *zopfli_options,
+                         const USER_OPTIONS *user_options) {
+  ZopfliInitOptions(zopfli_options);
+  zopfli_options->numiterations = user_options->zopfli_iterations;
+  zopfli_options->blocksplitting = !user_options->no_blocksplitting;
+}
+
+bool compress_image(IMAGE *image, USER_OPTIONS *user_options,
+                    unsigned char **compressed_data,
+                    unsigned long *compressed_data_size) {
+  if (!user_options->no_zopfli) {
+    // Zopfli
+    ZopfliOptions zopfli_options;
+    init_zopfli_options(&zopfli_options, user_options);
+    unsigned char *zopfli_data = NULL;
+    size_t zopfli_data_size = 0;
+    ZopfliCompress(&zopfli_options, ZOPFLI_FORMAT_ZLIB, image->data,
+                   image->size, &zopfli_data, &zopfli_data_size);
+
+    // Zopfli allocates its output itself, it is moved to a counted buffer
+    *compressed_data = counted_malloc(zopfli_data_size);
+    memcpy(*compressed_data, zopfli_data, zopfli_data_size);
+    *compressed_data_size = zopfli_data_size;
+    free(zopfli_data);
+  } else {
+    // ZLIB deflate
+    *compressed_data_size = compressBound(image->size);
+    *compressed_data = counted_malloc(*compressed_data_size);
+    if (zlib_compress(*compressed_data, compressed_data_size, image->data,
+                      image->size, 9 /* level */) != Z_OK) {
+      printf("Failed to deflate image data\n");
+      counted_free(*compressed_data);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// Embeds javascript in an image and returns the compressed size of the image
+// data or 0 on failure
+size_t compressed_javascript_size(const char *javascript,
+                                  USER_OPTIONS *user_options) {
+  COMPRESSION_STATISTICS scratch_statistics;
+  IMAGE *image = embbed_javascript_in_image((char *)javascript, user_options,
+                                            &scratch_statistics);
+
+  unsigned char *compressed_data = NULL;
+  unsigned long compressed_data_size = 0;
+  bool success = compress_image(image, user_options, &compressed_data,
+                                &compressed_data_size);
+
+  counted_free(image->data);
+  counted_free(image);
+
+  if (!success) {
+    return 0;
+  }
+
+  counted_free(compressed_data);
+  return compressed_data_size;
+}
+
+int get_processor_count() {
+#ifdef _WIN32
+  SYSTEM_INFO system_info;
+  GetSystemInfo(&system_info);
+  return (int)system_info.dwNumberOfProcessors;
+#else
+  long processor_count = sysconf(_SC_NPROCESSORS_ONLN);
+  return processor_count > 0 ? (int)processor_count : 1;
+#endif
+}
+
+typedef struct PARALLEL_JOBS {
+  void (*run)(void *job);
+  unsigned char *jobs;
+  size_t job_size;
+  size_t job_count;
+  atomic_size_t next_job;
+} PARALLEL_JOBS;
+
+int parallel_worker(void *argument) {
+  PARALLEL_JOBS *parallel_jobs = argument;
+
+  // Workers pull jobs until none are left, so job order does not depend on
+  // the number of threads
+  for (size_t i; (i = atomic_fetch_add(&parallel_jobs->next_job, 1)) <
+                 parallel_jobs->job_count;) {
+    parallel_jobs->run(parallel_jobs->jobs + i * parallel_jobs->job_size);
+  }
+
+  return 0;
+}
+
+// Runs an array of jobs on the given number of threads, the calling thread
+// being one of them
+void run_parallel(void (*run)(void *job), void *jobs, size_t job_size,
+                  size_t job_count, int thread_count) {
+  PARALLEL_JOBS parallel_jobs = {run, jobs, job_size, job_count, 0};
+
+  size_t extra_thread_count =
+      min((size_t)(thread_count > 1 ? thread_count - 1 : 0), job_count);
+  thrd_t *threads = counted_malloc(sizeof(thrd_t) * (extra_thread_count + 1));
+
+  size_t started_threads = 0;
+  while (started_threads < extra_thread_count &&
+         thrd_create(&threads[started_threads], parallel_worker,
+                     &parallel_jobs) == thrd_success) {
+    started_threads++;
+  }
+
+  parallel_worker(&parallel_jobs);
+
+  for (size_t i = 0; i < started_threads; i++) {
+    thrd_join(threads[i], NULL);
+  }
+
+  counted_free(threads);
+}
+
+// Search chains of deterministic runs, each seeded by its index so that
+// results do not depend on the number of threads
+const size_t DETERMINISTIC_SEARCH_CHAINS = 8;
+
+// Number of independent annealing chains, one per thread unless the run has
+// to be deterministic
+size_t search_chain_count(const USER_OPTIONS *user_options) {
+  return user_options->deterministic ? DETERMINISTIC_SEARCH_CHAINS
+                                     : (size_t)user_options->thread_count;
+}
+
+// Small deterministic random number generator (xorshift64*)
+uint32_t next_random(uint64_t *state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return (uint32_t)((*state * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+// Random state of search chain i
+uint64_t search_chain_seed(size_t chain) {
+  return 0x9e3779b97f4a7c15ULL * (chain + 1);
+}
+
+// Simulated annealing acceptance: always for no growth, otherwise with a
+// probability that falls with the growth and the temperature
+bool annealing_accepts(size_t size, size_t current_size, double temperature,
+                       uint64_t *random_state) {
+  return size <= current_size ||
+         (temperature > 0.0 &&
+          next_random(random_state) / 4294967296.0 <
+              exp(((double)current_size - (double)size) / temperature));
+}
+
+// Fast compressed size estimator (zlib raw deflate at maximum level). The
+// stream is reused between calls to avoid reallocating the deflate state.
+typedef struct SIZE_ESTIMATOR {
+  z_stream stream;
+  unsigned char *buffer;
+  size_t buffer_size;
+} SIZE_ESTIMATOR;
+
+bool init_size_estimator(SIZE_ESTIMATOR *estimator) {
+  memset(estimator, 0, sizeof(SIZE_ESTIMATOR));
+  init_zlib_stream(&estimator->stream);
+  return deflateInit2(&estimator->stream, 9, Z_DEFLATED, -15, 9,
+                      Z_DEFAULT_STRATEGY) == Z_OK;
+}
+
+void free_size_estimator(SIZE_ESTIMATOR *estimator) {
+  deflateEnd(&estimator->stream);
+  counted_free(estimator->buffer);
+}
+
+size_t estimate_compressed_size(SIZE_ESTIMATOR *estimator,
+                                const unsigned char *data, size_t size) {
+  deflateReset(&estimator->stream);
+
+  size_t bound = deflateBound(&estimator->stream, size);
+  if (bound > estimator->buffer_size) {
+    counted_free(estimator->buffer);
+    estimator->buffer = counted_malloc(bound);
+    estimator->buffer_size = bound;
+  }
+
+  estimator->stream.next_in = (unsigned char *)data;
+  estimator->stream.avail_in = size;
+  estimator->stream.next_out = estimator->buffer;
+  estimator->stream.avail_out = bound;
+  deflate(&estimator->stream, Z_FINISH);
+
+  return estimator->stream.total_out;
+}
+
+typedef enum JS_TOKEN_TYPE {
+  JS_TOKEN_WHITESPACE,
+  JS_TOKEN_COMMENT,
+  JS_TOKEN_IDENTIFIER,
+  JS_TOKEN_NUMBER,
+  JS_TOKEN_STRING,
+  JS_TOKEN_TEMPLATE,
+  JS_TOKEN_REGEXP,
+  JS_TOKEN_PUNCTUATOR
+} JS_TOKEN_TYPE;
+
+typedef struct JS_TOKEN {
+  JS_TOKEN_TYPE type;
+  const char *text;
+  size_t length;
+} JS_TOKEN;
+
+typedef struct JS_TOKENS {
+  JS_TOKEN *tokens;
+  size_t count;
+} JS_TOKENS;
+
+// Multi character punctuators, longest first for maximal munch
+const char *JS_PUNCTUATORS[] = {
+    ">>>=", "...", "===", "!==", "**=", "<<=", ">>=", ">>>", "&&=", "||=",
+    "?\?=",  "=>",  "==",  "!=",  "<=",  ">=",  "&&",  "||",  "??",  "?.",
+    "++",   "--",  "+=",  "-=",  "*=",  "/=",  "%=",  "&=",  "|=",  "^=",
+    "**",   "<<",  ">>"};
+
+// Keywords after which a slash starts a regular expression
+const char *JS_REGEXP_KEYWORDS[] = {
+    "return", "typeof", "instanceof", "in",   "of",    "new",  "delete",
+    "void",   "throw",  "case",       "do",   "else",  "yield", "await"};
+
+bool is_js_identifier_char(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         (c >= '0' && c <= '9') || c == '_' || c == '$' ||
+         (unsigned char)c >= 0x80;
+}
+
+bool js_token_equals(const JS_TOKEN *token, const char *text) {
+  return token != NULL && token->length == strlen(text) &&
+         strncmp(token->text, text, token->length) == 0;
+}
+
+bool js_token_in_list(const JS_TOKEN *token, const char **list,
+                      size_t list_length) {
+  for (size_t i = 0; i < list_length; i++) {
+    if (js_token_equals(token, list[i])) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Checks if a slash after the given (significant) token starts a regular
+// expression rather than a division
+bool js_regexp_allowed(const JS_TOKEN *previous) {
+  if (previous == NULL) {
+    return true;
+  }
+
+  switch (previous->type) {
+  case JS_TOKEN_IDENTIFIER:
+    return js_token_in_list(previous, JS_REGEXP_KEYWORDS,
+                            sizeof(JS_REGEXP_KEYWORDS) / sizeof(char *));
+  case JS_TOKEN_PUNCTUATOR:
+    return !js_token_equals(previous, ")") && !js_token_equals(previous, "]") &&
+           !js_token_equals(previous, "}") &&
+           !js_token_equals(previous, "++") && !js_token_equals(previous, "--");
+  case JS_TOKEN_TEMPLATE:
+    return previous->text[previous->length - 1] == '{';
+  default:
+    return false;
+  }
+}
+
+// Scans a template literal piece starting at the backtick or closing brace.
+// Returns the length of the piece, which ends with the closing backtick or
+// with '${', or 0 if it is unterminated.
+size_t scan_js_template(const char *source, size_t length, size_t start) {
+  for (size_t i = start + 1; i < length; i++) {
+    if (source[i] == '\\') {
+      i++;
+    } else if (source[i] == '`') {
+      return i + 1 - start;
+    } else if (source[i] == '$' && i + 1 < length && source[i + 1] == '{') {
+      return i + 2 - start;
+    }
+  }
+  return 0;
+}
+
+// Splits javascript source into tokens. Whitespace and comments are kept as
+// tokens, so concatenating all tokens gives back the source.
+bool tokenize_javascript(const char *source, size_t length,
+                         JS_TOKENS *js_tokens) {
+  size_t capacity = 1024;
+  js_tokens->tokens = counted_malloc(sizeof(JS_TOKEN) * capacity);
+  js_tokens->count = 0;
+
+  // Brace depth at which each open template literal continues
+  size_t template_depths[64];
+  size_t template_count = 0;
+  size_t brace_depth = 0;
+  const JS_TOKEN *previous = NULL;
+
+  for (size_t i = 0; i < length;) {
+    JS_TOKEN token = {JS_TOKEN_PUNCTUATOR, source + i, 1};
+    char c = source[i];
+    char next = i + 1 < length ? source[i + 1] : '\0';
+
+    if (c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' ||
+        c == '\f') {
+      token.type = JS_TOKEN_WHITESPACE;
+      while (i + token.length < length &&
+             strchr(" \t\n\r\v\f", source[i + token.length]) != NULL &&
+             source[i + token.length] != '\0') {
+        token.length++;
+      }
+    } else if (c == '/' && next == '/') {
+      token.type = JS_TOKEN_COMMENT;
+      token.length = strcspn(source + i, "\n");
+    } else if (c == '/' && next == '*') {
+      token.type = JS_TOKEN_COMMENT;
+      const char *end = strstr(source + i + 2, "*/");
+      if (end == NULL) {
+        printf("Unterminated comment in javascript source\n");
+        break;
+      }
+      token.length = end + 2 - (source + i);
+    } else if (is_js_identifier_char(c) && !(c >= '0' && c <= '9')) {
+      token.type = JS_TOKEN_IDENTIFIER;
+      while (i + token.length < length &&
+             is_js_identifier_char(source[i + token.length])) {
+        token.length++;
+      }
+    } else if ((c >= '0' && c <= '9') ||
+               (c == '.' && next >= '0' && next <= '9')) {
+      token.type = JS_TOKEN_NUMBER;
+      bool hex = c == '0' && (next == 'x' || next == 'X');
+      while (i + token.length < length) {
+        char n = source[i + token.length];
+        char p = source[i + token.length - 1];
+        if (!(is_js_identifier_char(n) || n == '.' ||
+              ((n == '+' || n == '-') && (p == 'e' || p == 'E') && !hex))) {
+          break;
+        }
+        token.length++;
+      }
+    } else if (c == '"' || c == '\'') {
+      token.type = JS_TOKEN_STRING;
+      while (i + token.length < length && source[i + token.length] != c &&
+             source[i + token.length] != '\n') {
+        token.length += source[i + token.length] == '\\' ? 2 : 1;
+      }
+      if (i + token.length >= length || source[i + token.length] != c) {
+        printf("Unterminated string in javascript source\n");
+        break;
+      }
+      token.length++;
+    } else if (c == '`' ||
+               (c == '}' && template_count > 0 &&
+                template_depths[template_count - 1] == brace_depth)) {
+      token.type = JS_TOKEN_TEMPLATE;
+      token.length = scan_js_template(source, length, i);
+      if (token.length == 0) {
+        printf("Unterminated template literal in javascript source\n");
+        break;
+      }
+      if (c == '}') {
+        template_count--;
+      }
+      if (source[i + token.length - 1] == '{') {
+        if (template_count == sizeof(template_depths) / sizeof(size_t)) {
+          printf("Template literals nested too deep in javascript source\n");
+          break;
+        }
+        template_depths[template_count++] = brace_depth;
+      }
+    } else if (c == '/' && js_regexp_allowed(previous)) {
+      token.type = JS_TOKEN_REGEXP;
+      bool in_class = false;
+      while (i + token.length < length && source[i + token.length] != '\n' &&
+             (in_class || source[i + token.length] != '/')) {
+        char r = source[i + token.length];
+        in_class = (in_class || r == '[') && r != ']';
+        token.length += r == '\\' ? 2 : 1;
+      }
+      if (i + token.length >= length || source[i + token.length] != '/') {
+        printf("Unterminated regular expression in javascript source\n");
+        break;
+      }
+      token.length++;
+      while (i + token.length < length &&
+             is_js_identifier_char(source[i + token.length])) {
+        token.length++;
+      }
+    } else {
+      for (size_t p = 0; p < sizeof(JS_PUNCTUATORS) / sizeof(char *); p++) {
+        size_t punctuator_length = strlen(JS_PUNCTUATORS[p]);
+        if (strncmp(source + i, JS_PUNCTUATORS[p], punctuator_length) == 0 &&
+            !(JS_PUNCTUATORS[p][1] == '.' && JS_PUNCTUATORS[p][0] == '?' &&
+              i + 2 < length && source[i + 2] >= '0' && source[i + 2] <= '9')) {
+          token.length = punctuator_length;
+          break;
+        }
+      }
+      brace_depth += c == '{' ? 1 : 0;
+      brace_depth -= c == '}' && brace_depth > 0 ? 1 : 0;
+    }
+
+    if (js_tokens->count == capacity) {
+      capacity *= 2;
+      js_tokens->tokens =
+          counted_realloc(js_tokens->tokens, sizeof(JS_TOKEN) * capacity);
+    }
+    js_tokens->tokens[js_tokens->count++] = token;
+
+    if (token.type != JS_TOKEN_WHITESPACE && token.type != JS_TOKEN_COMMENT) {
+      previous = &js_tokens->tokens[js_tokens->count - 1];
+    }
+
+    i += token.length;
+  }
+
+  // Scanning stopped early on errors
+  size_t scanned_length = 0;
+  for (size_t i = 0; i < js_tokens->count; i++) {
+    scanned_length += js_tokens->tokens[i].length;
+  }
+  if (scanned_length != length) {
+    counted_free(js_tokens->tokens);
+    js_tokens->tokens = NULL;
+    js_tokens->count = 0;
+    return false;
+  }
+
+  return true;
+}
+
+// Unicode whitespace and line terminators besides the ASCII ones
+bool is_js_unicode_whitespace(uint32_t code_point) {
+  return code_point == 0xa0 || code_point == 0x1680 ||
+         (code_point >= 0x2000 && code_point <= 0x200a) ||
+         code_point == 0x2028 || code_point == 0x2029 ||
+         code_point == 0x202f || code_point == 0x205f ||
+         code_point == 0x3000 || code_point == 0xfeff;
+}
+
+// Replaces \0 (nul_only) or non-ASCII characters by \u escapes (surrogate
+// pairs beyond the BMP), which mean the same in strings, untagged templates,
+// regular expressions and identifiers. A backslash escaping the character is
+// dropped, before U+2028 and U+2029 it continues a line and is kept with a
+// newline instead. Unicode whitespace between tokens becomes a space or a
+// newline. Bytes that are no valid UTF-8 are taken as Latin-1, which is what
+// the bootstraps decode them as. Returns NULL if a character is in a tagged
+// template, whose raw strings would change.
+char *escape_javascript_characters(const char *javascript, size_t length,
+                                   bool nul_only) {
+  // Tokenized with \0 as another character, text that does not tokenize is
+  // escaped like one string
+  char *source = counted_malloc(length + 1);
+  for (size_t i = 0; i < length; i++) {
+    source[i] = javascript[i] != '\0' ? javascript[i] : '\x01';
+  }
+  source[length] = '\0';
+  JS_TOKENS js_tokens;
+  if (!tokenize_javascript(source, length, &js_tokens)) {
+    js_tokens.tokens = counted_malloc(sizeof(JS_TOKEN));
+    js_tokens.tokens[0] = (JS_TOKEN){JS_TOKEN_STRING, source, length};
+    js_tokens.count = 1;
+  }
+
+  // Whether each open template literal is tagged
+  bool tagged[64];
+  size_t template_count = 0;
+  const JS_TOKEN *previous = NULL;
+
+  char *escaped = counted_malloc(length * 6 + 1);
+  size_t escaped_length = 0;
+  bool success = true;
+  for (size_t t = 0; t < js_tokens.count && success; t++) {
+    const JS_TOKEN *token = &js_tokens.tokens[t];
+    bool raw = false;
+    if (token->type == JS_TOKEN_TEMPLATE) {
+      raw = token->text[0] == '`'
+                ? previous != NULL && !js_regexp_allowed(previous)
+                : template_count == 0 || tagged[--template_count];
+      if (token->text[token->length - 1] == '{') {
+        if (template_count == sizeof(tagged) / sizeof(bool)) {
+          success = false;
+          break;
+        }
+        tagged[template_count++] = raw;
+      }
+    }
+    bool literal = token->type == JS_TOKEN_STRING ||
+                   token->type == JS_TOKEN_TEMPLATE ||
+                   token->type == JS_TOKEN_REGEXP;
+
+    const unsigned char *text =
+        (const unsigned char *)javascript + (token->text - source);
+    const unsigned char *end = text + token->length;
+    size_t backslashes = 0;
+    while (text < end && success) {
+      if (nul_only ? *text != '\0' : *text < 0x80) {
+        backslashes = *text == '\\' ? backslashes + 1 : 0;
+        escaped[escaped_length++] = *text++;
+        continue;
+      }
+
+      uint32_t code_point;
+      size_t sequence_length = decode_utf8(text, &code_point);
+      bool valid = sequence_length > 0 && text + sequence_length <= end;
+      if (!valid) {
+        code_point = *text;
+        sequence_length = 1;
+      }
+      text += sequence_length;
+
+      bool line_terminator = code_point == 0x2028 || code_point == 0x2029;
+      bool escaped_by_backslash = literal && backslashes % 2 == 1;
+      backslashes = 0;
+      if (raw) {
+        // Latin-1 bytes decode as they are, characters would be garbled
+        success = !valid && code_point != 0;
+        escaped[escaped_length++] = code_point;
+      } else if (escaped_by_backslash && line_terminator) {
+        escaped[escaped_length++] = '\n';
+      } else if (token->type == JS_TOKEN_COMMENT
+                     ? line_terminator
+                     : !literal && is_js_unicode_whitespace(code_point)) {
+        escaped[escaped_length++] = line_terminator ? '\n' : ' ';
+      } else if (code_point < 0x10000) {
+        escaped_length -= escaped_by_backslash ? 1 : 0;
+        escaped_length +=
+            sprintf(escaped + escaped_length, "\\u%04x", code_point);
+      } else {
+        escaped_length -= escaped_by_backslash ? 1 : 0;
+        code_point -= 0x10000;
+        escaped_length += sprintf(escaped + escaped_length, "\\u%04x\\u%04x",
+                                  0xd800 + (code_point >> 10),
+                                  0xdc00 + (code_point & 0x3ff));
+      }
+    }
+
+    if (token->type != JS_TOKEN_WHITESPACE &&
+        token->type != JS_TOKEN_COMMENT) {
+      previous = token;
+    }
+  }
+  escaped[escaped_length] = '\0';
+  counted_free(js_tokens.tokens);
+  counted_free(source);
+  if (!success) {
+    counted_free(escaped);
+    return NULL;
+  }
+  return escaped;
+}
+
+char *escape_non_ascii(const char *javascript) {
+  return escape_javascript_characters(javascript, strlen(javascript), false);
+}
+
+// Embeds javascript with non-ASCII text either escaped for the default
+// bootstraps or as UTF-8 bytes of explicit length decoded with TextDecoder,
+// whichever unpack code plus estimated compressed data is smaller. Text that
+// is no valid UTF-8 is always escaped, text that can not be escaped (see
+// escape_non_ascii) always UTF-8. One of them has to work.
+IMAGE *embbed_non_ascii_javascript_in_image(
+    char *javascript, USER_OPTIONS *user_options,
+    COMPRESSION_STATISTICS *compression_statistics) {
+  size_t javascript_length = strlen(javascript);
+  IMAGE *image = NULL;
+  char *escaped_javascript = escape_non_ascii(javascript);
+  if (escaped_javascript != NULL) {
+    image = embbed_javascript_in_image(escaped_javascript, user_options,
+                                       compression_statistics);
+    counted_free(escaped_javascript);
+    image->unpack_code = create_unpack_code(image);
+    compression_statistics->text_encoding = "escapes";
+  }
+  compression_statistics->javascript_size = javascript_length;
+  if (!is_valid_utf8(javascript)) {
+    return image;
+  }
+
+  IMAGE *utf8_image =
+      embbed_data_in_image((unsigned char *)javascript, javascript_length,
+                           true, user_options->row_layout);
+  utf8_image->unpack_code =
+      create_payload_unpack_code(utf8_image, UTF8_DECODE_CODE, "");
+  if (image == NULL) {
+    compression_statistics->text_encoding = "utf-8";
+    return utf8_image;
+  }
+
+  SIZE_ESTIMATOR estimator;
+  if (!init_size_estimator(&estimator)) {
+    counted_free(utf8_image->unpack_code);
+    counted_free(utf8_image->data);
+    counted_free(utf8_image);
+    return image;
+  }
+  size_t escaped_size =
+      strlen(image->unpack_code) +
+      estimate_compressed_size(&estimator, image->data, image->size);
+  size_t utf8_size =
+      strlen(utf8_image->unpack_code) +
+      estimate_compressed_size(&estimator, utf8_image->data, utf8_image->size);
+  free_size_estimator(&estimator);
+
+  IMAGE *discarded_image = utf8_image;
+  if (utf8_size < escaped_size) {
+    discarded_image = image;
+    image = utf8_image;
+    compression_statistics->text_encoding = "utf-8";
+  }
+  compression_statistics->text_encoding_saved_bytes =
+      max(escaped_size, utf8_size) - min(escaped_size, utf8_size);
+  counted_free(discarded_image->unpack_code);
+  counted_free(discarded_image->data);
+  counted_free(discarded_image);
+  return image;
+}
+
+char *read_text_file(const char *file_path) {
+  char *text = NULL;
+  FILE *file = fopen(file_path, "rt");
+
+  if (file != NULL) {
+    fseek(file, 0, SEEK_END);
+    size_t size = ftell(file);
+    rewind(file);
+
+    // Add an additional byte for null terminating the string
+    text = counted_calloc(size + 1, 1);
+
+    if (fread(text, 1, size, file) != size) {
+      printf("Failed to read source file '%s'\n", file_path);
+      counted_free(text);
+      text = NULL;
+    } else if (memchr(text, '\0', size) != NULL) {
+      // \0 bytes would end the string early, they are escaped where an
+      // escape means the same
+      char *escaped = escape_javascript_characters(text, size, true);
+      if (escaped == NULL) {
+        printf("Source file '%s' has \\0 in a tagged template\n", file_path);
+      }
+      counted_free(text);
+      text = escaped;
+    }
+
+    fclose(file);
+  } else {
+    printf("Failed to open javascript source file '%s'\n", file_path);
+  }
+
+  return text;
+}
+
+// Reserved and contextual words plus well-known globals that are never
+// renamed
+const char *JS_RESERVED_WORDS[] = {
+    "break",     "case",      "catch",     "class",    "const",
+    "continue",  "debugger",  "default",   "delete",   "do",
+    "else",      "enum",      "export",    "extends",  "false",
+    "finally",   "for",       "function",  "if",       "import",
+    "in",        "instanceof", "new",      "null",     "return",
+    "super",     "switch",    "this",      "throw",    "true",
+    "try",       "typeof",    "var",       "void",     "while",
+    "with",      "yield",     "let",       "static",   "implements",
+    "interface", "package",   "private",   "protected", "public",
+    "await",     "async",     "of",        "get",      "set",
+    "arguments", "eval",      "undefined", "NaN",      "Infinity"};
+
+// Globals the bootstraps share with the javascript: the canvas c, the
+// segments S and the WebAssembly imports I, start callback R and instance W
+const char *JS_BOOTSTRAP_NAMES[] = {"c", "S", "I", "R", "W"};
+
+// Keywords that start a declaration of the following identifier
+const char *JS_DECLARATION_KEYWORDS[] = {"var", "let", "const", "function",
+                                         "class"};
+
+// Tokens after which an opening brace starts a block rather than an object
+// literal or class body
+const char *JS_BLOCK_PREFIXES[] = {")", "{", "}", ";", "=>", "else", "do",
+                                   "try", "finally"};
+
+// Identifier names found in the source, hashed by name
+typedef struct JS_NAME {
+  const char *text;
+  size_t length;
+  size_t count;
+  bool declared;
+  bool excluded;
+} JS_NAME;
+
+typedef struct JS_NAME_TABLE {
+  JS_NAME *names;
+  size_t count;
+  size_t *slots;
+  size_t slot_count;
+} JS_NAME_TABLE;
+
+uint32_t hash_name(const char *text, size_t length) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < length; i++) {
+    hash = (hash ^ (unsigned char)text[i]) * 16777619u;
+  }
+  return hash;
+}
+
+// Returns the index of a name in the table, adding it if necessary. Slots hold
+// index + 1, 0 marks an empty slot.
+size_t find_or_add_name(JS_NAME_TABLE *table, const char *text,
+                        size_t length) {
+  size_t slot = hash_name(text, length) & (table->slot_count - 1);
+  while (table->slots[slot] != 0) {
+    JS_NAME *name = &table->names[table->slots[slot] - 1];
+    if (name->length == length && strncmp(name->text, text, length) == 0) {
+      return table->slots[slot] - 1;
+    }
+    slot = (slot + 1) & (table->slot_count - 1);
+  }
+
+  JS_NAME name = {text, length, 0, false, false};
+  table->names[table->count] = name;
+  table->slots[slot] = ++table->count;
+  return table->count - 1;
+}
+
+// Finds the closing bracket matching the opening bracket at the given index of
+// significant tokens
+size_t find_matching_bracket(JS_TOKEN **significant, size_t count,
+                             size_t open) {
+  char open_char = significant[open]->text[0];
+  char close_char = open_char == '(' ? ')' : (open_char == '[' ? ']' : '}');
+  size_t depth = 0;
+  for (size_t i = open; i < count; i++) {
+    if (significant[i]->type == JS_TOKEN_PUNCTUATOR &&
+        significant[i]->length == 1) {
+      if (significant[i]->text[0] == open_char) {
+        depth++;
+      } else if (significant[i]->text[0] == close_char && --depth == 0) {
+        return i;
+      }
+    }
+  }
+  return count;
+}
+
+// Collects all identifier names and decides which ones can be renamed safely.
+// A name is renamable if it is declared in the source (var/let/const,
+// function/class name, parameter, catch binding) and is never used in a way
+// that exposes the name itself: as a property after '.', as an object literal
+// key, class member or shorthand property. Names starting with "on" are kept,
+// since declared globals like onload act as event handlers, as are the
+// globals of the bootstraps, see JS_BOOTSTRAP_NAMES.
+size_t *analyze_js_names(const JS_TOKENS *js_tokens, JS_NAME_TABLE *table) {
+  size_t *token_names = counted_malloc(sizeof(size_t) * (js_tokens->count + 1));
+
+  table->slot_count = 64;
+  while (table->slot_count < js_tokens->count * 2) {
+    table->slot_count *= 2;
+  }
+  table->slots = counted_calloc(table->slot_count, sizeof(size_t));
+  table->names = counted_malloc(sizeof(JS_NAME) * (js_tokens->count + 1));
+  table->count = 0;
+
+  // Work on significant tokens only
+  JS_TOKEN **significant =
+      counted_malloc(sizeof(JS_TOKEN *) * (js_tokens->count + 1));
+  size_t *significant_index =
+      counted_malloc(sizeof(size_t) * (js_tokens->count + 1));
+  size_t count = 0;
+  for (size_t i = 0; i < js_tokens->count; i++) {
+    token_names[i] = SIZE_MAX;
+    if (js_tokens->tokens[i].type != JS_TOKEN_WHITESPACE &&
+        js_tokens->tokens[i].type != JS_TOKEN_COMMENT) {
+      significant_index[count] = i;
+      significant[count++] = &js_tokens->tokens[i];
+    }
+  }
+
+  // Bracket stack: opening char, object literal flag and var declaration flag
+  char bracket_stack[256];
+  bool object_stack[256];
+  bool declaration_stack[256];
+  size_t depth = 0;
+  bool declaration = false;
+  size_t parameter_depth = SIZE_MAX;
+  size_t parameter_close = SIZE_MAX;
+
+  for (size_t i = 0; i < count; i++) {
+    JS_TOKEN *token = significant[i];
+    JS_TOKEN *previous = i > 0 ? significant[i - 1] : NULL;
+    JS_TOKEN *next = i + 1 < count ? significant[i + 1] : NULL;
+
+    if (token->type == JS_TOKEN_PUNCTUATOR ||
+        token->type == JS_TOKEN_TEMPLATE) {
+      char c = token->type == JS_TOKEN_TEMPLATE
+                   ? (token->text[token->length - 1] == '{' ? '{' : ' ')
+                   : (token->length == 1 ? token->text[0] : ' ');
+      if (token->type == JS_TOKEN_TEMPLATE && token->text[0] == '}' &&
+          depth > 0) {
+        depth--;
+      }
+
+      if (c == '(' || c == '[' || c == '{') {
+        if (depth == sizeof(bracket_stack)) {
+          printf("Brackets nested too deep for identifier analysis\n");
+          break;
+        }
+        bracket_stack[depth] = c;
+        object_stack[depth] =
+            c == '{' && token->type == JS_TOKEN_PUNCTUATOR &&
+            !(previous == NULL ||
+              js_token_in_list(previous, JS_BLOCK_PREFIXES,
+                               sizeof(JS_BLOCK_PREFIXES) / sizeof(char *)));
+        declaration_stack[depth] = declaration;
+        declaration = false;
+        depth++;
+
+        // Parameter lists of functions and arrow functions
+        if (c == '(') {
+          size_t close = find_matching_bracket(significant, count, i);
+          bool function_parameters =
+              (previous != NULL &&
+               (js_token_equals(previous, "function") ||
+                js_token_equals(previous, "catch") ||
+                (i > 1 && previous->type == JS_TOKEN_IDENTIFIER &&
+                 js_token_equals(significant[i - 2], "function")))) ||
+              (close + 1 < count && js_token_equals(significant[close + 1],
+                                                    "=>"));
+          if (function_parameters) {
+            parameter_depth = depth;
+            parameter_close = close;
+          }
+        }
+      } else if ((c == ')' || c == ']' || c == '}') && depth > 0) {
+        depth--;
+        declaration = declaration_stack[depth];
+      } else if (c == ';') {
+        declaration = false;
+      }
+
+      if (i == parameter_close) {
+        parameter_depth = SIZE_MAX;
+        parameter_close = SIZE_MAX;
+      }
+      continue;
+    }
+
+    if (token->type != JS_TOKEN_IDENTIFIER) {
+      continue;
+    }
+
+    size_t name_index = find_or_add_name(table, token->text, token->length);
+    JS_NAME *name = &table->names[name_index];
+    token_names[significant_index[i]] = name_index;
+    name->count++;
+
+    if (js_token_in_list(token, JS_DECLARATION_KEYWORDS,
+                         sizeof(JS_DECLARATION_KEYWORDS) / sizeof(char *)) &&
+        !js_token_equals(token, "function") &&
+        !js_token_equals(token, "class")) {
+      declaration = true;
+    }
+
+    // Property access and keywords
+    if (js_token_equals(previous, ".") || js_token_equals(previous, "?.") ||
+        js_token_in_list(token, JS_RESERVED_WORDS,
+                         sizeof(JS_RESERVED_WORDS) / sizeof(char *)) ||
+        (token->length > 2 && strncmp(token->text, "on", 2) == 0) ||
+        js_token_in_list(token, JS_BOOTSTRAP_NAMES,
+                         sizeof(JS_BOOTSTRAP_NAMES) / sizeof(char *))) {
+      name->excluded = true;
+      continue;
+    }
+
+    // Object literal keys, shorthand properties and class members
+    if (depth > 0 && object_stack[depth - 1] &&
+        (previous == NULL || js_token_equals(previous, "{") ||
+         js_token_equals(previous, ",") || js_token_equals(previous, "}") ||
+         js_token_equals(previous, ";") || js_token_equals(previous, "*") ||
+         js_token_equals(previous, "get") || js_token_equals(previous, "set") ||
+         js_token_equals(previous, "static") ||
+         js_token_equals(previous, "async")) &&
+        (next == NULL || js_token_equals(next, ":") ||
+         js_token_equals(next, ",") || js_token_equals(next, "}") ||
+         js_token_equals(next, "(") || js_token_equals(next, "=") ||
+         js_token_equals(next, ";"))) {
+      name->excluded = true;
+      continue;
+    }
+
+    // Declarations
+    bool after_function_star = js_token_equals(previous, "*") && i > 1 &&
+                               js_token_equals(significant[i - 2], "function");
+    if (js_token_in_list(previous, JS_DECLARATION_KEYWORDS,
+                         sizeof(JS_DECLARATION_KEYWORDS) / sizeof(char *)) ||
+        after_function_star ||
+        (declaration && js_token_equals(previous, ",")) ||
+        (depth == parameter_depth &&
+         (js_token_equals(previous, "(") || js_token_equals(previous, ",") ||
+          js_token_equals(previous, "..."))) ||
+        js_token_equals(next, "=>")) {
+      name->declared = true;
+    }
+  }
+
+  counted_free(significant);
+  counted_free(significant_index);
+
+  return token_names;
+}
+
+// Builds the source text with renamed identifiers. Returns the text length.
+size_t render_renamed_javascript(const JS_TOKENS *js_tokens,
+                                 const size_t *token_names,
+                                 const size_t *renamable_index,
+                                 const size_t *assignment,
+                                 const JS_NAME *pool, char *output) {
+  char *output_ptr = output;
+  for (size_t i = 0; i < js_tokens->count; i++) {
+    const JS_TOKEN *token = &js_tokens->tokens[i];
+    if (token_names[i] != SIZE_MAX &&
+        renamable_index[token_names[i]] != SIZE_MAX) {
+      const JS_NAME *target =
+          &pool[assignment[renamable_index[token_names[i]]]];
+      memcpy(output_ptr, target->text, target->length);
+      output_ptr += target->length;
+    } else {
+      memcpy(output_ptr, token->text, token->length);
+      output_ptr += token->length;
+    }
+  }
+  return output_ptr - output;
+}
+
+typedef struct RENAMING_CONTEXT {
+  const JS_TOKENS *js_tokens;
+  const size_t *token_names;
+  const size_t *renamable_index;
+  size_t renamable_count;
+  const JS_NAME *pool;
+  size_t pool_count;
+  size_t max_output_length;
+  int iterations;
+} RENAMING_CONTEXT;
+
+// One independent annealing run starting from the shared initial assignment
+typedef struct RENAMING_JOB {
+  const RENAMING_CONTEXT *context;
+  uint64_t seed;
+  size_t *assignment;
+  size_t size;
+} RENAMING_JOB;
+
+void run_renaming_job(void *argument) {
+  RENAMING_JOB *job = argument;
+  const RENAMING_CONTEXT *context = job->context;
+
+  SIZE_ESTIMATOR estimator;
+  if (!init_size_estimator(&estimator)) {
+    return;
+  }
+
+  char *output = counted_malloc(context->max_output_length);
+  size_t *current = counted_malloc(sizeof(size_t) * context->renamable_count);
+  memcpy(current, job->assignment, sizeof(size_t) * context->renamable_count);
+
+  // Owner of each pool name or SIZE_MAX if unused
+  size_t *owner = counted_malloc(sizeof(size_t) * context->pool_count);
+  for (size_t i = 0; i < context->pool_count; i++) {
+    owner[i] = SIZE_MAX;
+  }
+  for (size_t i = 0; i < context->renamable_count; i++) {
+    owner[current[i]] = i;
+  }
+
+  size_t length =
+      render_renamed_javascript(context->js_tokens, context->token_names,
+                                context->renamable_index, current,
+                                context->pool, output);
+  size_t current_size = estimate_compressed_size(
+      &estimator, (unsigned char *)output, length);
+  job->size = current_size;
+
+  uint64_t random_state = job->seed;
+  for (int iteration = 0; iteration < context->iterations; iteration++) {
+    // Either swap the names of two identifiers or give one an unused name
+    size_t a = next_random(&random_state) % context->renamable_count;
+    size_t target = next_random(&random_state) % context->pool_count;
+    size_t b = owner[target];
+    if (b == a) {
+      continue;
+    }
+
+    size_t a_name = current[a];
+    current[a] = target;
+    if (b != SIZE_MAX) {
+      current[b] = a_name;
+    }
+
+    length = render_renamed_javascript(context->js_tokens, context->token_names,
+                                       context->renamable_index, current,
+                                       context->pool, output);
+    size_t size = estimate_compressed_size(&estimator, (unsigned char *)output,
+                                           length);
+
+    // Linearly falling temperature
+    double temperature =
+        2.0 * (1.0 - (double)iteration / (double)context->iterations);
+    if (annealing_accepts(size, current_size, temperature, &random_state)) {
+      owner[target] = a;
+      owner[a_name] = b;
+      current_size = size;
+      if (size < job->size) {
+        job->size = size;
+        memcpy(job->assignment, current,
+               sizeof(size_t) * context->renamable_count);
+      }
+    } else {
+      current[a] = a_name;
+      if (b != SIZE_MAX) {
+        current[b] = target;
+      }
+    }
+  }
+
+  counted_free(owner);
+  counted_free(current);
+  counted_free(output);
+  free_size_estimator(&estimator);
+}
+
+// Appends all names of the given length that are not used otherwise in the
+// source to the pool of candidate names
+void add_pool_names(JS_NAME_TABLE *table, size_t name_length, JS_NAME *pool,
+                    size_t *pool_count, size_t max_pool_count,
+                    char *name_storage) {
+  const char *first_chars =
+      "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_$";
+  const char *other_chars =
+      "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_$0123456789";
+  size_t first_count = strlen(first_chars);
+  size_t other_count = strlen(other_chars);
+  size_t combinations =
+      name_length == 1 ? first_count : first_count * other_count;
+
+  for (size_t i = 0; i < combinations && *pool_count < max_pool_count; i++) {
+    char *text = name_storage + *pool_count * 2;
+    text[0] = first_chars[i % first_count];
+    text[1] = other_chars[i / first_count % other_count];
+
+    // Skip names that stay in the source, keywords, names of Math which are
+    // in scope inside with(Math) and the globals of the bootstraps
+    size_t slot = hash_name(text, name_length) & (table->slot_count - 1);
+    bool used = false;
+    for (; table->slots[slot] != 0;
+         slot = (slot + 1) & (table->slot_count - 1)) {
+      JS_NAME *name = &table->names[table->slots[slot] - 1];
+      if (name->length == name_length &&
+          strncmp(name->text, text, name_length) == 0) {
+        used = true;
+        break;
+      }
+    }
+    if (used || (name_length == 2 && (strncmp(text, "do", 2) == 0 ||
+                                      strncmp(text, "if", 2) == 0 ||
+                                      strncmp(text, "in", 2) == 0 ||
+                                      strncmp(text, "of", 2) == 0 ||
+                                      strncmp(text, "PI", 2) == 0)) ||
+        (name_length == 1 && (text[0] == 'E' || strchr("cSIRW", text[0])))) {
+      continue;
+    }
+
+    JS_NAME name = {text, name_length, 0, false, false};
+    pool[(*pool_count)++] = name;
+  }
+}
+
+// Renames identifiers declared in the javascript source to the names that
+// compress best. Candidate assignments are searched by parallel simulated
+// annealing runs scored with the fast estimator, the best one is confirmed
+// with the real compression. Returns a new string or NULL if renaming does not
+// pay off.
+char *rename_identifiers(const char *javascript, USER_OPTIONS *user_options,
+                         COMPRESSION_STATISTICS *compression_statistics) {
+  size_t javascript_length = strlen(javascript);
+  JS_TOKENS js_tokens;
+  if (!tokenize_javascript(javascript, javascript_length, &js_tokens)) {
+    return NULL;
+  }
+
+  JS_NAME_TABLE table;
+  size_t *token_names = analyze_js_names(&js_tokens, &table);
+
+  // Renamable names are the ones declared and never excluded
+  size_t *renamable_index = counted_malloc(sizeof(size_t) * (table.count + 1));
+  size_t renamable_count = 0;
+  for (size_t i = 0; i < table.count; i++) {
+    renamable_index[i] = SIZE_MAX;
+    if (table.names[i].declared && !table.names[i].excluded) {
+      renamable_index[i] = renamable_count++;
+    }
+  }
+
+  char *result = NULL;
+  size_t max_pool_count = 2 * renamable_count + 64;
+  JS_NAME *pool = counted_malloc(sizeof(JS_NAME) * max_pool_count);
+  char *name_storage = counted_malloc(2 * max_pool_count);
+  size_t pool_count = 0;
+
+  if (renamable_count > 0) {
+    // Original names are part of the pool, followed by unused short names
+    size_t *assignment = counted_malloc(sizeof(size_t) * renamable_count);
+    for (size_t i = 0; i < table.count; i++) {
+      if (renamable_index[i] != SIZE_MAX) {
+        assignment[renamable_index[i]] = pool_count;
+        pool[pool_count++] = table.names[i];
+      }
+    }
+    add_pool_names(&table, 1, pool, &pool_count, max_pool_count, name_storage);
+    add_pool_names(&table, 2, pool, &pool_count, max_pool_count, name_storage);
+
+    // Upper bound of renamed source length
+    size_t max_name_length = 0;
+    for (size_t i = 0; i < pool_count; i++) {
+      max_name_length = pool[i].length > max_name_length ? pool[i].length
+                                                         : max_name_length;
+    }
+    size_t max_output_length = javascript_length;
+    for (size_t i = 0; i < table.count; i++) {
+      if (renamable_index[i] != SIZE_MAX) {
+        max_output_length += table.names[i].count * max_name_length;
+      }
+    }
+
+    RENAMING_CONTEXT context = {&js_tokens,     token_names,
+                                renamable_index, renamable_count,
+                                pool,           pool_count,
+                                max_output_length,
+                                user_options->rename_iterations};
+
+    // One annealing run per search chain, each with its own seed
+    size_t job_count = search_chain_count(user_options);
+    RENAMING_JOB *jobs = counted_malloc(sizeof(RENAMING_JOB) * job_count);
+    for (size_t i = 0; i < job_count; i++) {
+      jobs[i].context = &context;
+      jobs[i].seed = search_chain_seed(i);
+      jobs[i].assignment = counted_malloc(sizeof(size_t) * renamable_count);
+      memcpy(jobs[i].assignment, assignment, sizeof(size_t) * renamable_count);
+      jobs[i].size = SIZE_MAX;
+    }
+
+    run_parallel(run_renaming_job, jobs, sizeof(RENAMING_JOB), job_count,
+                 user_options->thread_count);
+
+    // Ordered reduction, ties go to the lower job index
+    size_t best_job = 0;
+    for (size_t i = 1; i < job_count; i++) {
+      if (jobs[i].size < jobs[best_job].size) {
+        best_job = i;
+      }
+    }
+
+    // Confirm with real compression of the embedded image
+    char *renamed = counted_calloc(max_output_length + 1, 1);
+    render_renamed_javascript(&js_tokens, token_names, renamable_index,
+                              jobs[best_job].assignment, pool, renamed);
+
+    size_t original_size = compressed_javascript_size(javascript, user_options);
+    size_t renamed_size = compressed_javascript_size(renamed, user_options);
+
+    if (renamed_size > 0 && renamed_size < original_size) {
+      result = renamed;
+      compression_statistics->renamed_identifiers = renamable_count;
+      compression_statistics->renaming_saved_bytes =
+          original_size - renamed_size;
+    } else {
+      counted_free(renamed);
+    }
+
+    for (size_t i = 0; i < job_count; i++) {
+      counted_free(jobs[i].assignment);
+    }
+    counted_free(jobs);
+    counted_free(assignment);
+  }
+
+  counted_free(name_storage);
+  counted_free(pool);
+  counted_free(renamable_index);
+  counted_free(table.names);
+  counted_free(table.slots);
+  counted_free(token_names);
+  counted_free(js_tokens.tokens);
+
+  return result;
+}
+
+// Comment markers declaring top-level units that can be reordered safely. A
+// unit starts at a unit marker and ends at the next one, the group of units
+// ends at the end marker or at the end of the source.
+const char *REORDER_UNIT_MARKER = "//@reorder";
+const char *REORDER_END_MARKER = "//@reorder-end";
+
+// Piece of the reordered source: fixed text or a unit belonging to a group
+// whose units can be permuted among the group's slots. Units that relied on
+// automatic semicolon insertion get a ';' inserted at the terminator offset.
+typedef struct SOURCE_PIECE {
+  const char *text;
+  size_t length;
+  size_t group;
+  size_t terminator_offset;
+} SOURCE_PIECE;
+
+bool is_marker_comment(const JS_TOKEN *token, const char *marker) {
+  size_t length = token->length;
+  while (length > 0 && (token->text[length - 1] == ' ' ||
+                        token->text[length - 1] == '\r')) {
+    length--;
+  }
+  return token->type == JS_TOKEN_COMMENT && length == strlen(marker) &&
+         strncmp(token->text, marker, length) == 0;
+}
+
+void add_source_piece(SOURCE_PIECE *pieces, size_t *piece_count,
+                      const char *text, size_t length, size_t group) {
+  if (length == 0) {
+    return;
+  }
+
+  // Fixed text is merged with the preceding fixed piece
+  if (group == SIZE_MAX && *piece_count > 0 &&
+      pieces[*piece_count - 1].group == SIZE_MAX &&
+      pieces[*piece_count - 1].text + pieces[*piece_count - 1].length ==
+          text) {
+    pieces[*piece_count - 1].length += length;
+    return;
+  }
+
+  SOURCE_PIECE piece = {text, length, group, SIZE_MAX};
+  pieces[(*piece_count)++] = piece;
+}
+
+void add_unit_piece(SOURCE_PIECE *pieces, size_t *piece_count,
+                    const char *text, size_t length, size_t group,
+                    const JS_TOKEN *last) {
+  add_source_piece(pieces, piece_count, text, length, group);
+  if (length > 0 && last != NULL && last->text >= text &&
+      !js_token_equals(last, ";") && !js_token_equals(last, "}")) {
+    pieces[*piece_count - 1].terminator_offset =
+        last->text + last->length - text;
+  }
+}
+
+// Index after the bracket that closes the one at start, template pieces count
+// as brackets. Returns 0 if it is not closed.
+size_t skip_js_brackets(const JS_TOKENS *js_tokens, size_t start) {
+  size_t depth = 0;
+  for (size_t i = start; i < js_tokens->count; i++) {
+    const JS_TOKEN *token = &js_tokens->tokens[i];
+    if (token->type == JS_TOKEN_PUNCTUATOR && token->length == 1) {
+      depth += strchr("([{", token->text[0]) != NULL ? 1 : 0;
+      depth -= strchr(")]}", token->text[0]) != NULL ? 1 : 0;
+    } else if (token->type == JS_TOKEN_TEMPLATE) {
+      depth += token->text[token->length - 1] == '{' ? 1 : 0;
+      depth -= token->text[0] == '}' ? 1 : 0;
+    }
+    if (depth == 0) {
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+// Splits the source into fixed pieces and reorderable units. Group 0 holds all
+// top-level function declarations (they are hoisted, so their order does not
+// matter), groups 1 and up are the ones declared by markers. Marker comments
+// are dropped. Returns the number of pieces.
+size_t split_reorderable_units(const JS_TOKENS *js_tokens,
+                               SOURCE_PIECE *pieces, size_t *group_count) {
+  size_t piece_count = 0;
+  size_t depth = 0;
+  size_t marker_group = SIZE_MAX;
+  const char *unit_start = NULL;
+  const JS_TOKEN *previous = NULL;
+  *group_count = 1;
+
+  for (size_t i = 0; i < js_tokens->count; i++) {
+    const JS_TOKEN *token = &js_tokens->tokens[i];
+
+    if (depth == 0 && (is_marker_comment(token, REORDER_UNIT_MARKER) ||
+                       is_marker_comment(token, REORDER_END_MARKER))) {
+      if (unit_start != NULL) {
+        add_unit_piece(pieces, &piece_count, unit_start,
+                       token->text - unit_start, marker_group, previous);
+        unit_start = NULL;
+      }
+
+      if (is_marker_comment(token, REORDER_UNIT_MARKER)) {
+        if (marker_group == SIZE_MAX) {
+          marker_group = (*group_count)++;
+        }
+        unit_start = token->text + token->length;
+      } else {
+        marker_group = SIZE_MAX;
+      }
+      continue;
+    }
+
+    // Top-level function declaration outside of marked groups
+    if (depth == 0 && marker_group == SIZE_MAX &&
+        js_token_equals(token, "function") &&
+        (previous == NULL || js_token_equals(previous, ";") ||
+         js_token_equals(previous, "}"))) {
+      // Parameters first, their default values may hold braces too
+      size_t end = i;
+      while (end < js_tokens->count &&
+             !js_token_equals(&js_tokens->tokens[end], "(")) {
+        end++;
+      }
+      end = skip_js_brackets(js_tokens, end);
+      while (end > 0 && end < js_tokens->count &&
+             (js_tokens->tokens[end].type == JS_TOKEN_WHITESPACE ||
+              js_tokens->tokens[end].type == JS_TOKEN_COMMENT)) {
+        end++;
+      }
+      bool body_found = end > 0 && end < js_tokens->count &&
+                        js_token_equals(&js_tokens->tokens[end], "{");
+      end = body_found ? skip_js_brackets(js_tokens, end) : 0;
+
+      if (end > 0) {
+        const JS_TOKEN *last = &js_tokens->tokens[end - 1];
+        add_unit_piece(pieces, &piece_count, token->text,
+                       last->text + last->length - token->text, 0, last);
+        previous = last;
+        i = end - 1;
+        continue;
+      }
+    }
+
+    if (unit_start == NULL) {
+      add_source_piece(pieces, &piece_count, token->text, token->length,
+                       SIZE_MAX);
+    }
+
+    if (token->type == JS_TOKEN_PUNCTUATOR && token->length == 1) {
+      depth += strchr("([{", token->text[0]) != NULL ? 1 : 0;
+      depth -= strchr(")]}", token->text[0]) != NULL && depth > 0 ? 1 : 0;
+    } else if (token->type == JS_TOKEN_TEMPLATE) {
+      depth += token->text[token->length - 1] == '{' ? 1 : 0;
+      depth -= token->text[0] == '}' && depth > 0 ? 1 : 0;
+    }
+
+    if (token->type != JS_TOKEN_WHITESPACE &&
+        token->type != JS_TOKEN_COMMENT) {
+      previous = token;
+    }
+  }
+
+  if (unit_start != NULL) {
+    const char *end = js_tokens->count > 0
+                          ? js_tokens->tokens[js_tokens->count - 1].text +
+                                js_tokens->tokens[js_tokens->count - 1].length
+                          : unit_start;
+    add_unit_piece(pieces, &piece_count, unit_start, end - unit_start,
+                   marker_group, previous);
+  }
+
+  return piece_count;
+}
+
+// Compares the names of two function declaration pieces
+bool js_function_names_equal(const SOURCE_PIECE *a, const SOURCE_PIECE *b) {
+  const char *name_a = a->text + strlen("function");
+  const char *name_b = b->text + strlen("function");
+  name_a += strspn(name_a, " \t\r\n*");
+  name_b += strspn(name_b, " \t\r\n*");
+
+  size_t length = 0;
+  while (is_js_identifier_char(name_a[length]) &&
+         is_js_identifier_char(name_b[length]) &&
+         name_a[length] == name_b[length]) {
+    length++;
+  }
+  return !is_js_identifier_char(name_a[length]) &&
+         !is_js_identifier_char(name_b[length]);
+}
+
+size_t render_reordered_javascript(const SOURCE_PIECE *pieces,
+                                   size_t piece_count, const size_t *order,
+                                   char *output) {
+  char *output_ptr = output;
+  for (size_t i = 0; i < piece_count; i++) {
+    const SOURCE_PIECE *piece = &pieces[order[i]];
+    if (piece->terminator_offset != SIZE_MAX) {
+      memcpy(output_ptr, piece->text, piece->terminator_offset);
+      output_ptr += piece->terminator_offset;
+      *output_ptr++ = ';';
+      memcpy(output_ptr, piece->text + piece->terminator_offset,
+             piece->length - piece->terminator_offset);
+      output_ptr += piece->length - piece->terminator_offset;
+    } else {
+      memcpy(output_ptr, piece->text, piece->length);
+      output_ptr += piece->length;
+    }
+  }
+  return output_ptr - output;
+}
+
+typedef struct REORDERING_CONTEXT {
+  const SOURCE_PIECE *pieces;
+  size_t piece_count;
+  // Positions of all units, grouped, and the group of each of them
+  const size_t *unit_positions;
+  const size_t *group_start;
+  const size_t *group_size;
+  const size_t *unit_group;
+  size_t unit_count;
+  size_t max_output_length;
+  int iterations;
+} REORDERING_CONTEXT;
+
+typedef struct REORDERING_JOB {
+  const REORDERING_CONTEXT *context;
+  uint64_t seed;
+  size_t *order;
+  size_t size;
+} REORDERING_JOB;
+
+// Moves the unit at one slot of a group to another slot, shifting the units
+// in between
+void move_unit(size_t *order, const size_t *positions, size_t from,
+               size_t to) {
+  size_t moved = order[positions[from]];
+  for (; from < to; from++) {
+    order[positions[from]] = order[positions[from + 1]];
+  }
+  for (; from > to; from--) {
+    order[positions[from]] = order[positions[from - 1]];
+  }
+  order[positions[to]] = moved;
+}
+
+void run_reordering_job(void *argument) {
+  REORDERING_JOB *job = argument;
+  const REORDERING_CONTEXT *context = job->context;
+
+  SIZE_ESTIMATOR estimator;
+  if (!init_size_estimator(&estimator)) {
+    return;
+  }
+
+  char *output = counted_malloc(context->max_output_length);
+  size_t *current = counted_malloc(sizeof(size_t) * context->piece_count);
+  memcpy(current, job->order, sizeof(size_t) * context->piece_count);
+
+  size_t length = render_reordered_javascript(
+      context->pieces, context->piece_count, current, output);
+  size_t current_size = estimate_compressed_size(
+      &estimator, (unsigned char *)output, length);
+  job->size = current_size;
+
+  uint64_t random_state = job->seed;
+  for (int iteration = 0; iteration < context->iterations; iteration++) {
+    // Move a random unit to another slot of its group
+    size_t unit = next_random(&random_state) % context->unit_count;
+    size_t group = context->unit_group[unit];
+    const size_t *positions =
+        context->unit_positions + context->group_start[group];
+    size_t from = unit - context->group_start[group];
+    size_t to = next_random(&random_state) % context->group_size[group];
+    if (from == to) {
+      continue;
+    }
+
+    move_unit(current, positions, from, to);
+    length = render_reordered_javascript(context->pieces, context->piece_count,
+                                         current, output);
+    size_t size = estimate_compressed_size(&estimator, (unsigned char *)output,
+                                           length);
+
+    double temperature =
+        2.0 * (1.0 - (double)iteration / (double)context->iterations);
+    if (annealing_accepts(size, current_size, temperature, &random_state)) {
+      current_size = size;
+      if (size < job->size) {
+        job->size = size;
+        memcpy(job->order, current, sizeof(size_t) * context->piece_count);
+      }
+    } else {
+      move_unit(current, positions, to, from);
+    }
+  }
+
+  counted_free(current);
+  counted_free(output);
+  free_size_estimator(&estimator);
+}
+
+// Reorders top-level units (function declarations and marked units) to the
+// order that compresses best. Orderings are searched by parallel simulated
+// annealing runs scored with the fast estimator, the best one is confirmed
+// with the real compression. Returns a new string or NULL if reordering does
+// not pay off.
+char *reorder_units(const char *javascript, USER_OPTIONS *user_options,
+                    COMPRESSION_STATISTICS *compression_statistics) {
+  size_t javascript_length = strlen(javascript);
+  JS_TOKENS js_tokens;
+  if (!tokenize_javascript(javascript, javascript_length, &js_tokens)) {
+    return NULL;
+  }
+
+  SOURCE_PIECE *pieces =
+      counted_malloc(sizeof(SOURCE_PIECE) * (js_tokens.count + 1));
+  size_t group_count;
+  size_t piece_count = split_reorderable_units(&js_tokens, pieces,
+                                               &group_count);
+
+  // Function declarations with the same name override each other in order, so
+  // they stay fixed
+  for (size_t i = 0; i < piece_count; i++) {
+    for (size_t j = i + 1; j < piece_count && pieces[i].group == 0; j++) {
+      if (pieces[j].group == 0 && js_function_names_equal(&pieces[i],
+                                                           &pieces[j])) {
+        for (size_t k = 0; k < piece_count; k++) {
+          pieces[k].group = pieces[k].group == 0 ? SIZE_MAX : pieces[k].group;
+        }
+      }
+    }
+  }
+
+  // Collect unit positions per group, groups need at least two units
+  size_t *group_start = counted_calloc(group_count, sizeof(size_t));
+  size_t *group_size = counted_calloc(group_count, sizeof(size_t));
+  size_t *unit_positions = counted_malloc(sizeof(size_t) * (piece_count + 1));
+  size_t *unit_group = counted_malloc(sizeof(size_t) * (piece_count + 1));
+  size_t unit_count = 0;
+  for (size_t group = 0; group < group_count; group++) {
+    group_start[group] = unit_count;
+    for (size_t i = 0; i < piece_count; i++) {
+      if (pieces[i].group == group) {
+        unit_positions[unit_count + group_size[group]++] = i;
+      }
+    }
+    if (group_size[group] >= 2) {
+      for (size_t i = 0; i < group_size[group]; i++) {
+        unit_group[unit_count + i] = group;
+      }
+      unit_count += group_size[group];
+    } else {
+      group_size[group] = 0;
+    }
+  }
+
+  char *result = NULL;
+  if (unit_count > 0) {
+    size_t *order = counted_malloc(sizeof(size_t) * piece_count);
+    size_t max_output_length = 0;
+    for (size_t i = 0; i < piece_count; i++) {
+      order[i] = i;
+      max_output_length +=
+          pieces[i].length + (pieces[i].terminator_offset != SIZE_MAX);
+    }
+
+    REORDERING_CONTEXT context = {pieces,       piece_count, unit_positions,
+                                  group_start,  group_size,  unit_group,
+                                  unit_count,   max_output_length,
+                                  user_options->reorder_iterations};
+
+    size_t job_count = search_chain_count(user_options);
+    REORDERING_JOB *jobs = counted_malloc(sizeof(REORDERING_JOB) * job_count);
+    for (size_t i = 0; i < job_count; i++) {
+      jobs[i].context = &context;
+      jobs[i].seed = search_chain_seed(i);
+      jobs[i].order = counted_malloc(sizeof(size_t) * piece_count);
+      memcpy(jobs[i].order, order, sizeof(size_t) * piece_count);
+      jobs[i].size = SIZE_MAX;
+    }
+
+    run_parallel(run_reordering_job, jobs, sizeof(REORDERING_JOB), job_count,
+                 user_options->thread_count);
+
+    size_t best_job = 0;
+    for (size_t i = 1; i < job_count; i++) {
+      if (jobs[i].size < jobs[best_job].size) {
+        best_job = i;
+      }
+    }
+
+    // Confirm with real compression of the embedded image
+    char *reordered = counted_calloc(max_output_length + 1, 1);
+    render_reordered_javascript(pieces, piece_count, jobs[best_job].order,
+                                reordered);
+
+    size_t original_size = compressed_javascript_size(javascript, user_options);
+    size_t reordered_size = compressed_javascript_size(reordered, user_options);
+
+    if (reordered_size > 0 && reordered_size < original_size) {
+      result = reordered;
+      compression_statistics->reordered_units = unit_count;
+      compression_statistics->reordering_saved_bytes =
+          original_size - reordered_size;
+    } else {
+      counted_free(reordered);
+    }
+
+    for (size_t i = 0; i < job_count; i++) {
+      counted_free(jobs[i].order);
+    }
+    counted_free(jobs);
+    counted_free(order);
+  }
+
+  counted_free(unit_group);
+  counted_free(unit_positions);
+  counted_free(group_size);
+  counted_free(group_start);
+  counted_free(pieces);
+  counted_free(js_tokens.tokens);
+
+  return result;
+}
+
+// Keywords that get a space in front of a following punctuator or literal
+// when keyword spacing is chosen
+const char *JS_SPACED_KEYWORDS[] = {
+    "return", "typeof", "instanceof", "in",  "of",    "new",   "delete",
+    "void",   "throw",  "case",       "do",  "else",  "yield", "await",
+    "var",    "let",    "const"};
+
+// Punctuators that cannot end a statement and punctuators that cannot start
+// one. A line break next to them is never subject to automatic semicolon
+// insertion.
+const char *JS_NO_STATEMENT_END[] = {
+    "{",  "(",  "[",   ",",   ";",   ":",   "?",   ".",  "?.",  "=",   "+=",
+    "-=", "*=", "/=",  "%=",  "&=",  "|=",  "^=",  "<<=", ">>=", ">>>=",
+    "**=", "&&=", "||=", "?\?=", "==", "===", "!=", "!==", "<",  ">",   "<=",
+    ">=", "+",  "-",   "*",   "/",   "%",   "**",  "&",   "|",   "^",   "!",
+    "~",  "&&", "||",  "??",  "<<",  ">>",  ">>>", "=>"};
+
+const char *JS_NO_STATEMENT_START[] = {
+    ")",   "]",   "}",   ",",   ";",   ":",   "?",   ".",   "?.",  "=",
+    "+=",  "-=",  "*=",  "/=",  "%=",  "&=",  "|=",  "^=",  "<<=", ">>=",
+    ">>>=", "**=", "&&=", "||=", "?\?=", "==",  "===", "!=",  "!==", "<",
+    ">",   "<=",  ">=",  "*",   "/",   "%",   "**",  "&",   "|",   "^",
+    "&&",  "||",  "??",  "<<",  ">>",  ">>>", "=>"};
+
+bool is_js_significant(const JS_TOKEN *token) {
+  return token->type != JS_TOKEN_WHITESPACE && token->type != JS_TOKEN_COMMENT;
+}
+
+// Checks if whitespace or comments between two tokens contain a line break
+bool js_line_break_between(const JS_TOKEN *from, const JS_TOKEN *to) {
+  for (const JS_TOKEN *token = from + 1; token < to; token++) {
+    if (memchr(token->text, '\n', token->length) != NULL ||
+        memchr(token->text, '\r', token->length) != NULL) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Checks if a line break between two significant tokens has to be kept
+// because automatic semicolon insertion (or a restricted production like
+// return or postfix ++) may depend on it
+bool js_line_break_required(const JS_TOKEN *previous, const JS_TOKEN *next) {
+  if (previous->type == JS_TOKEN_PUNCTUATOR &&
+      js_token_in_list(previous, JS_NO_STATEMENT_END,
+                       sizeof(JS_NO_STATEMENT_END) / sizeof(char *))) {
+    return false;
+  }
+  if (previous->type == JS_TOKEN_TEMPLATE &&
+      previous->text[previous->length - 1] == '{') {
+    return false;
+  }
+  return !(next->type == JS_TOKEN_PUNCTUATOR &&
+           js_token_in_list(next, JS_NO_STATEMENT_START,
+                            sizeof(JS_NO_STATEMENT_START) / sizeof(char *)));
+}
+
+// Checks if two tokens written without separator would be read differently
+bool js_tokens_need_space(const char *previous_text, size_t previous_length,
+                          const JS_TOKEN *previous, const JS_TOKEN *next) {
+  char last = previous_text[previous_length - 1];
+  char first = next->text[0];
+
+  // Identifiers, keywords, numbers and regexp flags
+  if (is_js_identifier_char(last) && is_js_identifier_char(first)) {
+    return true;
+  }
+
+  // Number followed by a property access, as in '1 .toString()'
+  if (previous->type == JS_TOKEN_NUMBER && first == '.') {
+    size_t i = 0;
+    while (i < previous_length &&
+           strchr(".eExXoObB", previous_text[i]) == NULL) {
+      i++;
+    }
+    if (i == previous_length) {
+      return true;
+    }
+  }
+
+  // Regular expression followed by an identifier would take it as flags
+  if (previous->type == JS_TOKEN_REGEXP && is_js_identifier_char(first)) {
+    return true;
+  }
+
+  // Comments, '+ +', '- -' and the html comment opener '<!--'
+  return (last == '/' && (first == '/' || first == '*')) ||
+         (last == '+' && first == '+') || (last == '-' && first == '-') ||
+         (last == '<' && first == '!');
+}
+
+// Checks if a ';' can be dropped. It must be followed by '}' or the end of
+// the source, and must not be an empty statement body or follow a label.
+bool js_semicolon_droppable(const JS_TOKEN *previous, const JS_TOKEN *next) {
+  return (next == NULL || js_token_equals(next, "}")) && previous != NULL &&
+         !js_token_equals(previous, ")") &&
+         !js_token_equals(previous, "else") &&
+         !js_token_equals(previous, "do") && !js_token_equals(previous, ":") &&
+         !js_token_equals(previous, ";");
+}
+
+// Writes a string literal with the given quote character, re-escaping quotes
+// as needed. Returns the written length.
+size_t write_js_string(const JS_TOKEN *token, char quote, char *output) {
+  char original_quote = token->text[0];
+  char *output_ptr = output;
+  *output_ptr++ = quote;
+  for (size_t i = 1; i + 1 < token->length; i++) {
+    if (token->text[i] == '\\') {
+      // Escaped original quote is not needed with other quotes
+      if (token->text[i + 1] != original_quote || original_quote == quote) {
+        *output_ptr++ = '\\';
+      }
+      *output_ptr++ = token->text[++i];
+    } else {
+      if (token->text[i] == quote) {
+        *output_ptr++ = '\\';
+      }
+      *output_ptr++ = token->text[i];
+    }
+  }
+  *output_ptr++ = quote;
+  return output_ptr - output;
+}
+
+// Number of escapes needed to write a string literal with the given quote
+size_t count_js_string_escapes(const JS_TOKEN *token, char quote) {
+  size_t count = 0;
+  for (size_t i = 1; i + 1 < token->length; i++) {
+    i += token->text[i] == '\\' ? 1 : 0;
+    count += token->text[i] == quote ? 1 : 0;
+  }
+  return count;
+}
+
+// Writes a decimal number in its shortest form: no leading zero before the
+// fraction, no trailing zeros in the fraction and exponent notation for
+// integers with 3 or more trailing zeros. Other number formats are kept.
+// Returns the written length.
+size_t write_js_number(const JS_TOKEN *token, const JS_TOKEN *next,
+                       char *output) {
+  char text[64];
+  size_t length = token->length;
+  bool decimal = length < sizeof(text) && strspn(token->text, "0123456789.") ==
+                                              length;
+  if (!decimal || (length > 1 && token->text[0] == '0' &&
+                   token->text[1] != '.')) {
+    memcpy(output, token->text, length);
+    return length;
+  }
+
+  memcpy(text, token->text, length);
+  text[length] = '\0';
+
+  char *fraction = strchr(text, '.');
+  if (fraction != NULL) {
+    // Trailing zeros of the fraction, keep at least one fraction digit
+    while (length > (size_t)(fraction - text) + 2 && text[length - 1] == '0') {
+      text[--length] = '\0';
+    }
+    // Leading zero of the integer part
+    if (text[0] == '0' && fraction == text + 1 && length > 2) {
+      memmove(text, text + 1, length--);
+    }
+  } else if (!js_token_equals(next, ".")) {
+    size_t zeros = 0;
+    while (zeros + 1 < length && text[length - 1 - zeros] == '0') {
+      zeros++;
+    }
+    if (zeros >= 3) {
+      length = length - zeros +
+               snprintf(text + length - zeros, sizeof(text) - length + zeros,
+                        "e%lu", zeros);
+    }
+  }
+
+  memcpy(output, text, length);
+  return length;
+}
+
+// Writes minified javascript. Comments are removed, whitespace is reduced to
+// what separates tokens or to line breaks that automatic semicolon insertion
+// may depend on. Returns the written length.
+size_t minify_javascript(const JS_TOKENS *js_tokens,
+                         const MINIFY_CHOICES *choices, char *output) {
+  char *output_ptr = output;
+  const JS_TOKEN *previous = NULL;
+  const char *previous_text = NULL;
+  size_t previous_length = 0;
+
+  for (size_t i = 0; i < js_tokens->count; i++) {
+    const JS_TOKEN *token = &js_tokens->tokens[i];
+    if (!is_js_significant(token)) {
+      continue;
+    }
+
+    const JS_TOKEN *next = NULL;
+    for (size_t j = i + 1; j < js_tokens->count && next == NULL; j++) {
+      next = is_js_significant(&js_tokens->tokens[j]) ? &js_tokens->tokens[j]
+                                                      : NULL;
+    }
+
+    if (choices->drop_semicolons && js_token_equals(token, ";") &&
+        js_semicolon_droppable(previous, next)) {
+      continue;
+    }
+
+    // Separator between the previous and this token
+    if (previous != NULL) {
+      if (js_line_break_between(previous, token) &&
+          js_line_break_required(previous, token)) {
+        *output_ptr++ = '\n';
+      } else if (js_tokens_need_space(previous_text, previous_length, previous,
+                                      token) ||
+                 (choices->keyword_spacing &&
+                  previous->type == JS_TOKEN_IDENTIFIER &&
+                  js_token_in_list(previous, JS_SPACED_KEYWORDS,
+                                   sizeof(JS_SPACED_KEYWORDS) /
+                                       sizeof(char *)) &&
+                  !(token->type == JS_TOKEN_PUNCTUATOR &&
+                    strchr(";),}]:.", token->text[0]) != NULL))) {
+        *output_ptr++ = ' ';
+      }
+    }
+
+    char *token_start = output_ptr;
+    if (token->type == JS_TOKEN_STRING &&
+        choices->quote_style != QUOTE_STYLE_KEEP) {
+      char quote = choices->quote_style == QUOTE_STYLE_DOUBLE ? '"' : '\'';
+      if (choices->quote_style == QUOTE_STYLE_FEWEST_ESCAPES) {
+        quote = count_js_string_escapes(token, '"') <
+                        count_js_string_escapes(token, '\'')
+                    ? '"'
+                    : '\'';
+      }
+      output_ptr += write_js_string(token, quote, output_ptr);
+    } else if (token->type == JS_TOKEN_NUMBER && choices->short_numbers) {
+      output_ptr += write_js_number(token, next, output_ptr);
+    } else {
+      memcpy(output_ptr, token->text, token->length);
+      output_ptr += token->length;
+    }
+
+    previous = token;
+    previous_text = token_start;
+    previous_length = output_ptr - token_start;
+  }
+
+  return output_ptr - output;
+}
+
+// Compares two string literals by value, ignoring the quote style
+bool js_strings_equal(const JS_TOKEN *a, const JS_TOKEN *b) {
+  size_t i = 1;
+  size_t j = 1;
+  while (i + 1 < a->length && j + 1 < b->length) {
+    // Escaped quotes and bare quotes are the same character
+    bool a_quote = a->text[i] == '\\' &&
+                   (a->text[i + 1] == '\'' || a->text[i + 1] == '"');
+    bool b_quote = b->text[j] == '\\' &&
+                   (b->text[j + 1] == '\'' || b->text[j + 1] == '"');
+    i += a_quote ? 1 : 0;
+    j += b_quote ? 1 : 0;
+    if (a->text[i] != b->text[j]) {
+      return false;
+    }
+    if (a->text[i] == '\\' && !a_quote) {
+      if (a->text[++i] != b->text[++j]) {
+        return false;
+      }
+    }
+    i++;
+    j++;
+  }
+  return i + 1 == a->length && j + 1 == b->length;
+}
+
+bool js_numbers_equal(const JS_TOKEN *a, const JS_TOKEN *b) {
+  if (a->length == b->length && strncmp(a->text, b->text, a->length) == 0) {
+    return true;
+  }
+
+  char a_text[64];
+  char b_text[64];
+  if (a->length >= sizeof(a_text) || b->length >= sizeof(b_text)) {
+    return false;
+  }
+  memcpy(a_text, a->text, a->length);
+  a_text[a->length] = '\0';
+  memcpy(b_text, b->text, b->length);
+  b_text[b->length] = '\0';
+  return strtod(a_text, NULL) == strtod(b_text, NULL);
+}
+
+// Round-trip check of the minifier: tokenizes the minified javascript again
+// and compares it token by token with the original. Strings are compared by
+// value, numbers by numeric value, droppable semicolons are skipped on both
+// sides and required line breaks must still be there.
+bool verify_minified_javascript(const JS_TOKENS *original,
+                                const char *minified, size_t length) {
+  JS_TOKENS result;
+  if (!tokenize_javascript(minified, length, &result)) {
+    return false;
+  }
+
+  bool equal = true;
+  const JS_TOKEN *tokens[2] = {NULL, NULL};
+  const JS_TOKEN *previous[2] = {NULL, NULL};
+  const JS_TOKENS *streams[2] = {original, &result};
+  size_t positions[2] = {0, 0};
+
+  while (equal) {
+    // Next significant, not droppable token of each stream
+    for (int s = 0; s < 2; s++) {
+      tokens[s] = NULL;
+      while (tokens[s] == NULL && positions[s] < streams[s]->count) {
+        const JS_TOKEN *token = &streams[s]->tokens[positions[s]++];
+        if (!is_js_significant(token)) {
+          continue;
+        }
+        const JS_TOKEN *next = NULL;
+        for (size_t j = positions[s]; j < streams[s]->count && next == NULL;
+             j++) {
+          next = is_js_significant(&streams[s]->tokens[j])
+                     ? &streams[s]->tokens[j]
+                     : NULL;
+        }
+        if (js_token_equals(token, ";") &&
+            js_semicolon_droppable(previous[s], next)) {
+          continue;
+        }
+        tokens[s] = token;
+      }
+    }
+
+    if (tokens[0] == NULL || tokens[1] == NULL) {
+      equal = tokens[0] == tokens[1];
+      break;
+    }
+
+    if (tokens[0]->type != tokens[1]->type) {
+      equal = false;
+    } else if (tokens[0]->type == JS_TOKEN_STRING) {
+      equal = js_strings_equal(tokens[0], tokens[1]);
+    } else if (tokens[0]->type == JS_TOKEN_NUMBER) {
+      equal = js_numbers_equal(tokens[0], tokens[1]);
+    } else {
+      equal = tokens[0]->length == tokens[1]->length &&
+              strncmp(tokens[0]->text, tokens[1]->text, tokens[0]->length) ==
+                  0;
+    }
+
+    if (equal && previous[0] != NULL &&
+        js_line_break_between(previous[0], tokens[0]) &&
+        js_line_break_required(previous[0], tokens[0])) {
+      equal = js_line_break_between(previous[1], tokens[1]);
+    }
+
+    previous[0] = tokens[0];
+    previous[1] = tokens[1];
+  }
+
+  counted_free(result.tokens);
+  return equal;
+}
+
+typedef struct MINIFY_JOB {
+  const JS_TOKENS *js_tokens;
+  MINIFY_CHOICES choices;
+  size_t max_output_length;
+  size_t size;
+} MINIFY_JOB;
+
+void run_minify_job(void *argument) {
+  MINIFY_JOB *job = argument;
+
+  SIZE_ESTIMATOR estimator;
+  if (!init_size_estimator(&estimator)) {
+    return;
+  }
+
+  char *output = counted_malloc(job->max_output_length);
+  size_t length = minify_javascript(job->js_tokens, &job->choices, output);
+  job->size =
+      estimate_compressed_size(&estimator, (unsigned char *)output, length);
+
+  counted_free(output);
+  free_size_estimator(&estimator);
+}
+
+// Minifies the javascript source. All combinations of formatting choices are
+// scored in parallel with the fast estimator, the best one is checked by the
+// round-trip verifier and confirmed with the real compression. Returns a new
+// string or NULL if minifying fails or does not pay off.
+char *minify(const char *javascript, USER_OPTIONS *user_options,
+             COMPRESSION_STATISTICS *compression_statistics) {
+  size_t javascript_length = strlen(javascript);
+  JS_TOKENS js_tokens;
+  if (!tokenize_javascript(javascript, javascript_length, &js_tokens)) {
+    return NULL;
+  }
+
+  // Quotes may need escapes, keyword spacing adds a space per token
+  size_t max_output_length = 2 * javascript_length + js_tokens.count + 1;
+
+  size_t job_count = QUOTE_STYLE_COUNT * 2 * 2 * 2;
+  MINIFY_JOB *jobs = counted_malloc(sizeof(MINIFY_JOB) * job_count);
+  for (size_t i = 0; i < job_count; i++) {
+    MINIFY_CHOICES choices = {(QUOTE_STYLE)(i >> 3), (i & 4) != 0,
+                              (i & 2) != 0, (i & 1) != 0};
+    MINIFY_JOB job = {&js_tokens, choices, max_output_length, SIZE_MAX};
+    jobs[i] = job;
+  }
+
+  run_parallel(run_minify_job, jobs, sizeof(MINIFY_JOB), job_count,
+               user_options->thread_count);
+
+  size_t best_job = 0;
+  for (size_t i = 1; i < job_count; i++) {
+    if (jobs[i].size < jobs[best_job].size) {
+      best_job = i;
+    }
+  }
+
+  char *result = counted_calloc(max_output_length + 1, 1);
+  size_t length =
+      minify_javascript(&js_tokens, &jobs[best_job].choices, result);
+
+  if (!verify_minified_javascript(&js_tokens, result, length)) {
+    printf("Minified javascript failed the round-trip check, not minifying\n");
+    counted_free(result);
+    result = NULL;
+  } else {
+    size_t original_size = compressed_javascript_size(javascript, user_options);
+    size_t minified_size = compressed_javascript_size(result, user_options);
+    if (minified_size > 0 && minified_size < original_size) {
+      compression_statistics->minify_choices = jobs[best_job].choices;
+      compression_statistics->minified = true;
+      compression_statistics->minify_saved_bytes =
+          original_size - minified_size;
+    } else {
+      counted_free(result);
+      result = NULL;
+    }
+  }
+
+  counted_free(jobs);
+  counted_free(js_tokens.tokens);
+
+  return result;
+}
+
+// Orders evaluated at most when bundling, all orders of up to 8 inputs. Orders
+// of more inputs are refined by refine_bundle_order.
+const size_t MAX_BUNDLE_ORDERS = 40320;
+
+// Parses '--depends=file:dependency,...' declarations into a matrix where
+// entry [file * count + dependency] is set if the dependency has to come
+// before the file. Returns false on unknown file names.
+bool parse_bundle_dependencies(USER_OPTIONS *user_options,
+                               bool *dependencies) {
+  size_t count = user_options->javascript_path_count;
+  for (size_t d = 0; d < user_options->dependency_count; d++) {
+    const char *declaration = user_options->dependencies[d];
+    size_t file_length = strcspn(declaration, ":");
+
+    size_t file = 0;
+    while (file < count &&
+           !(strlen(user_options->javascript_paths[file]) == file_length &&
+             strncmp(user_options->javascript_paths[file], declaration,
+                     file_length) == 0)) {
+      file++;
+    }
+    if (file == count || declaration[file_length] != ':') {
+      printf("Unknown file in dependency '%s'\n", declaration);
+      return false;
+    }
+
+    const char *list = declaration + file_length + 1;
+    for (size_t length; *list != '\0'; list += length + (list[length] == ',')) {
+      length = strcspn(list, ",");
+      size_t dependency = 0;
+      while (dependency < count &&
+             !(strlen(user_options->javascript_paths[dependency]) == length &&
+               strncmp(user_options->javascript_paths[dependency], list,
+                       length) == 0)) {
+        dependency++;
+      }
+      if (dependency == count) {
+        printf("Unknown dependency in '%s'\n", declaration);
+        return false;
+      }
+      dependencies[file * count + dependency] = true;
+    }
+  }
+  return true;
+}
+
+// Enumerates orders of the inputs that respect the dependencies, in
+// lexicographic order of input indices. Returns the number of orders found.
+size_t enumerate_bundle_orders(const bool *dependencies, size_t count,
+                               size_t *order, size_t position, bool *placed,
+                               size_t *orders, size_t max_orders,
+                               size_t found) {
+  if (position == count) {
+    memcpy(orders + found * count, order, sizeof(size_t) * count);
+    return found + 1;
+  }
+
+  for (size_t file = 0; file < count && found < max_orders; file++) {
+    bool ready = !placed[file];
+    for (size_t dependency = 0; dependency < count && ready; dependency++) {
+      ready = !dependencies[file * count + dependency] || placed[dependency];
+    }
+    if (ready) {
+      placed[file] = true;
+      order[position] = file;
+      found = enumerate_bundle_orders(dependencies, count, order, position + 1,
+                                      placed, orders, max_orders, found);
+      placed[file] = false;
+    }
+  }
+
+  return found;
+}
+
+// Refines an order of more inputs than the enumeration covers: moves single
+// inputs to other positions as long as that shrinks the score and respects
+// the dependencies. The enumerated orders only differ in their last inputs,
+// this reaches all positions. Returns the score of the refined order.
+size_t refine_bundle_order(size_t *order, size_t count,
+                           const bool *dependencies,
+                           size_t (*score)(const size_t *order, void *context),
+                           void *context) {
+  size_t *candidate = counted_malloc(sizeof(size_t) * count);
+  size_t best_score = score(order, context);
+  for (bool improved = true; improved;) {
+    improved = false;
+    for (size_t from = 0; from < count; from++) {
+      for (size_t to = 0; to < count; to++) {
+        if (to == from) {
+          continue;
+        }
+        size_t moved = order[from];
+        size_t k = 0;
+        for (size_t i = 0; i < count; i++) {
+          if (k == to) {
+            candidate[k++] = moved;
+          }
+          if (i != from) {
+            candidate[k++] = order[i];
+          }
+        }
+        if (k == to) {
+          candidate[k] = moved;
+        }
+
+        bool valid = true;
+        for (size_t i = 0; i < count && valid; i++) {
+          for (size_t j = i + 1; j < count && valid; j++) {
+            valid = !dependencies[candidate[i] * count + candidate[j]];
+          }
+        }
+        size_t candidate_score = valid ? score(candidate, context) : SIZE_MAX;
+        if (candidate_score < best_score) {
+          best_score = candidate_score;
+          memcpy(order, candidate, sizeof(size_t) * count);
+          improved = true;
+        }
+      }
+    }
+  }
+  counted_free(candidate);
+  return best_score;
+}
+
+// Inputs are joined with a line break, pieces alternate between inputs and
+// line breaks. Returns the rendered length.
+size_t render_bundle(const SOURCE_PIECE *inputs, size_t count,
+                     const size_t *order, char *output) {
+  SOURCE_PIECE *pieces = counted_malloc(sizeof(SOURCE_PIECE) * 2 * count);
+  size_t *piece_order = counted_malloc(sizeof(size_t) * 2 * count);
+  SOURCE_PIECE line_break = {"\n", 1, SIZE_MAX, SIZE_MAX};
+  for (size_t i = 0; i < count; i++) {
+    pieces[2 * i] = inputs[order[i]];
+    pieces[2 * i + 1] = line_break;
+    piece_order[2 * i] = 2 * i;
+    piece_order[2 * i + 1] = 2 * i + 1;
+  }
+
+  size_t length =
+      render_reordered_javascript(pieces, 2 * count - 1, piece_order, output);
+
+  counted_free(piece_order);
+  counted_free(pieces);
+  return length;
+}
+
+typedef struct BUNDLE_JOB {
+  const SOURCE_PIECE *inputs;
+  size_t count;
+  const size_t *orders;
+  size_t first_order;
+  size_t order_count;
+  size_t max_output_length;
+  size_t best_order;
+  size_t size;
+} BUNDLE_JOB;
+
+typedef struct BUNDLE_ORDER_SCORE {
+  const SOURCE_PIECE *inputs;
+  size_t count;
+  char *output;
+  SIZE_ESTIMATOR *estimator;
+} BUNDLE_ORDER_SCORE;
+
+size_t score_bundle_order(const size_t *order, void *context) {
+  BUNDLE_ORDER_SCORE *bundle = context;
+  size_t length =
+      render_bundle(bundle->inputs, bundle->count, order, bundle->output);
+  return estimate_compressed_size(bundle->estimator,
+                                  (unsigned char *)bundle->output, length);
+}
+
+// Scores a slice of the candidate orders with the fast estimator
+void run_bundle_job(void *argument) {
+  BUNDLE_JOB *job = argument;
+
+  SIZE_ESTIMATOR estimator;
+  if (!init_size_estimator(&estimator)) {
+    return;
+  }
+
+  char *output = counted_malloc(job->max_output_length);
+  for (size_t i = job->first_order; i < job->first_order + job->order_count;
+       i++) {
+    size_t length = render_bundle(job->inputs, job->count,
+                                  job->orders + i * job->count, output);
+    size_t size =
+        estimate_compressed_size(&estimator, (unsigned char *)output, length);
+    if (size < job->size) {
+      job->size = size;
+      job->best_order = i;
+    }
+  }
+
+  counted_free(output);
+  free_size_estimator(&estimator);
+}
+
+// Reads all javascript inputs and concatenates them in the order that
+// compresses best while respecting declared dependencies. Candidate orders are
+// scored in parallel with the fast estimator, the best one is confirmed with
+// the real compression against the command line order. Returns the bundled
+// javascript or NULL on failure.
+char *bundle_javascript(USER_OPTIONS *user_options,
+                        COMPRESSION_STATISTICS *compression_statistics) {
+  size_t count = user_options->javascript_path_count;
+  char **texts = counted_calloc(count, sizeof(char *));
+  JS_TOKENS *js_tokens = counted_calloc(count, sizeof(JS_TOKENS));
+  SOURCE_PIECE *inputs = counted_malloc(sizeof(SOURCE_PIECE) * count);
+  bool *dependencies = counted_calloc(count * count, sizeof(bool));
+  size_t *orders = counted_malloc(sizeof(size_t) * count * MAX_BUNDLE_ORDERS);
+  char *result = NULL;
+
+  // Inputs without trailing whitespace, terminated by ';' after their last
+  // token so that no input continues the statement of its predecessor
+  size_t max_output_length = 1;
+  size_t i = 0;
+  for (; i < count; i++) {
+    texts[i] = read_text_file(user_options->javascript_paths[i]);
+    if (texts[i] == NULL) {
+      break;
+    }
+
+    size_t length = strlen(texts[i]);
+    while (length > 0 && strchr(" \t\r\n", texts[i][length - 1]) != NULL) {
+      length--;
+    }
+    if (!tokenize_javascript(texts[i], length, &js_tokens[i])) {
+      printf("Failed to tokenize '%s'\n", user_options->javascript_paths[i]);
+      break;
+    }
+
+    SOURCE_PIECE input = {texts[i], length, 0, SIZE_MAX};
+    for (size_t t = js_tokens[i].count; t > 0; t--) {
+      const JS_TOKEN *token = &js_tokens[i].tokens[t - 1];
+      if (is_js_significant(token)) {
+        if (!js_token_equals(token, ";")) {
+          input.terminator_offset = token->text + token->length - texts[i];
+        }
+        break;
+      }
+    }
+    inputs[i] = input;
+    max_output_length += length + 2;
+  }
+
+  if (i == count && parse_bundle_dependencies(user_options, dependencies)) {
+    size_t *order = counted_malloc(sizeof(size_t) * count);
+    bool *placed = counted_calloc(count, sizeof(bool));
+    size_t order_count =
+        enumerate_bundle_orders(dependencies, count, order, 0, placed, orders,
+                                MAX_BUNDLE_ORDERS, 0);
+    counted_free(placed);
+    counted_free(order);
+
+    if (order_count == 0) {
+      printf("Dependencies between javascript inputs are circular\n");
+    } else {
+      // Slices of orders, a few per thread to balance the load
+      size_t job_count =
+          min(order_count, (size_t)user_options->thread_count * 4);
+      BUNDLE_JOB *jobs = counted_malloc(sizeof(BUNDLE_JOB) * job_count);
+      for (size_t j = 0; j < job_count; j++) {
+        size_t first = order_count * j / job_count;
+        size_t last = order_count * (j + 1) / job_count;
+        BUNDLE_JOB job = {inputs, count, orders, first, last - first,
+                          max_output_length, first, SIZE_MAX};
+        jobs[j] = job;
+      }
+
+      run_parallel(run_bundle_job, jobs, sizeof(BUNDLE_JOB), job_count,
+                   user_options->thread_count);
+
+      size_t best_job = 0;
+      for (size_t j = 1; j < job_count; j++) {
+        if (jobs[j].size < jobs[best_job].size) {
+          best_job = j;
+        }
+      }
+      size_t *best_order = orders + jobs[best_job].best_order * count;
+
+      // All orders fill the buffer if the enumeration stopped early
+      size_t *refined_order = NULL;
+      SIZE_ESTIMATOR estimator;
+      if (order_count == MAX_BUNDLE_ORDERS && init_size_estimator(&estimator)) {
+        refined_order = counted_malloc(sizeof(size_t) * count);
+        memcpy(refined_order, best_order, sizeof(size_t) * count);
+        BUNDLE_ORDER_SCORE score = {inputs, count,
+                                    counted_malloc(max_output_length),
+                                    &estimator};
+        refine_bundle_order(refined_order, count, dependencies,
+                            score_bundle_order, &score);
+        counted_free(score.output);
+        free_size_estimator(&estimator);
+        best_order = refined_order;
+        compression_statistics->bundle_search_truncated = true;
+      }
+
+      // Command line order is the first one if it respects the dependencies
+      result = counted_calloc(max_output_length, 1);
+      render_bundle(inputs, count, best_order, result);
+
+      bool command_line_order = true;
+      for (size_t j = 0; j < count; j++) {
+        command_line_order = command_line_order && orders[j] == j;
+      }
+
+      if (command_line_order && best_order != orders) {
+        char *original = counted_calloc(max_output_length, 1);
+        render_bundle(inputs, count, orders, original);
+
+        size_t original_size = compressed_javascript_size(original,
+                                                          user_options);
+        size_t bundled_size = compressed_javascript_size(result, user_options);
+        if (bundled_size == 0 || bundled_size >= original_size) {
+          counted_free(result);
+          result = original;
+          best_order = orders;
+        } else {
+          counted_free(original);
+          compression_statistics->bundle_saved_bytes =
+              original_size - bundled_size;
+        }
+      }
+
+      compression_statistics->bundle_count = count;
+      compression_statistics->bundle_order =
+          counted_malloc(sizeof(char *) * count);
+      for (size_t j = 0; j < count; j++) {
+        compression_statistics->bundle_order[j] =
+            user_options->javascript_paths[best_order[j]];
+      }
+      counted_free(refined_order);
+
+      counted_free(jobs);
+    }
+  }
+
+  for (size_t j = 0; j < count; j++) {
+    counted_free(texts[j]);
+    counted_free(js_tokens[j].tokens);
+  }
+  counted_free(orders);
+  counted_free(dependencies);
+  counted_free(inputs);
+  counted_free(js_tokens);
+  counted_free(texts);
+
+  return result;
+}
+
+// Reads a binary file. Returns NULL on failure.
+unsigned char *read_binary_file(const char *file_path, size_t *size) {
+  unsigned char *data = NULL;
+  FILE *file = fopen(file_path, "rb");
+
+  if (file != NULL) {
+    fseek(file, 0, SEEK_END);
+    *size = ftell(file);
+    rewind(file);
+
+    // Allocate at least one byte so that empty files are not NULL
+    data = counted_malloc(*size + 1);
+
+    if (fread(data, 1, *size, file) != *size) {
+      printf("Failed to read file '%s'\n", file_path);
+      counted_free(data);
+      data = NULL;
+    }
+
+    fclose(file);
+  } else {
+    printf("Failed to open file '%s'\n", file_path);
+  }
+
+  return data;
+}
+
+// Writes a whole file at once. Returns false on failure.
+bool write_binary_file(const char *file_path, const unsigned char *data,
+                       size_t size) {
+  FILE *file = fopen(file_path, "wb");
+  if (file == NULL) {
+    return false;
+  }
+  bool success = fwrite(data, 1, size, file) == size;
+  return fclose(file) == 0 && success;
+}
+
+// Builds the payload of javascript and segments: javascript, \0 end marker and
+// the segments back to back in the given order. Returns the payload length.
+size_t build_segment_payload(const char *javascript, size_t javascript_length,
+                             const SEGMENT *segments, const size_t *order,
+                             size_t segment_count, unsigned char *payload) {
+  memcpy(payload, javascript, javascript_length);
+  payload[javascript_length] = 0;
+  size_t length = javascript_length + 1;
+  for (size_t i = 0; i < segment_count; i++) {
+    memcpy(payload + length, segments[order[i]].data,
+           segments[order[i]].size);
+    length += segments[order[i]].size;
+  }
+  return length;
+}
+
+// Bytes on each side of a boundary between segments that the scores of
+// pairs cover, the deflate window
+const size_t SEGMENT_BOUNDARY_WINDOW = 32768;
+
+// Scores the boundaries from one part of the payload (the javascript with
+// its end marker, or a segment) to each segment: the estimated size of the
+// segment's start after the part's end, less that of the part's end alone
+typedef struct SEGMENT_BOUNDARY_JOB {
+  const unsigned char *part;
+  size_t part_size;
+  size_t part_index;
+  const SEGMENT *segments;
+  size_t segment_count;
+  size_t *scores;
+} SEGMENT_BOUNDARY_JOB;
+
+void run_segment_boundary_job(void *argument) {
+  SEGMENT_BOUNDARY_JOB *job = argument;
+  for (size_t i = 0; i < job->segment_count; i++) {
+    job->scores[i] = SIZE_MAX;
+  }
+
+  SIZE_ESTIMATOR estimator;
+  if (!init_size_estimator(&estimator)) {
+    return;
+  }
+  size_t tail_size = min(job->part_size, SEGMENT_BOUNDARY_WINDOW);
+  unsigned char *window = counted_malloc(tail_size + SEGMENT_BOUNDARY_WINDOW);
+  memcpy(window, job->part + job->part_size - tail_size, tail_size);
+  size_t tail_score = estimate_compressed_size(&estimator, window, tail_size);
+  for (size_t i = 0; i < job->segment_count; i++) {
+    if (i == job->part_index) {
+      continue;
+    }
+    size_t head_size = min(job->segments[i].size, SEGMENT_BOUNDARY_WINDOW);
+    memcpy(window + tail_size, job->segments[i].data, head_size);
+    job->scores[i] = estimate_compressed_size(&estimator, window,
+                                              tail_size + head_size) -
+                     tail_score;
+  }
+  counted_free(window);
+  free_size_estimator(&estimator);
+}
+
+// Boundary scores of the javascript (row 0) and segments (row i + 1) to each
+// segment, see SEGMENT_BOUNDARY_JOB
+typedef struct SEGMENT_ORDER_SCORE {
+  const size_t *boundary_scores;
+  size_t segment_count;
+} SEGMENT_ORDER_SCORE;
+
+size_t score_segment_order(const size_t *order, void *context) {
+  SEGMENT_ORDER_SCORE *score = context;
+  size_t total = 0;
+  for (size_t i = 0; i < score->segment_count; i++) {
+    size_t from = i == 0 ? 0 : order[i - 1] + 1;
+    total += score->boundary_scores[from * score->segment_count + order[i]];
+  }
+  return total;
+}
+
+// Embeds a WebAssembly module after its javascript glue (which may be empty)
+// and its \0 end marker. The unpack code evaluates the glue and instantiates
+// the module from a Uint8Array of its bytes, see WASM_START_CODE.
+IMAGE *embbed_wasm_in_image(const char *javascript, const SEGMENT *wasm,
+                            USER_OPTIONS *user_options,
+                            COMPRESSION_STATISTICS *compression_statistics) {
+  size_t javascript_length = strlen(javascript);
+  size_t payload_length = javascript_length + 1 + wasm->size;
+  unsigned char *payload = counted_malloc(payload_length);
+  memcpy(payload, javascript, javascript_length);
+  payload[javascript_length] = '\0';
+  memcpy(payload + javascript_length + 1, wasm->data, wasm->size);
+
+  IMAGE *image = embbed_data_in_image(payload, payload_length, true,
+                                      user_options->row_layout);
+  counted_free(payload);
+  image->unpack_code =
+      create_payload_unpack_code(image, WASM_DECODE_CODE, WASM_START_CODE);
+
+  // Glue may be empty, sizes are relative to glue and module together
+  compression_statistics->javascript_size = javascript_length + wasm->size;
+  compression_statistics->wasm_size = wasm->size;
+  return image;
+}
+
+// Embeds javascript plus binary segments in a multi row image. Segments are
+// ordered by the estimated cost of each boundary between two of them (scored
+// in parallel with the fast estimator), so the search stays quadratic in the
+// segment count. The unpack code evaluates the javascript after exposing the
+// segments as Uint8Arrays in the global array S, indexed in command line
+// order.
+IMAGE *embbed_segments_in_image(
+    char *javascript, const SEGMENT *segments, size_t segment_count,
+    USER_OPTIONS *user_options,
+    COMPRESSION_STATISTICS *compression_statistics) {
+  size_t javascript_length = strlen(javascript);
+  compression_statistics->javascript_size = javascript_length;
+
+  size_t payload_length = javascript_length + 1;
+  for (size_t i = 0; i < segment_count; i++) {
+    payload_length += segments[i].size;
+  }
+
+  // Scores of all boundaries, in parallel per part before them
+  size_t part_count = segment_count + 1;
+  unsigned char *head = counted_malloc(javascript_length + 1);
+  memcpy(head, javascript, javascript_length + 1);
+  size_t *boundary_scores =
+      counted_malloc(sizeof(size_t) * part_count * segment_count);
+  SEGMENT_BOUNDARY_JOB *jobs =
+      counted_malloc(sizeof(SEGMENT_BOUNDARY_JOB) * part_count);
+  for (size_t i = 0; i < part_count; i++) {
+    SEGMENT_BOUNDARY_JOB job = {
+        i == 0 ? head : segments[i - 1].data,
+        i == 0 ? javascript_length + 1 : segments[i - 1].size,
+        i == 0 ? SIZE_MAX : i - 1,
+        segments,
+        segment_count,
+        boundary_scores + i * segment_count};
+    jobs[i] = job;
+  }
+  run_parallel(run_segment_boundary_job, jobs, sizeof(SEGMENT_BOUNDARY_JOB),
+               part_count, user_options->thread_count);
+  counted_free(jobs);
+  counted_free(head);
+
+  // Each segment follows the part before it that it shares most with, then
+  // single segments are moved while that lowers the sum of the scores
+  size_t *best_order = counted_malloc(sizeof(size_t) * segment_count);
+  bool *placed = counted_calloc(segment_count, sizeof(bool));
+  for (size_t i = 0; i < segment_count; i++) {
+    size_t from = i == 0 ? 0 : best_order[i - 1] + 1;
+    best_order[i] = SIZE_MAX;
+    for (size_t j = 0; j < segment_count; j++) {
+      if (!placed[j] &&
+          (best_order[i] == SIZE_MAX ||
+           boundary_scores[from * segment_count + j] <
+               boundary_scores[from * segment_count + best_order[i]])) {
+        best_order[i] = j;
+      }
+    }
+    placed[best_order[i]] = true;
+  }
+  bool *dependencies =
+      counted_calloc(segment_count * segment_count, sizeof(bool));
+  SEGMENT_ORDER_SCORE score = {boundary_scores, segment_count};
+  refine_bundle_order(best_order, segment_count, dependencies,
+                      score_segment_order, &score);
+
+  // Pair scores miss matches beyond the window, command line order is kept
+  // unless the whole payload estimates smaller
+  unsigned char *payload = counted_malloc(payload_length);
+  SIZE_ESTIMATOR estimator;
+  if (init_size_estimator(&estimator)) {
+    size_t *command_line_order = counted_malloc(sizeof(size_t) * segment_count);
+    for (size_t i = 0; i < segment_count; i++) {
+      command_line_order[i] = i;
+    }
+    size_t length =
+        build_segment_payload(javascript, javascript_length, segments,
+                              command_line_order, segment_count, payload);
+    size_t command_line_size =
+        estimate_compressed_size(&estimator, payload, length);
+    build_segment_payload(javascript, javascript_length, segments, best_order,
+                          segment_count, payload);
+    if (estimate_compressed_size(&estimator, payload, length) >=
+        command_line_size) {
+      memcpy(best_order, command_line_order, sizeof(size_t) * segment_count);
+    }
+    counted_free(command_line_order);
+    free_size_estimator(&estimator);
+  }
+  counted_free(dependencies);
+  counted_free(placed);
+  counted_free(boundary_scores);
+
+  build_segment_payload(javascript, javascript_length, segments, best_order,
+                        segment_count, payload);
+  IMAGE *image = embbed_data_in_image(payload, payload_length, true,
+                                      user_options->row_layout);
+  counted_free(payload);
+
+  // Segment sizes in layout order and their index in S
+  size_t lists_length = segment_count * 2 * 21 + 1;
+  char *sizes = counted_calloc(lists_length, 1);
+  char *indices = counted_calloc(lists_length, 1);
+  for (size_t i = 0; i < segment_count; i++) {
+    snprintf(sizes + strlen(sizes), lists_length - strlen(sizes), "%s%lu",
+             i > 0 ? "," : "", segments[best_order[i]].size);
+    snprintf(indices + strlen(indices), lists_length - strlen(indices),
+             "%s%lu", i > 0 ? "," : "", best_order[i]);
+  }
+
+  // Images taller than the default canvas are read in tiles
+  if (image->height > DEFAULT_CANVAS_HEIGHT) {
+    size_t decode_code_length =
+        snprintf(NULL, 0, SEGMENTS_DECODE_CODE, sizes, indices) + 1;
+    char *decode_code = counted_malloc(decode_code_length);
+    snprintf(decode_code, decode_code_length, SEGMENTS_DECODE_CODE, sizes,
+             indices);
+    image->unpack_code = create_payload_unpack_code(image, decode_code, "");
+    counted_free(decode_code);
+  } else {
+    size_t unpack_code_length =
+        snprintf(NULL, 0, SEGMENTS_IMAGE_HTML_UNPACK,
+                 (unsigned int)image->width, (unsigned int)image->height,
+                 sizes, indices) +
+        1;
+    image->unpack_code = counted_malloc(unpack_code_length);
+    snprintf(image->unpack_code, unpack_code_length,
+             SEGMENTS_IMAGE_HTML_UNPACK, (unsigned int)image->width,
+             (unsigned int)image->height, sizes, indices);
+  }
+
+  compression_statistics->segment_count = segment_count;
+  compression_statistics->segment_size = payload_length - javascript_length - 1;
+  compression_statistics->segment_order =
+      counted_malloc(sizeof(char *) * segment_count);
+  for (size_t i = 0; i < segment_count; i++) {
+    compression_statistics->segment_order[i] = segments[best_order[i]].path;
+  }
+
+  counted_free(indices);
+  counted_free(sizes);
+  counted_free(best_order);
+
+  return image;
+}
+
+// Sorts all cyclic rotations of the data by prefix doubling with counting
+// sorts in O(n log n). Order receives the start positions of the sorted
+// rotations.
+void sort_rotations(const unsigned char *data, size_t size, size_t *order) {
+  size_t classes_size = size > 256 ? size : 256;
+  size_t *classes = counted_malloc(sizeof(size_t) * size);
+  size_t *new_classes = counted_malloc(sizeof(size_t) * size);
+  size_t *shifted = counted_malloc(sizeof(size_t) * size);
+  size_t *count = counted_calloc(classes_size, sizeof(size_t));
+
+  // Rotations of length 1 are sorted by their first byte
+  for (size_t i = 0; i < size; i++) {
+    count[data[i]]++;
+  }
+  for (size_t i = 1; i < 256; i++) {
+    count[i] += count[i - 1];
+  }
+  for (size_t i = size; i-- > 0;) {
+    order[--count[data[i]]] = i;
+  }
+  size_t class_count = 1;
+  classes[order[0]] = 0;
+  for (size_t i = 1; i < size; i++) {
+    class_count += data[order[i]] != data[order[i - 1]] ? 1 : 0;
+    classes[order[i]] = class_count - 1;
+  }
+
+  // Rotations of length 2k are sorted by the classes of their two halves
+  for (size_t k = 1; k < size && class_count < size; k <<= 1) {
+    for (size_t i = 0; i < size; i++) {
+      shifted[i] = (order[i] + size - k % size) % size;
+    }
+    memset(count, 0, sizeof(size_t) * class_count);
+    for (size_t i = 0; i < size; i++) {
+      count[classes[shifted[i]]]++;
+    }
+    for (size_t i = 1; i < class_count; i++) {
+      count[i] += count[i - 1];
+    }
+    for (size_t i = size; i-- > 0;) {
+      order[--count[classes[shifted[i]]]] = shifted[i];
+    }
+
+    new_classes[order[0]] = 0;
+    class_count = 1;
+    for (size_t i = 1; i < size; i++) {
+      size_t current = order[i];
+      size_t previous = order[i - 1];
+      if (classes[current] != classes[previous] ||
+          classes[(current + k) % size] != classes[(previous + k) % size]) {
+        class_count++;
+      }
+      new_classes[current] = class_count - 1;
+    }
+    memcpy(classes, new_classes, sizeof(size_t) * size);
+  }
+
+  counted_free(count);
+  counted_free(shifted);
+  counted_free(new_classes);
+  counted_free(classes);
+}
+
+// Burrows-Wheeler transform. The parameter is the row of the original
+// rotation.
+void bwt_forward(const unsigned char *data, size_t size,
+                 unsigned char *output, size_t *parameter) {
+  size_t *order = counted_malloc(sizeof(size_t) * size);
+  sort_rotations(data, size, order);
+  for (size_t i = 0; i < size; i++) {
+    output[i] = data[(order[i] + size - 1) % size];
+    if (order[i] == 0) {
+      *parameter = i;
+    }
+  }
+  counted_free(order);
+}
+
+void bwt_inverse(const unsigned char *data, size_t size, size_t parameter,
+                 unsigned char *output) {
+  size_t count[256] = {0};
+  size_t *ranks = counted_malloc(sizeof(size_t) * size);
+  for (size_t i = 0; i < size; i++) {
+    ranks[i] = count[data[i]]++;
+  }
+  for (size_t i = 0, sum = 0; i < 256; i++) {
+    size_t c = count[i];
+    count[i] = sum;
+    sum += c;
+  }
+  for (size_t j = parameter, k = size; k-- > 0;) {
+    output[k] = data[j];
+    j = count[data[j]] + ranks[j];
+  }
+  counted_free(ranks);
+}
+
+// Move-to-front coding of a byte stream
+void mtf_forward(unsigned char *data, size_t size) {
+  unsigned char symbols[256];
+  for (int i = 0; i < 256; i++) {
+    symbols[i] = i;
+  }
+  for (size_t i = 0; i < size; i++) {
+    unsigned char symbol = data[i];
+    unsigned char index = 0;
+    while (symbols[index] != symbol) {
+      index++;
+    }
+    memmove(symbols + 1, symbols, index);
+    symbols[0] = symbol;
+    data[i] = index;
+  }
+}
+
+void mtf_inverse(unsigned char *data, size_t size) {
+  unsigned char symbols[256];
+  for (int i = 0; i < 256; i++) {
+    symbols[i] = i;
+  }
+  for (size_t i = 0; i < size; i++) {
+    unsigned char symbol = symbols[data[i]];
+    memmove(symbols + 1, symbols, data[i]);
+    symbols[0] = symbol;
+    data[i] = symbol;
+  }
+}
+
+void bwt_mtf_forward(const unsigned char *data, size_t size,
+                     unsigned char *output, size_t *parameter) {
+  bwt_forward(data, size, output, parameter);
+  mtf_forward(output, size);
+}
+
+void bwt_mtf_inverse(const unsigned char *data, size_t size, size_t parameter,
+                     unsigned char *output) {
+  unsigned char *bwt = counted_malloc(size);
+  memcpy(bwt, data, size);
+  mtf_inverse(bwt, size);
+  bwt_inverse(bwt, size, parameter, output);
+  counted_free(bwt);
+}
+
+// Reversible transform applied to the javascript before compression. The
+// inverse code is javascript that turns the array b of payload bytes into the
+// string e, with %lu standing for the transform parameter. Like the
+// bootstraps, it has no spaces and no '>' as it is part of an unquoted
+// attribute value.
+typedef struct PAYLOAD_TRANSFORM {
+  const char *name;
+  void (*forward)(const unsigned char *data, size_t size,
+                  unsigned char *output, size_t *parameter);
+  void (*inverse)(const unsigned char *data, size_t size, size_t parameter,
+                  unsigned char *output);
+  const char *inverse_code;
+} PAYLOAD_TRANSFORM;
+
+#define MTF_INVERSE_CODE                                                       \
+  "for(m=[],i=0;i<256;)m[i]=i++;for(i=0;i<b.length;i++)m.unshift(b[i]=m."     \
+  "splice(b[i],1)[0]);"
+
+#define BWT_INVERSE_CODE                                                       \
+  "for(C=[],T=[],i=0;i<256;)C[i++]=0;for(i=0;i<b.length;i++)T[i]=C[b[i]]++;"  \
+  "for(s=i=0;i<256;i++)t=C[i],C[i]=s,s+=t;for(o=[],j=%lu,k=b.length;k--;j=C["  \
+  "b[j]]+T[j])o[k]=b[j];for(e='',k=0;k<b.length;)e+=String.fromCharCode(o[k+" \
+  "+]);"
+
+const PAYLOAD_TRANSFORM PAYLOAD_TRANSFORMS[] = {
+    {"bwt", bwt_forward, bwt_inverse, BWT_INVERSE_CODE},
+    {"bwt_mtf", bwt_mtf_forward, bwt_mtf_inverse,
+     MTF_INVERSE_CODE BWT_INVERSE_CODE}};
+
+const size_t PAYLOAD_TRANSFORM_COUNT =
+    sizeof(PAYLOAD_TRANSFORMS) / sizeof(PAYLOAD_TRANSFORM);
+
+// Round-trip check of compressed image data: inflates it and compares the
+// result with the image data
+bool verify_image_round_trip(const IMAGE *image,
+                             const unsigned char *compressed_data,
+                             unsigned long compressed_data_size) {
+  uLongf size = image->size;
+  unsigned char *data = counted_malloc(image->size + 1);
+  bool equal = zlib_uncompress(data, &size, compressed_data,
+                               compressed_data_size) == Z_OK &&
+               size == image->size &&
+               memcmp(data, image->data, image->size) == 0;
+  counted_free(data);
+  return equal;
+}
+
+typedef struct TRANSFORM_JOB {
+  const PAYLOAD_TRANSFORM *transform;
+  const char *javascript;
+  USER_OPTIONS *user_options;
+  IMAGE *image;
+  size_t total_size;
+} TRANSFORM_JOB;
+
+// Embeds the javascript with one transform (or none) and measures the unpack
+// code plus the real compressed size, as everything else in the file stays
+// the same
+void run_transform_job(void *argument) {
+  TRANSFORM_JOB *job = argument;
+  size_t size = strlen(job->javascript);
+  const unsigned char *data = (const unsigned char *)job->javascript;
+
+  if (job->transform == NULL) {
+    job->image =
+        embbed_data_in_image(data, size, size >= SINGLE_ROW_MAX_LENGTH,
+                             job->user_options->row_layout);
+    job->image->unpack_code = create_unpack_code(job->image);
+  } else {
+    unsigned char *transformed = counted_malloc(size + 1);
+    unsigned char *restored = counted_malloc(size + 1);
+    size_t parameter = 0;
+    job->transform->forward(data, size, transformed, &parameter);
+    job->transform->inverse(transformed, size, parameter, restored);
+    bool reversible = memcmp(restored, data, size) == 0;
+    counted_free(restored);
+
+    if (!reversible) {
+      counted_free(transformed);
+      return;
+    }
+
+    job->image = embbed_data_in_image(transformed, size, true,
+                                      job->user_options->row_layout);
+    counted_free(transformed);
+
+    size_t inverse_code_length =
+        snprintf(NULL, 0, job->transform->inverse_code, parameter) + 1;
+    char *inverse_code = counted_malloc(inverse_code_length);
+    snprintf(inverse_code, inverse_code_length, job->transform->inverse_code,
+             parameter);
+
+    job->image->unpack_code =
+        create_payload_unpack_code(job->image, inverse_code, "");
+    counted_free(inverse_code);
+  }
+
+  unsigned char *compressed_data = NULL;
+  unsigned long compressed_data_size = 0;
+  if (compress_image(job->image, job->user_options, &compressed_data,
+                     &compressed_data_size)) {
+    if (verify_image_round_trip(job->image, compressed_data,
+                                compressed_data_size)) {
+      job->total_size =
+          strlen(job->image->unpack_code) + compressed_data_size;
+    }
+    counted_free(compressed_data);
+  }
+}
+
+// Evaluates all payload transforms in parallel against the untransformed
+// javascript and returns the image with the smallest unpack code plus
+// compressed data. Transforms are only applied if they pass the round trip
+// checks of the transform itself and of the compressed image data. Falls
+// back to embbed_javascript_in_image if no job has an image that compressed.
+IMAGE *embbed_transformed_javascript_in_image(
+    char *javascript, USER_OPTIONS *user_options,
+    COMPRESSION_STATISTICS *compression_statistics) {
+  compression_statistics->javascript_size = strlen(javascript);
+
+  // First job is the untransformed javascript
+  size_t job_count = PAYLOAD_TRANSFORM_COUNT + 1;
+  TRANSFORM_JOB *jobs = counted_malloc(sizeof(TRANSFORM_JOB) * job_count);
+  for (size_t i = 0; i < job_count; i++) {
+    TRANSFORM_JOB job = {i > 0 ? &PAYLOAD_TRANSFORMS[i - 1] : NULL,
+                         javascript, user_options, NULL, SIZE_MAX};
+    jobs[i] = job;
+  }
+
+  run_parallel(run_transform_job, jobs, sizeof(TRANSFORM_JOB), job_count,
+               user_options->thread_count);
+
+  size_t best_job = 0;
+  for (size_t i = 1; i < job_count; i++) {
+    if (jobs[i].total_size < jobs[best_job].total_size) {
+      best_job = i;
+    }
+  }
+
+  // Savings are only known against an untransformed image that compressed
+  bool found = jobs[best_job].total_size != SIZE_MAX;
+  if (found && best_job > 0) {
+    compression_statistics->transform = jobs[best_job].transform->name;
+    if (jobs[0].total_size != SIZE_MAX) {
+      compression_statistics->transform_saved_bytes =
+          jobs[0].total_size - jobs[best_job].total_size;
+    }
+  }
+
+  IMAGE *image = found ? jobs[best_job].image : NULL;
+  for (size_t i = 0; i < job_count; i++) {
+    if (jobs[i].image != NULL && jobs[i].image != image) {
+      counted_free(jobs[i].image->unpack_code);
+      counted_free(jobs[i].image->data);
+      counted_free(jobs[i].image);
+    }
+  }
+  counted_free(jobs);
+
+  if (image == NULL) {
+    return embbed_javascript_in_image(javascript, user_options,
+                                      compression_statistics);
+  }
+  return image;
+}
+
+// Context models of the context mixing coder. Each one predicts the next bit
+// from the bits seen of the current byte and the selected bytes of the
+// previous four, optionally combined with a hash of the current word.
+typedef struct CM_MODEL {
+  const char *name;
+  uint32_t mask;
+  bool word;
+} CM_MODEL;
+
+const CM_MODEL CM_MODELS[] = {
+    {"order0", 0, false},          {"order1", 0xff, false},
+    {"order2", 0xffff, false},     {"order3", 0xffffff, false},
+    {"order4", 0xffffffff, false}, {"sparse", 0xff00, false},
+    {"word", 0, true}};
+
+const size_t CM_MODEL_COUNT = sizeof(CM_MODELS) / sizeof(CM_MODEL);
+
+// Starting point of the parameter search: orders 1 to 3 and words
+const CM_PARAMETERS CM_DEFAULT_PARAMETERS = {0x4e, 60, 8, true};
+
+// Mixer weights are fixed point with 16 fractional bits
+const int CM_INITIAL_WEIGHT = 19661;
+
+// Parameter search rounds at most, each one moves to the best neighbour
+const int CM_MAX_SEARCH_ROUNDS = 32;
+
+// Javascript decoder of the context mixing coder, a line by line port of
+// context_mixing_code. It only uses integer arithmetic that is exact in
+// doubles, truncating division and 32 bit operations so that it models
+// exactly like the encoder. The partial byte lives in l, as c is the canvas.
+// Arguments are the model masks, word flags, table bits, mixer weight sets,
+// initial weight, javascript length, mixer context mask, learning rate and
+// count limit.
+const char *CM_DECODER_CODE =
+    "M=[%s],F=[%s],B=%d,n=M.length;for(Q=[],R=[],I=[],T=[],x=8388608,i=0;i<"
+    "2048;x+=x*(16777216-x)/4294967296|0)Q[2047+i]=x>>12,Q[2047-i++]=4096-(x>>"
+    "12);for(q=k=0;q<4096;R[q++]=k-2047)for(;k<4094&&Q[k]<q;)k++;for(P=[],N=["
+    "],W=[],j=0;j<n;j++)P[j]=new(Uint16Array)(1<<B).fill(32768),N[j]=new("
+    "Uint8Array)(1<<B);for(i=0;i<%d*n;)W[i++]=%d;for(x=h=w=k=z=0,y=4294967295,"
+    "e='';k<4;)z=z*256+b[k++];for(o=0;o<%lu;o++){for(X=[],j=0;j<n;j++)X[j]="
+    "Math.imul(h&M[j]^(F[j]?w:0),791559461)+j*16777619;for(l=1;l<256;l=l*2+u){"
+    "for(s=j=0,g=(l&%d)*n;j<n;j++)I[j]=Math.imul(X[j]+l,2654435761)>>>32-B,T["
+    "j]=R[P[j][I[j]]>>4],s+=W[g+j]*T[j];d=s/65536|0;p=Q[(d<-2047?-2047:2047<d?"
+    "2047:d)+2047];m=x+Math.floor((y-x)*p/4096);u=z<=m?1:0;u?y=m:x=m+1;for(r="
+    "(u<<12)-p,j=0;j<n;j++)W[g+j]+=T[j]*r*%d/65536|0,v=P[j][I[j]],P[j][I[j]]="
+    "v+(((u?65535:0)-v)/(N[j][I[j]]+2)|0),N[j][I[j]]<%d&&N[j][I[j]]++;for(;!(("
+    "x^y)>>>24);z=(z<<8|b[k++])>>>0)x=x<<8>>>0,y=(y<<8|255)>>>0}l&=255;e+="
+    "String.fromCharCode(l);h=(h<<8|l)>>>0;w=96<(l|32)&&(l|32)<123?Math.imul("
+    "w^l,16777619):0}";
+
+// Hash table bits per model, enough for every bit of the javascript to have a
+// slot twice over, capped to keep the decoder's memory use reasonable
+int cm_table_bits(size_t size) {
+  int bits = 16;
+  while (bits < 20 && ((size_t)1 << bits) < size * 16) {
+    bits++;
+  }
+  return bits;
+}
+
+// Creates the javascript decoder for the given parameters and javascript
+// length
+char *create_cm_decoder_code(const CM_PARAMETERS *parameters, size_t size) {
+  char masks[CM_MODEL_COUNT * 11 + 1];
+  char words[CM_MODEL_COUNT * 2 + 1];
+  size_t masks_length = 0;
+  size_t words_length = 0;
+  for (size_t i = 0; i < CM_MODEL_COUNT; i++) {
+    if (parameters->models & (1u << i)) {
+      const char *separator = masks_length > 0 ? "," : "";
+      masks_length += sprintf(masks + masks_length, "%s%lu", separator,
+                              (unsigned long)CM_MODELS[i].mask);
+      words_length += sprintf(words + words_length, "%s%d", separator,
+                              CM_MODELS[i].word ? 1 : 0);
+    }
+  }
+  masks[masks_length] = '\0';
+  words[words_length] = '\0';
+
+  int bits = cm_table_bits(size);
+  int weight_sets = parameters->mixer_context ? 256 : 1;
+  int mixer_mask = parameters->mixer_context ? 255 : 0;
+
+  size_t decoder_code_length =
+      snprintf(NULL, 0, CM_DECODER_CODE, masks, words, bits, weight_sets,
+               CM_INITIAL_WEIGHT, size, mixer_mask, parameters->learning_rate,
+               parameters->count_limit) +
+      1;
+  char *decoder_code = counted_malloc(decoder_code_length);
+  snprintf(decoder_code, decoder_code_length, CM_DECODER_CODE, masks, words,
+           bits, weight_sets, CM_INITIAL_WEIGHT, size, mixer_mask,
+           parameters->learning_rate, parameters->count_limit);
+  return decoder_code;
+}
+
+// Context mixing coder: the predictions of the selected context models are
+// mixed in the logistic domain by a gated linear mixer and drive a binary
+// arithmetic coder. Encodes the input into an output buffer of the given
+// capacity and returns the encoded size (0 if it does not fit), or decodes
+// the input into an output of the given size and returns that size.
+size_t context_mixing_code(const unsigned char *input, size_t input_size,
+                           unsigned char *output, size_t output_size,
+                           const CM_PARAMETERS *parameters, bool decode) {
+  // Logistic function in 12 bit fixed point, integrated in integer steps to
+  // get the same table in javascript, and its inverse
+  int squash[4095];
+  int stretch[4096];
+  uint64_t x = 1 << 23;
+  for (int i = 0; i < 2048; i++) {
+    squash[2047 + i] = x >> 12;
+    squash[2047 - i] = 4096 - (x >> 12);
+    x += x * ((1 << 24) - x) >> 32;
+  }
+  for (int q = 0, k = 0; q < 4096; q++) {
+    while (k < 4094 && squash[k] < q) {
+      k++;
+    }
+    stretch[q] = k - 2047;
+  }
+
+  size_t model_count = 0;
+  uint32_t masks[CM_MODEL_COUNT];
+  bool words[CM_MODEL_COUNT];
+  for (size_t i = 0; i < CM_MODEL_COUNT; i++) {
+    if (parameters->models & (1u << i)) {
+      masks[model_count] = CM_MODELS[i].mask;
+      words[model_count++] = CM_MODELS[i].word;
+    }
+  }
+
+  size_t length = decode ? output_size : input_size;
+  int bits = cm_table_bits(length);
+  size_t table_size = (size_t)1 << bits;
+  uint16_t *probabilities =
+      counted_malloc(sizeof(uint16_t) * model_count * table_size);
+  uint8_t *counts = counted_calloc(model_count * table_size, 1);
+  for (size_t i = 0; i < model_count * table_size; i++) {
+    probabilities[i] = 32768;
+  }
+  size_t weight_count = (parameters->mixer_context ? 256 : 1) * model_count;
+  int64_t *weights = counted_malloc(sizeof(int64_t) * weight_count);
+  for (size_t i = 0; i < weight_count; i++) {
+    weights[i] = CM_INITIAL_WEIGHT;
+  }
+  unsigned int mixer_mask = parameters->mixer_context ? 255 : 0;
+
+  uint32_t x1 = 0;
+  uint32_t x2 = 0xffffffff;
+  uint32_t z = 0;
+  size_t input_position = 0;
+  size_t output_position = 0;
+  if (decode) {
+    for (; input_position < 4; input_position++) {
+      z = z << 8 | (input_position < input_size ? input[input_position] : 0);
+    }
+  }
+
+  bool fits = true;
+  uint32_t history = 0;
+  uint32_t word = 0;
+  uint32_t contexts[CM_MODEL_COUNT];
+  size_t slots[CM_MODEL_COUNT];
+  int stretched[CM_MODEL_COUNT];
+  for (size_t o = 0; o < length && fits; o++) {
+    for (size_t j = 0; j < model_count; j++) {
+      contexts[j] = ((history & masks[j]) ^ (words[j] ? word : 0)) *
+                        791559461u +
+                    (uint32_t)j * 16777619u;
+    }
+
+    unsigned int partial = 1;
+    for (int bit_position = 7; bit_position >= 0; bit_position--) {
+      size_t weight_set = (partial & mixer_mask) * model_count;
+      int64_t dot_product = 0;
+      for (size_t j = 0; j < model_count; j++) {
+        slots[j] = j * table_size +
+                   (((contexts[j] + partial) * 2654435761u) >> (32 - bits));
+        stretched[j] = stretch[probabilities[slots[j]] >> 4];
+        dot_product += weights[weight_set + j] * stretched[j];
+      }
+      int64_t mixed = dot_product / 65536;
+      mixed = mixed < -2047 ? -2047 : mixed > 2047 ? 2047 : mixed;
+      int p = squash[mixed + 2047];
+
+      uint32_t middle = x1 + (uint32_t)((uint64_t)(x2 - x1) * p >> 12);
+      int bit = decode ? z <= middle : (input[o] >> bit_position) & 1;
+      if (bit) {
+        x2 = middle;
+      } else {
+        x1 = middle + 1;
+      }
+
+      int error = (bit << 12) - p;
+      for (size_t j = 0; j < model_count; j++) {
+        weights[weight_set + j] += (int64_t)stretched[j] * error *
+                                   parameters->learning_rate / 65536;
+        int probability = probabilities[slots[j]];
+        probabilities[slots[j]] =
+            probability +
+            ((bit ? 65535 : 0) - probability) / (counts[slots[j]] + 2);
+        if (counts[slots[j]] < parameters->count_limit) {
+          counts[slots[j]]++;
+        }
+      }
+      partial = partial * 2 + bit;
+
+      // Shift out leading bytes that can no longer change
+      while (((x1 ^ x2) >> 24) == 0) {
+        if (!decode) {
+          if (output_position == output_size) {
+            fits = false;
+            break;
+          }
+          output[output_position++] = x2 >> 24;
+        }
+        x1 <<= 8;
+        x2 = x2 << 8 | 255;
+        z = z << 8 |
+            (input_position < input_size ? input[input_position] : 0);
+        input_position++;
+      }
+    }
+
+    unsigned char byte = partial & 255;
+    if (decode) {
+      output[o] = byte;
+    }
+    history = history << 8 | byte;
+    unsigned char letter = byte | 32;
+    word = letter > 96 && letter < 123 ? (word ^ byte) * 16777619u : 0;
+  }
+
+  // Enough of the final range for the decoder to resolve the last bits
+  for (int i = 3; i >= 0 && !decode && fits; i--) {
+    fits = output_position < output_size;
+    if (fits) {
+      output[output_position++] = x1 >> (8 * i);
+    }
+  }
+
+  counted_free(weights);
+  counted_free(counts);
+  counted_free(probabilities);
+
+  if (!fits) {
+    return 0;
+  }
+  return decode ? length : output_position;
+}
+
+// Encoded size the context mixing coder may use at most, anything larger is
+// not worth shipping
+size_t cm_output_capacity(size_t size) { return size + size / 8 + 16; }
+
+typedef struct CM_SEARCH_JOB {
+  const unsigned char *data;
+  size_t size;
+  CM_PARAMETERS parameters;
+  size_t score;
+} CM_SEARCH_JOB;
+
+// Scores parameters by encoded size plus the size of their decoder
+void run_cm_search_job(void *argument) {
+  CM_SEARCH_JOB *job = argument;
+
+  unsigned char *output = counted_malloc(cm_output_capacity(job->size));
+  size_t encoded_size =
+      context_mixing_code(job->data, job->size, output,
+                          cm_output_capacity(job->size), &job->parameters,
+                          false);
+  counted_free(output);
+
+  if (encoded_size > 0) {
+    char *decoder_code = create_cm_decoder_code(&job->parameters, job->size);
+    job->score = encoded_size + strlen(decoder_code);
+    counted_free(decoder_code);
+  }
+}
+
+// Parameters that differ from the given ones in a single model or setting.
+// Returns the number of neighbours.
+size_t cm_neighbours(const CM_PARAMETERS *parameters,
+                     CM_PARAMETERS *neighbours) {
+  size_t count = 0;
+  for (size_t i = 0; i < CM_MODEL_COUNT; i++) {
+    CM_PARAMETERS neighbour = *parameters;
+    neighbour.models ^= 1u << i;
+    if (neighbour.models != 0) {
+      neighbours[count++] = neighbour;
+    }
+  }
+
+  const int count_limits[] = {parameters->count_limit / 2,
+                              parameters->count_limit * 2};
+  const int learning_rates[] = {parameters->learning_rate / 2,
+                                parameters->learning_rate * 2};
+  for (size_t i = 0; i < 2; i++) {
+    if (count_limits[i] >= 2 && count_limits[i] <= 255) {
+      neighbours[count] = *parameters;
+      neighbours[count++].count_limit = count_limits[i];
+    }
+    if (learning_rates[i] >= 1 && learning_rates[i] <= 64) {
+      neighbours[count] = *parameters;
+      neighbours[count++].learning_rate = learning_rates[i];
+    }
+  }
+
+  neighbours[count] = *parameters;
+  neighbours[count++].mixer_context = !parameters->mixer_context;
+  return count;
+}
+
+// Tunes the model parameters against the javascript by a parallel hill
+// climb over their neighbours
+CM_PARAMETERS search_cm_parameters(const unsigned char *data, size_t size,
+                                   USER_OPTIONS *user_options) {
+  CM_PARAMETERS best = CM_DEFAULT_PARAMETERS;
+  CM_SEARCH_JOB first_job = {data, size, best, SIZE_MAX};
+  run_cm_search_job(&first_job);
+  size_t best_score = first_job.score;
+
+  CM_SEARCH_JOB *jobs =
+      counted_malloc(sizeof(CM_SEARCH_JOB) * (CM_MODEL_COUNT + 5));
+  CM_PARAMETERS neighbours[CM_MODEL_COUNT + 5];
+  for (int round = 0; round < CM_MAX_SEARCH_ROUNDS; round++) {
+    size_t job_count = cm_neighbours(&best, neighbours);
+    for (size_t i = 0; i < job_count; i++) {
+      CM_SEARCH_JOB job = {data, size, neighbours[i], SIZE_MAX};
+      jobs[i] = job;
+    }
+
+    run_parallel(run_cm_search_job, jobs, sizeof(CM_SEARCH_JOB), job_count,
+                 user_options->thread_count);
+
+    size_t best_job = 0;
+    for (size_t i = 1; i < job_count; i++) {
+      if (jobs[i].score < jobs[best_job].score) {
+        best_job = i;
+      }
+    }
+    if (jobs[best_job].score >= best_score) {
+      break;
+    }
+    best = jobs[best_job].parameters;
+    best_score = jobs[best_job].score;
+  }
+  counted_free(jobs);
+
+  return best;
+}
+
+// Elapsed milliseconds since the given start time
+double milliseconds_since(const struct timespec *start) {
+  struct timespec now;
+  timespec_get(&now, TIME_UTC);
+  return (now.tv_sec - start->tv_sec) * 1000.0 +
+         (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+// Compresses the javascript with the context mixing coder under tuned
+// parameters and embeds it with its javascript decoder. The result is only
+// used if it decodes back to the javascript and if decoder plus compressed
+// image are smaller than the image with the plain javascript.
+IMAGE *embbed_context_mixed_javascript_in_image(
+    char *javascript, USER_OPTIONS *user_options,
+    COMPRESSION_STATISTICS *compression_statistics) {
+  compression_statistics->javascript_size = strlen(javascript);
+
+  TRANSFORM_JOB plain = {NULL, javascript, user_options, NULL, SIZE_MAX};
+  run_transform_job(&plain);
+
+  size_t size = strlen(javascript);
+  const unsigned char *data = (const unsigned char *)javascript;
+  CM_PARAMETERS parameters = search_cm_parameters(data, size, user_options);
+
+  unsigned char *encoded = counted_malloc(cm_output_capacity(size));
+  size_t encoded_size = context_mixing_code(
+      data, size, encoded, cm_output_capacity(size), &parameters, false);
+
+  // Decoding time of the native decoder only. Browsers run the javascript
+  // decoder, which is several times slower, see --bootstrap_benchmark.
+  unsigned char *decoded = counted_malloc(size + 1);
+  struct timespec start;
+  timespec_get(&start, TIME_UTC);
+  bool decodable =
+      encoded_size > 0 &&
+      context_mixing_code(encoded, encoded_size, decoded, size, &parameters,
+                          true) == size &&
+      memcmp(decoded, data, size) == 0;
+  double decode_time = milliseconds_since(&start);
+  counted_free(decoded);
+
+  IMAGE *image = NULL;
+  size_t total_size = SIZE_MAX;
+  if (decodable) {
+    image = embbed_data_in_image(encoded, encoded_size, true,
+                                 user_options->row_layout);
+    char *decoder_code = create_cm_decoder_code(&parameters, size);
+    image->unpack_code = create_payload_unpack_code(image, decoder_code, "");
+    counted_free(decoder_code);
+
+    unsigned char *compressed_data = NULL;
+    unsigned long compressed_data_size = 0;
+    if (compress_image(image, user_options, &compressed_data,
+                       &compressed_data_size)) {
+      if (verify_image_round_trip(image, compressed_data,
+                                  compressed_data_size)) {
+        total_size = strlen(image->unpack_code) + compressed_data_size;
+      }
+      counted_free(compressed_data);
+    }
+  }
+  counted_free(encoded);
+
+  if (total_size < plain.total_size) {
+    compression_statistics->context_mixing = true;
+    compression_statistics->context_mixing_parameters = parameters;
+    compression_statistics->context_mixing_saved_bytes =
+        plain.total_size - total_size;
+    compression_statistics->context_mixing_native_decode_time = decode_time;
+    counted_free(plain.image->unpack_code);
+    counted_free(plain.image->data);
+    counted_free(plain.image);
+    return image;
+  }
+
+  if (image != NULL) {
+    counted_free(image->unpack_code);
+    counted_free(image->data);
+    counted_free(image);
+  }
+  return plain.image;
+}
+
+// CRC32 of a chunk covers its identifier and data
+unsigned long png_chunk_crc(const char *chunk_identifier,
+                            const unsigned char *data, size_t data_size) {
+  unsigned long crc = crc32(0L, (const unsigned char *)chunk_identifier, 4);
+  return data_size > 0 ? crc32(crc, data, data_size) : crc;
+}
+
+// Appends a chunk to a PNG in memory, the data may already be in place
+unsigned char *append_png_chunk(unsigned char *output, const char *identifier,
+                                const unsigned char *data, size_t data_size,
+                                bool no_crc, bool overflow_data_in_crc) {
+  uint32_t data_size_out = htonl(data_size - (overflow_data_in_crc ? 4 : 0));
+  memcpy(output, &data_size_out, 4);
+  memcpy(output + 4, identifier, 4);
+  if (data_size > 0) {
+    memmove(output + 8, data, data_size);
+  }
+
+  if (!no_crc) {
+    uint32_t crc_out = htonl(png_chunk_crc(identifier, output + 8, data_size));
+    memcpy(output + 8 + data_size, &crc_out, 4);
+  }
+  return output + 8 + data_size + (no_crc ? 0 : 4);
+}
+
+// Builds the PNG file in memory, bare files without the custom chunk holding
+// the unpack code. The buffer is allocated, returns its size.
+size_t build_png(const IMAGE *image, const unsigned char *compressed_data,
+                 unsigned long compressed_data_size, unsigned int format_hacks,
+                 bool bare, unsigned char **png) {
+  // Prepare unpack code, payload layouts may come with their own
+  char *unpack_code = image->unpack_code != NULL
+                          ? image->unpack_code
+                          : create_unpack_code(image);
+  size_t unpack_code_length = bare ? 0 : strlen(unpack_code);
+
+  // Trailing Adler-32 of the zlib stream can be dropped
+  if (format_hacks & FORMAT_HACK_OMIT_ADLER32) {
+    compressed_data_size -= 4;
+  }
+
+  *png = counted_malloc(sizeof(PNG_HEADER) + (12 + 13) +
+                        (12 + unpack_code_length) +
+                        (12 + compressed_data_size) + 12);
+  unsigned char *position = *png;
+  memcpy(position, PNG_HEADER, sizeof(PNG_HEADER));
+  position += sizeof(PNG_HEADER);
+
+  // Image header (IHDR) chunk
+  PNG_IHDR png_ihdr = {
+      htonl(image->width), htonl(image->height), 8, 0, 0, 0, 0};
+  position = append_png_chunk(position, "IHDR", (unsigned char *)&png_ihdr,
+                              2 * sizeof(unsigned int) + 5,
+                              format_hacks & FORMAT_HACK_OMIT_IHDR_CRC, false);
+
+  // Custom chunk with unpack code
+  if (!bare) {
+    bool jawh_crc_overflow = format_hacks & FORMAT_HACK_JAWH_CRC_OVERFLOW;
+    position = append_png_chunk(
+        position, "jawh", (unsigned char *)unpack_code, unpack_code_length,
+        jawh_crc_overflow, jawh_crc_overflow);
+  }
+  if (unpack_code != image->unpack_code) {
+    counted_free(unpack_code);
+  }
+
+  position = append_png_chunk(position, "IDAT", compressed_data,
+                              compressed_data_size,
+                              format_hacks & FORMAT_HACK_OMIT_IDAT_CRC, false);
+
+  // End (IEND) chunk
+  if (!(format_hacks & FORMAT_HACK_OMIT_IEND)) {
+    position = append_png_chunk(position, "IEND", NULL, 0, false, false);
+  }
+  return position - *png;
+}
+
+// Writes the image with compressed image data that is already at hand
+bool write_compressed_image_as_png(
+    IMAGE *image, unsigned char *compressed_data,
+    unsigned long compressed_data_size, USER_OPTIONS *user_options,
+    COMPRESSION_STATISTICS *compression_statistics) {
+  // Browsers fail silently on images beyond their size limits
+  if (image->height > MAX_IMAGE_HEIGHT) {
+    printf("Image height of %lu rows exceeds the %lu rows browsers decode\n",
+           image->height, MAX_IMAGE_HEIGHT);
+    return false;
+  }
+
+  unsigned char *png = NULL;
+  size_t png_size =
+      build_png(image, compressed_data, compressed_data_size,
+                user_options->format_hacks, false, &png);
+  bool success = write_binary_file(user_options->png_path, png, png_size);
+  if (!success) {
+    printf("Failed to write destination png file '%s'\n",
+           user_options->png_path);
+  }
+  counted_free(png);
+
+  // Variants only reframe the compressed image data
+  for (size_t i = 0; i < user_options->variant_count; i++) {
+    PNG_VARIANT *variant = &user_options->variants[i];
+    variant->png_size =
+        build_png(image, compressed_data, compressed_data_size,
+                  variant->format_hacks, variant->bare, &png);
+    if (!write_binary_file(variant->path, png, variant->png_size)) {
+      printf("Failed to write variant png file '%s'\n", variant->path);
+      success = false;
+    }
+    counted_free(png);
+  }
+  compression_statistics->variants = user_options->variants;
+  compression_statistics->variant_count = user_options->variant_count;
+
+  compression_statistics->multi_row_image = image->height > 1;
+  compression_statistics->row_width = image->width;
+  compression_statistics->png_size = png_size;
+  compression_statistics->format_hacks = user_options->format_hacks;
+  return success;
+}
+
+// Phases of a compression task in the order they run
+typedef enum COMPRESSION_PHASE {
+  COMPRESSION_PHASE_DEFLATE,
+  COMPRESSION_PHASE_ZOPFLI,
+  COMPRESSION_PHASE_ANNEALING,
+  COMPRESSION_PHASE_DONE
+} COMPRESSION_PHASE;
+
+const char *COMPRESSION_PHASE_NAMES[] = {"deflate", "zopfli", "annealing",
+                                         "done"};
+
+// Best size is the smallest compressed image data so far, annealing reports
+// estimates from its own bit counts. Zopfli reports iteration 0 when it
+// starts and all its iterations when done, nothing in between.
+typedef struct COMPRESSION_PROGRESS {
+  COMPRESSION_PHASE phase;
+  int iteration;
+  size_t best_size;
+} COMPRESSION_PROGRESS;
+
+// Compression of image data running on its own thread. Callbacks are called
+// from that thread, or during annealing from the thread of its first chain.
+// Everything but the progress snapshot belongs to the task until it is
+// finished.
+typedef struct COMPRESSION_TASK {
+  IMAGE *image;
+  USER_OPTIONS user_options;
+  COMPRESSION_STATISTICS *compression_statistics;
+  void (*progress_callback)(const COMPRESSION_PROGRESS *progress,
+                            void *context);
+  void (*completion_callback)(struct COMPRESSION_TASK *task, void *context);
+  void *callback_context;
+  unsigned char *compressed_data;
+  unsigned long compressed_data_size;
+  thrd_t thread;
+  mtx_t progress_mutex;
+  COMPRESSION_PROGRESS progress;
+  atomic_bool cancelled;
+  atomic_bool done;
+} COMPRESSION_TASK;
+
+// Updates the progress snapshot and calls the progress callback
+void report_compression_progress(COMPRESSION_TASK *task,
+                                 COMPRESSION_PHASE phase, int iteration,
+                                 size_t size) {
+  mtx_lock(&task->progress_mutex);
+  task->progress.phase = phase;
+  task->progress.iteration = iteration;
+  task->progress.best_size = min(task->progress.best_size, size);
+  COMPRESSION_PROGRESS progress = task->progress;
+  mtx_unlock(&task->progress_mutex);
+
+  if (task->progress_callback != NULL) {
+    task->progress_callback(&progress, task->callback_context);
+  }
+}
+
+// Cooperative cancellation is checked between phases and in annealing
+// iterations, not while zopfli runs
+bool compression_cancelled(const COMPRESSION_TASK *task) {
+  return task != NULL && atomic_load(&task->cancelled);
+}
+
+// Deflate length and distance code bases and extra bits (RFC 1951)
+const uint16_t DEFLATE_LENGTH_BASE[29] = {
+    3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+    31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+const uint8_t DEFLATE_LENGTH_EXTRA[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                          1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                          4, 4, 4, 4, 5, 5, 5, 5, 0};
+const uint16_t DEFLATE_DISTANCE_BASE[30] = {
+    1,   2,   3,   4,   5,   7,    9,    13,   17,   25,   33,   49,   65,   97,
+    129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193,
+    12289, 16385, 24577};
+const uint8_t DEFLATE_DISTANCE_EXTRA[30] = {0, 0, 0,  0,  1,  1,  2,  2,
+                                            3, 3, 4,  4,  5,  5,  6,  6,
+                                            7, 7, 8,  8,  9,  9,  10, 10,
+                                            11, 11, 12, 12, 13, 13};
+
+// Order in which code length code lengths are stored
+const uint8_t DEFLATE_CODE_LENGTH_ORDER[19] = {16, 17, 18, 0, 8,  7, 9,
+                                               6,  10, 5,  11, 4, 12, 3,
+                                               13, 2,  14, 1,  15};
+
+// Bits of the code length codes' repeat symbols 16, 17 and 18
+const uint8_t DEFLATE_REPEAT_EXTRA[3] = {2, 3, 7};
+
+int deflate_length_symbol(int length) {
+  if (length <= 10) {
+    return 257 + length - 3;
+  }
+  if (length == 258) {
+    return 285;
+  }
+  int offset = length - 3;
+  int extra_bits = 0;
+  while ((offset >> (extra_bits + 3)) != 0) {
+    extra_bits++;
+  }
+  return 261 + 4 * extra_bits + ((offset >> extra_bits) & 3);
+}
+
+int deflate_distance_symbol(int distance) {
+  if (distance <= 4) {
+    return distance - 1;
+  }
+  int offset = distance - 1;
+  int high_bit = 2;
+  while ((offset >> (high_bit + 1)) != 0) {
+    high_bit++;
+  }
+  return 2 * high_bit + ((offset >> (high_bit - 1)) & 1);
+}
+
+// LZ77 parse of image data as a sequence of literals and matches, each packed
+// into one entry with the length in the low and the distance in the high 16
+// bits. Literals have distance 0 and their byte in the length field.
+typedef struct LZ77_STORE {
+  uint32_t *entries;
+  size_t size;
+  size_t capacity;
+} LZ77_STORE;
+
+uint32_t lz77_entry(uint16_t litlen, uint16_t dist) {
+  return litlen | (uint32_t)dist << 16;
+}
+
+uint16_t lz77_litlen(uint32_t entry) { return entry & 0xffff; }
+
+uint16_t lz77_dist(uint32_t entry) { return entry >> 16; }
+
+void init_lz77_store(LZ77_STORE *store, size_t capacity) {
+  store->capacity = max(capacity, (size_t)16);
+  store->entries = counted_malloc(sizeof(uint32_t) * store->capacity);
+  store->size = 0;
+}
+
+// Makes room for the given number of symbols
+void reserve_lz77_store(LZ77_STORE *store, size_t size) {
+  if (size > store->capacity) {
+    store->capacity = max(size, 2 * store->capacity);
+    store->entries =
+        counted_realloc(store->entries, sizeof(uint32_t) * store->capacity);
+  }
+}
+
+void lz77_store_append(LZ77_STORE *store, uint16_t litlen, uint16_t dist) {
+  reserve_lz77_store(store, store->size + 1);
+  store->entries[store->size++] = lz77_entry(litlen, dist);
+}
+
+void free_lz77_store(LZ77_STORE *store) { counted_free(store->entries); }
+
+// Number of bytes a literal or match covers
+size_t lz77_symbol_length(uint32_t entry) {
+  return lz77_dist(entry) == 0 ? 1 : lz77_litlen(entry);
+}
+
+// LZ77 parse with deflate block boundaries, block b covers the symbols from
+// block_starts[b] up to block_starts[b + 1]
+typedef struct DEFLATE_PARSE {
+  LZ77_STORE store;
+  size_t *block_starts;
+  size_t block_count;
+  size_t block_capacity;
+} DEFLATE_PARSE;
+
+// Makes room for the given number of blocks
+void reserve_deflate_blocks(DEFLATE_PARSE *parse, size_t block_count) {
+  if (block_count > parse->block_capacity) {
+    parse->block_capacity = max(block_count, 2 * parse->block_capacity);
+    parse->block_starts = counted_realloc(
+        parse->block_starts, sizeof(size_t) * (parse->block_capacity + 1));
+  }
+}
+
+typedef struct BIT_READER {
+  const unsigned char *data;
+  size_t size;
+  size_t position;
+  bool overrun;
+} BIT_READER;
+
+// Reads bits least significant first, reading past the end sets overrun
+int read_bits(BIT_READER *reader, int count) {
+  int value = 0;
+  for (int i = 0; i < count; i++, reader->position++) {
+    if ((reader->position >> 3) >= reader->size) {
+      reader->overrun = true;
+      return 0;
+    }
+    value |= ((reader->data[reader->position >> 3] >> (reader->position & 7)) &
+              1)
+             << i;
+  }
+  return value;
+}
+
+// Canonical Huffman decoding by code length counts (as in zlib's puff)
+typedef struct HUFFMAN_DECODER {
+  uint16_t counts[16];
+  uint16_t symbols[288];
+} HUFFMAN_DECODER;
+
+bool init_huffman_decoder(HUFFMAN_DECODER *decoder, const uint8_t *lengths,
+                          int count) {
+  memset(decoder->counts, 0, sizeof(decoder->counts));
+  for (int i = 0; i < count; i++) {
+    decoder->counts[lengths[i]]++;
+  }
+  decoder->counts[0] = 0;
+
+  // Over-subscribed codes are invalid
+  int left = 1;
+  uint16_t offsets[16] = {0};
+  for (int length = 1; length < 16; length++) {
+    left = (left << 1) - decoder->counts[length];
+    if (left < 0) {
+      return false;
+    }
+    if (length < 15) {
+      offsets[length + 1] = offsets[length] + decoder->counts[length];
+    }
+  }
+
+  for (int i = 0; i < count; i++) {
+    if (lengths[i] != 0) {
+      decoder->symbols[offsets[lengths[i]]++] = i;
+    }
+  }
+  return true;
+}
+
+int decode_huffman_symbol(BIT_READER *reader, const HUFFMAN_DECODER *decoder) {
+  int code = 0;
+  int first = 0;
+  int index = 0;
+  for (int length = 1; length < 16; length++) {
+    code |= read_bits(reader, 1);
+    int count = decoder->counts[length];
+    if (code - count < first) {
+      return decoder->symbols[index + (code - first)];
+    }
+    index += count;
+    first = (first + count) << 1;
+    code <<= 1;
+  }
+  return -1;
+}
+
+// Fixed Huffman code lengths of literals/lengths and distances
+void fixed_huffman_lengths(uint8_t *ll_lengths, uint8_t *d_lengths) {
+  for (int i = 0; i < 288; i++) {
+    ll_lengths[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+  }
+  for (int i = 0; i < 32; i++) {
+    d_lengths[i] = 5;
+  }
+}
+
+// Reads the LZ77 parse and block boundaries of a zlib stream that inflates to
+// the given size. Stored blocks become blocks of literals.
+bool parse_deflate_stream(const unsigned char *data, size_t size,
+                          size_t output_size, DEFLATE_PARSE *parse) {
+  // Symbols usually cover several bytes, the store grows as needed
+  init_lz77_store(&parse->store, output_size / 4);
+  parse->block_capacity = 16;
+  parse->block_starts =
+      counted_malloc(sizeof(size_t) * (parse->block_capacity + 1));
+  parse->block_count = 0;
+
+  BIT_READER reader = {data, size, 16, false};
+  bool valid = size > 2 && (data[0] & 0x0f) == 8 && !(data[1] & 0x20);
+  size_t position = 0;
+  for (bool final = false; valid && !final;) {
+    reserve_deflate_blocks(parse, parse->block_count + 1);
+    parse->block_starts[parse->block_count++] = parse->store.size;
+
+    final = read_bits(&reader, 1);
+    int type = read_bits(&reader, 2);
+    if (type == 0) {
+      reader.position = (reader.position + 7) & ~(size_t)7;
+      int length = read_bits(&reader, 16);
+      int inverted_length = read_bits(&reader, 16);
+      valid = (length ^ inverted_length) == 0xffff &&
+              position + length <= output_size;
+      for (int i = 0; i < length && valid; i++) {
+        lz77_store_append(&parse->store, read_bits(&reader, 8), 0);
+      }
+      position += length;
+      valid = valid && !reader.overrun;
+      continue;
+    }
+
+    uint8_t ll_lengths[288] = {0};
+    uint8_t d_lengths[32] = {0};
+    if (type == 1) {
+      fixed_huffman_lengths(ll_lengths, d_lengths);
+    } else if (type == 2) {
+      int ll_count = read_bits(&reader, 5) + 257;
+      int d_count = read_bits(&reader, 5) + 1;
+      int cl_count = read_bits(&reader, 4) + 4;
+      uint8_t cl_lengths[19] = {0};
+      for (int i = 0; i < cl_count; i++) {
+        cl_lengths[DEFLATE_CODE_LENGTH_ORDER[i]] = read_bits(&reader, 3);
+      }
+      HUFFMAN_DECODER cl_decoder;
+      valid = init_huffman_decoder(&cl_decoder, cl_lengths, 19);
+
+      uint8_t lengths[320] = {0};
+      for (int i = 0; i < ll_count + d_count && valid;) {
+        int symbol = decode_huffman_symbol(&reader, &cl_decoder);
+        if (symbol < 0 || (symbol == 16 && i == 0)) {
+          valid = false;
+        } else if (symbol < 16) {
+          lengths[i++] = symbol;
+        } else {
+          int value = symbol == 16 ? lengths[i - 1] : 0;
+          int repeat = symbol == 16   ? 3 + read_bits(&reader, 2)
+                       : symbol == 17 ? 3 + read_bits(&reader, 3)
+                                      : 11 + read_bits(&reader, 7);
+          valid = i + repeat <= ll_count + d_count;
+          for (; repeat > 0 && valid; repeat--) {
+            lengths[i++] = value;
+          }
+        }
+      }
+      memcpy(ll_lengths, lengths, ll_count);
+      memcpy(d_lengths, lengths + ll_count, d_count);
+    } else {
+      valid = false;
+    }
+
+    HUFFMAN_DECODER ll_decoder;
+    HUFFMAN_DECODER d_decoder;
+    valid = valid && init_huffman_decoder(&ll_decoder, ll_lengths, 288) &&
+            init_huffman_decoder(&d_decoder, d_lengths, 32);
+    while (valid) {
+      int symbol = decode_huffman_symbol(&reader, &ll_decoder);
+      if (symbol == 256) {
+        break;
+      }
+      if (symbol < 0 || symbol > 285 || reader.overrun) {
+        valid = false;
+      } else if (symbol < 256) {
+        lz77_store_append(&parse->store, symbol, 0);
+        position++;
+      } else {
+        int length = DEFLATE_LENGTH_BASE[symbol - 257] +
+                     read_bits(&reader, DEFLATE_LENGTH_EXTRA[symbol - 257]);
+        int distance_symbol = decode_huffman_symbol(&reader, &d_decoder);
+        if (distance_symbol < 0 || distance_symbol > 29) {
+          valid = false;
+          break;
+        }
+        int distance =
+            DEFLATE_DISTANCE_BASE[distance_symbol] +
+            read_bits(&reader, DEFLATE_DISTANCE_EXTRA[distance_symbol]);
+        valid = (size_t)distance <= position;
+        lz77_store_append(&parse->store, length, distance);
+        position += length;
+      }
+      valid = valid && position <= output_size;
+    }
+    valid = valid && !reader.overrun;
+  }
+
+  parse->block_starts[parse->block_count] = parse->store.size;
+  valid = valid && position == output_size;
+  if (!valid) {
+    counted_free(parse->block_starts);
+    free_lz77_store(&parse->store);
+  }
+  return valid;
+}
+
+typedef struct BIT_WRITER {
+  unsigned char *data;
+  size_t size;
+  size_t capacity;
+  int bit;
+} BIT_WRITER;
+
+void write_bits(BIT_WRITER *writer, unsigned int value, int count) {
+  for (int i = 0; i < count; i++) {
+    if (writer->bit == 0) {
+      if (writer->size == writer->capacity) {
+        writer->capacity *= 2;
+        writer->data = counted_realloc(writer->data, writer->capacity);
+      }
+      writer->data[writer->size++] = 0;
+    }
+    writer->data[writer->size - 1] |= ((value >> i) & 1) << writer->bit;
+    writer->bit = (writer->bit + 1) & 7;
+  }
+}
+
+// Huffman codes are stored most significant bit first
+void write_huffman_code(BIT_WRITER *writer, unsigned int code, int length) {
+  for (int i = length - 1; i >= 0; i--) {
+    write_bits(writer, code >> i, 1);
+  }
+}
+
+// Canonical Huffman codes for the given code lengths
+void huffman_codes(const uint8_t *lengths, int count, unsigned int *codes) {
+  unsigned int length_counts[16] = {0};
+  unsigned int next_codes[16] = {0};
+  for (int i = 0; i < count; i++) {
+    length_counts[lengths[i]]++;
+  }
+  length_counts[0] = 0;
+  for (int length = 1; length < 16; length++) {
+    next_codes[length] =
+        (next_codes[length - 1] + length_counts[length - 1]) << 1;
+  }
+  for (int i = 0; i < count; i++) {
+    codes[i] = lengths[i] != 0 ? next_codes[lengths[i]]++ : 0;
+  }
+}
+
+typedef struct HUFFMAN_LEAF {
+  size_t weight;
+  int symbol;
+} HUFFMAN_LEAF;
+
+int compare_huffman_leaves(const void *a, const void *b) {
+  const HUFFMAN_LEAF *leaf_a = a;
+  const HUFFMAN_LEAF *leaf_b = b;
+  if (leaf_a->weight != leaf_b->weight) {
+    return leaf_a->weight < leaf_b->weight ? -1 : 1;
+  }
+  return leaf_a->symbol - leaf_b->symbol;
+}
+
+// Optimal code lengths of at most max_bits by the package-merge algorithm.
+// Lists are built from the deepest level up, the 2n - 2 cheapest items of the
+// top list then decide how often each leaf is counted on every level.
+void limited_huffman_lengths(const size_t *frequencies, int count,
+                             int max_bits, uint8_t *lengths) {
+  HUFFMAN_LEAF leaves[288];
+  int leaf_count = 0;
+  memset(lengths, 0, count);
+  for (int i = 0; i < count; i++) {
+    if (frequencies[i] > 0) {
+      HUFFMAN_LEAF leaf = {frequencies[i], i};
+      leaves[leaf_count++] = leaf;
+    }
+  }
+  if (leaf_count <= 1) {
+    if (leaf_count == 1) {
+      lengths[leaves[0].symbol] = 1;
+    }
+    return;
+  }
+  qsort(leaves, leaf_count, sizeof(HUFFMAN_LEAF), compare_huffman_leaves);
+
+  // Items are leaves (their index) or packages (-1)
+  size_t weights[15][576];
+  int16_t items[15][576];
+  size_t list_sizes[15];
+  for (int i = 0; i < leaf_count; i++) {
+    weights[max_bits - 1][i] = leaves[i].weight;
+    items[max_bits - 1][i] = i;
+  }
+  list_sizes[max_bits - 1] = leaf_count;
+
+  for (int level = max_bits - 2; level >= 0; level--) {
+    size_t package_count = list_sizes[level + 1] / 2;
+    size_t leaf = 0;
+    size_t package = 0;
+    size_t size = 0;
+    while (leaf < (size_t)leaf_count || package < package_count) {
+      size_t package_weight =
+          package < package_count ? weights[level + 1][2 * package] +
+                                        weights[level + 1][2 * package + 1]
+                                  : SIZE_MAX;
+      if (leaf < (size_t)leaf_count &&
+          leaves[leaf].weight <= package_weight) {
+        weights[level][size] = leaves[leaf].weight;
+        items[level][size++] = leaf++;
+      } else {
+        weights[level][size] = package_weight;
+        items[level][size++] = -1;
+        package++;
+      }
+    }
+    list_sizes[level] = size;
+  }
+
+  size_t taken = 2 * leaf_count - 2;
+  for (int level = 0; level < max_bits && taken > 0; level++) {
+    size_t packages = 0;
+    for (size_t i = 0; i < taken; i++) {
+      if (items[level][i] >= 0) {
+        lengths[leaves[items[level][i]].symbol]++;
+      } else {
+        packages++;
+      }
+    }
+    taken = 2 * packages;
+  }
+}
+
+// Symbol frequencies and extra bits of a deflate block
+typedef struct DEFLATE_BLOCK_FREQUENCIES {
+  size_t ll[288];
+  size_t d[32];
+  size_t extra_bits;
+} DEFLATE_BLOCK_FREQUENCIES;
+
+void count_lz77_symbol(DEFLATE_BLOCK_FREQUENCIES *frequencies, uint32_t entry,
+                       int sign) {
+  uint16_t litlen = lz77_litlen(entry);
+  uint16_t dist = lz77_dist(entry);
+  if (dist == 0) {
+    frequencies->ll[litlen] += sign;
+    return;
+  }
+  int length_symbol = deflate_length_symbol(litlen);
+  int distance_symbol = deflate_distance_symbol(dist);
+  frequencies->ll[length_symbol] += sign;
+  frequencies->d[distance_symbol] += sign;
+  frequencies->extra_bits += sign * (DEFLATE_LENGTH_EXTRA[length_symbol - 257] +
+                                     DEFLATE_DISTANCE_EXTRA[distance_symbol]);
+}
+
+void count_lz77_symbols(DEFLATE_BLOCK_FREQUENCIES *frequencies,
+                        const LZ77_STORE *store, size_t start, size_t end) {
+  memset(frequencies, 0, sizeof(DEFLATE_BLOCK_FREQUENCIES));
+  for (size_t i = start; i < end; i++) {
+    count_lz77_symbol(frequencies, store->entries[i], 1);
+  }
+}
+
+// Adds or with a sign of -1 subtracts the frequencies of another block
+void add_block_frequencies(DEFLATE_BLOCK_FREQUENCIES *frequencies,
+                           const DEFLATE_BLOCK_FREQUENCIES *other, int sign) {
+  for (int i = 0; i < 288; i++) {
+    frequencies->ll[i] += sign * other->ll[i];
+  }
+  for (int i = 0; i < 32; i++) {
+    frequencies->d[i] += sign * other->d[i];
+  }
+  frequencies->extra_bits += sign * other->extra_bits;
+}
+
+// Run length encoding of the code lengths with the repeat symbols 16, 17 and
+// 18 enabled by the bits of options. Returns the bits of the tree and writes
+// it if a writer is given.
+size_t encode_huffman_tree(const uint8_t *ll_lengths, const uint8_t *d_lengths,
+                           int options, BIT_WRITER *writer) {
+  bool use_16 = options & 1;
+  bool use_17 = options & 2;
+  bool use_18 = options & 4;
+
+  int ll_count = 286;
+  while (ll_count > 257 && ll_lengths[ll_count - 1] == 0) {
+    ll_count--;
+  }
+  int d_count = 30;
+  while (d_count > 1 && d_lengths[d_count - 1] == 0) {
+    d_count--;
+  }
+  uint8_t lengths[320];
+  memcpy(lengths, ll_lengths, ll_count);
+  memcpy(lengths + ll_count, d_lengths, d_count);
+  int count = ll_count + d_count;
+
+  uint8_t symbols[320];
+  uint8_t extras[320];
+  int symbol_count = 0;
+  for (int i = 0; i < count; i++) {
+    int value = lengths[i];
+    int repeat = 1;
+    if (use_16 || (value == 0 && (use_17 || use_18))) {
+      while (i + repeat < count && lengths[i + repeat] == value) {
+        repeat++;
+      }
+    }
+    i += repeat - 1;
+
+    if (value == 0 && repeat >= 3) {
+      while (use_18 && repeat >= 11) {
+        int run = min(repeat, 138);
+        symbols[symbol_count] = 18;
+        extras[symbol_count++] = run - 11;
+        repeat -= run;
+      }
+      while (use_17 && repeat >= 3) {
+        int run = min(repeat, 10);
+        symbols[symbol_count] = 17;
+        extras[symbol_count++] = run - 3;
+        repeat -= run;
+      }
+    }
+    if (use_16 && repeat >= 4) {
+      symbols[symbol_count] = value;
+      extras[symbol_count++] = 0;
+      repeat--;
+      while (repeat >= 3) {
+        int run = min(repeat, 6);
+        symbols[symbol_count] = 16;
+        extras[symbol_count++] = run - 3;
+        repeat -= run;
+      }
+    }
+    for (; repeat > 0; repeat--) {
+      symbols[symbol_count] = value;
+      extras[symbol_count++] = 0;
+    }
+  }
+
+  size_t cl_frequencies[19] = {0};
+  for (int i = 0; i < symbol_count; i++) {
+    cl_frequencies[symbols[i]]++;
+  }
+  uint8_t cl_lengths[19];
+  limited_huffman_lengths(cl_frequencies, 19, 7, cl_lengths);
+
+  // Decoders reject incomplete code length codes, a single used code gets a
+  // sibling
+  int used = 0;
+  for (int i = 0; i < 19; i++) {
+    used += cl_lengths[i] != 0;
+  }
+  if (used == 1) {
+    cl_lengths[cl_lengths[0] != 0 ? 1 : 0] = 1;
+  }
+
+  int cl_count = 19;
+  while (cl_count > 4 &&
+         cl_lengths[DEFLATE_CODE_LENGTH_ORDER[cl_count - 1]] == 0) {
+    cl_count--;
+  }
+
+  size_t bits = 14 + 3 * cl_count;
+  for (int i = 0; i < symbol_count; i++) {
+    bits += cl_lengths[symbols[i]] +
+            (symbols[i] >= 16 ? DEFLATE_REPEAT_EXTRA[symbols[i] - 16] : 0);
+  }
+
+  if (writer != NULL) {
+    unsigned int cl_codes[19];
+    huffman_codes(cl_lengths, 19, cl_codes);
+    write_bits(writer, ll_count - 257, 5);
+    write_bits(writer, d_count - 1, 5);
+    write_bits(writer, cl_count - 4, 4);
+    for (int i = 0; i < cl_count; i++) {
+      write_bits(writer, cl_lengths[DEFLATE_CODE_LENGTH_ORDER[i]], 3);
+    }
+    for (int i = 0; i < symbol_count; i++) {
+      write_huffman_code(writer, cl_codes[symbols[i]], cl_lengths[symbols[i]]);
+      if (symbols[i] >= 16) {
+        write_bits(writer, extras[i], DEFLATE_REPEAT_EXTRA[symbols[i] - 16]);
+      }
+    }
+  }
+  return bits;
+}
+
+// Encoding of a deflate block as chosen by deflate_block_bits
+typedef struct DEFLATE_BLOCK_ENCODING {
+  bool fixed;
+  int tree_options;
+  uint8_t ll_lengths[288];
+  uint8_t d_lengths[32];
+} DEFLATE_BLOCK_ENCODING;
+
+// Bits of a block with the cheaper of fixed and optimal dynamic Huffman
+// codes, including its header and end of block code
+size_t deflate_block_bits(const DEFLATE_BLOCK_FREQUENCIES *frequencies,
+                          DEFLATE_BLOCK_ENCODING *encoding) {
+  size_t ll[288];
+  memcpy(ll, frequencies->ll, sizeof(ll));
+  ll[256] = 1;
+
+  uint8_t ll_lengths[288];
+  uint8_t d_lengths[32];
+  limited_huffman_lengths(ll, 288, 15, ll_lengths);
+  limited_huffman_lengths(frequencies->d, 32, 15, d_lengths);
+
+  // Old zlib versions need two distance codes
+  int distance_codes = 0;
+  for (int i = 0; i < 30; i++) {
+    distance_codes += d_lengths[i] != 0;
+  }
+  if (distance_codes < 2) {
+    d_lengths[d_lengths[0] != 0 ? 1 : 0] = 1;
+    if (distance_codes == 0) {
+      d_lengths[1] = 1;
+    }
+  }
+
+  size_t data_bits = frequencies->extra_bits;
+  size_t fixed_bits = 3 + frequencies->extra_bits;
+  uint8_t fixed_ll_lengths[288];
+  uint8_t fixed_d_lengths[32];
+  fixed_huffman_lengths(fixed_ll_lengths, fixed_d_lengths);
+  for (int i = 0; i < 288; i++) {
+    data_bits += ll[i] * ll_lengths[i];
+    fixed_bits += ll[i] * fixed_ll_lengths[i];
+  }
+  for (int i = 0; i < 32; i++) {
+    data_bits += frequencies->d[i] * d_lengths[i];
+    fixed_bits += frequencies->d[i] * fixed_d_lengths[i];
+  }
+
+  size_t tree_bits = SIZE_MAX;
+  int tree_options = 0;
+  for (int options = 0; options < 8; options++) {
+    size_t bits = encode_huffman_tree(ll_lengths, d_lengths, options, NULL);
+    if (bits < tree_bits) {
+      tree_bits = bits;
+      tree_options = options;
+    }
+  }
+  size_t dynamic_bits = 3 + tree_bits + data_bits;
+
+  if (encoding != NULL) {
+    encoding->fixed = fixed_bits <= dynamic_bits;
+    encoding->tree_options = tree_options;
+    if (encoding->fixed) {
+      memcpy(encoding->ll_lengths, fixed_ll_lengths, 288);
+      memcpy(encoding->d_lengths, fixed_d_lengths, 32);
+    } else {
+      memcpy(encoding->ll_lengths, ll_lengths, 288);
+      memcpy(encoding->d_lengths, d_lengths, 32);
+    }
+  }
+  return min(fixed_bits, dynamic_bits);
+}
+
+void write_deflate_block(BIT_WRITER *writer, const LZ77_STORE *store,
+                         size_t start, size_t end, bool final) {
+  DEFLATE_BLOCK_FREQUENCIES frequencies;
+  count_lz77_symbols(&frequencies, store, start, end);
+  DEFLATE_BLOCK_ENCODING encoding;
+  deflate_block_bits(&frequencies, &encoding);
+
+  write_bits(writer, final, 1);
+  write_bits(writer, encoding.fixed ? 1 : 2, 2);
+  if (!encoding.fixed) {
+    encode_huffman_tree(encoding.ll_lengths, encoding.d_lengths,
+                        encoding.tree_options, writer);
+  }
+
+  unsigned int ll_codes[288];
+  unsigned int d_codes[32];
+  huffman_codes(encoding.ll_lengths, 288, ll_codes);
+  huffman_codes(encoding.d_lengths, 32, d_codes);
+  for (size_t i = start; i < end; i++) {
+    uint16_t litlen = lz77_litlen(store->entries[i]);
+    uint16_t dist = lz77_dist(store->entries[i]);
+    if (dist == 0) {
+      write_huffman_code(writer, ll_codes[litlen], encoding.ll_lengths[litlen]);
+      continue;
+    }
+    int length_symbol = deflate_length_symbol(litlen);
+    int distance_symbol = deflate_distance_symbol(dist);
+    write_huffman_code(writer, ll_codes[length_symbol],
+                       encoding.ll_lengths[length_symbol]);
+    write_bits(writer, litlen - DEFLATE_LENGTH_BASE[length_symbol - 257],
+               DEFLATE_LENGTH_EXTRA[length_symbol - 257]);
+    write_huffman_code(writer, d_codes[distance_symbol],
+                       encoding.d_lengths[distance_symbol]);
+    write_bits(writer, dist - DEFLATE_DISTANCE_BASE[distance_symbol],
+               DEFLATE_DISTANCE_EXTRA[distance_symbol]);
+  }
+  write_huffman_code(writer, ll_codes[256], encoding.ll_lengths[256]);
+}
+
+// Writes a zlib stream of the parse with the given two header bytes
+void write_zlib_stream(const DEFLATE_PARSE *parse, const unsigned char *header,
+                       const unsigned char *data, size_t size,
+                       unsigned char **compressed_data,
+                       unsigned long *compressed_data_size) {
+  BIT_WRITER writer = {counted_malloc(size / 2 + 64), 0, size / 2 + 64, 0};
+  write_bits(&writer, header[0], 8);
+  write_bits(&writer, header[1], 8);
+  for (size_t b = 0; b < parse->block_count; b++) {
+    write_deflate_block(&writer, &parse->store, parse->block_starts[b],
+                        parse->block_starts[b + 1],
+                        b == parse->block_count - 1);
+  }
+  writer.bit = 0;
+
+  uint32_t adler = adler32(adler32(0L, NULL, 0), data, size);
+  for (int i = 3; i >= 0; i--) {
+    write_bits(&writer, (adler >> (8 * i)) & 0xff, 8);
+  }
+
+  *compressed_data = writer.data;
+  *compressed_data_size = writer.size;
+}
+
+// Matches the annealing can choose from at a position: the nearest distances
+// and those that reach further than all nearer ones, with their maximum
+// length. Only the hash chains are kept, 4 bytes per position, and the
+// candidates of a position are found again when a move needs them.
+typedef struct MATCH_CANDIDATES {
+  const unsigned char *data;
+  size_t size;
+  uint32_t *previous;
+} MATCH_CANDIDATES;
+
+const int MATCH_CANDIDATES_PER_POSITION = 16;
+const int MATCH_CANDIDATES_CHAIN_LENGTH = 1024;
+
+void init_match_candidates(const unsigned char *data, size_t size,
+                           MATCH_CANDIDATES *candidates) {
+  candidates->data = data;
+  candidates->size = size;
+  candidates->previous = counted_malloc(sizeof(uint32_t) * size);
+
+  uint32_t *heads = counted_malloc(sizeof(uint32_t) * 65536);
+  for (size_t i = 0; i < 65536; i++) {
+    heads[i] = UINT32_MAX;
+  }
+  for (size_t p = 0; p < size; p++) {
+    if (p + 3 > size) {
+      candidates->previous[p] = UINT32_MAX;
+      continue;
+    }
+    size_t hash = (data[p] << 8 ^ data[p + 1] << 4 ^ data[p + 2]) & 0xffff;
+    candidates->previous[p] = heads[hash];
+    heads[hash] = p;
+  }
+  counted_free(heads);
+}
+
+void free_match_candidates(MATCH_CANDIDATES *candidates) {
+  counted_free(candidates->previous);
+}
+
+// Fills up to MATCH_CANDIDATES_PER_POSITION distances and lengths of matches
+// at the position, nearest first. Returns their count.
+size_t find_match_candidates(const MATCH_CANDIDATES *candidates,
+                             size_t position, uint16_t *dists,
+                             uint16_t *lengths) {
+  const unsigned char *data = candidates->data;
+  size_t per_position = MATCH_CANDIDATES_PER_POSITION;
+  size_t max_length = min(candidates->size - position, (size_t)258);
+  size_t best_length = 0;
+  size_t count = 0;
+  int chain = 0;
+  for (uint32_t q = candidates->previous[position];
+       q != UINT32_MAX && position - q <= 32768 &&
+       chain < MATCH_CANDIDATES_CHAIN_LENGTH && count < per_position;
+       q = candidates->previous[q], chain++) {
+    size_t length = 0;
+    while (length < max_length && data[q + length] == data[position + length]) {
+      length++;
+    }
+    if (length >= 3 && (length > best_length || count < per_position / 2)) {
+      dists[count] = position - q;
+      lengths[count] = length;
+      count++;
+      best_length = length > best_length ? length : best_length;
+    }
+  }
+  return count;
+}
+
+typedef struct PARSE_ANNEALING_CONTEXT {
+  const unsigned char *data;
+  const MATCH_CANDIDATES *candidates;
+  const DEFLATE_PARSE *start;
+  int iterations;
+  COMPRESSION_TASK *task;
+} PARSE_ANNEALING_CONTEXT;
+
+typedef struct PARSE_ANNEALING_JOB {
+  const PARSE_ANNEALING_CONTEXT *context;
+  uint64_t seed;
+  bool reports_progress;
+  DEFLATE_PARSE best;
+  size_t bits;
+} PARSE_ANNEALING_JOB;
+
+// Symbols between the data position checkpoints of the annealing state
+const size_t POSITION_CHECKPOINT_INTERVAL = 64;
+
+// Annealing state: the parse with sparse data position checkpoints, block
+// frequencies and bits. Checkpoint k holds the position of symbol k times the
+// interval, the first valid_checkpoints are up to date and the others are
+// rebuilt when a position past them is needed. Checkpoints grow with the
+// store's capacity, block arrays with the parse's block capacity.
+typedef struct PARSE_STATE {
+  DEFLATE_PARSE parse;
+  size_t *checkpoints;
+  size_t valid_checkpoints;
+  DEFLATE_BLOCK_FREQUENCIES *frequencies;
+  size_t *block_bits;
+  size_t bits;
+} PARSE_STATE;
+
+void copy_deflate_parse(DEFLATE_PARSE *destination,
+                        const DEFLATE_PARSE *source) {
+  reserve_lz77_store(&destination->store, source->store.size);
+  memcpy(destination->store.entries, source->store.entries,
+         sizeof(uint32_t) * source->store.size);
+  destination->store.size = source->store.size;
+  reserve_deflate_blocks(destination, source->block_count);
+  memcpy(destination->block_starts, source->block_starts,
+         sizeof(size_t) * (source->block_count + 1));
+  destination->block_count = source->block_count;
+}
+
+// Allocates a parse with room for the given number of symbols, which grows
+// like the blocks with reserve_lz77_store and reserve_deflate_blocks
+void init_deflate_parse(DEFLATE_PARSE *parse, size_t capacity) {
+  init_lz77_store(&parse->store, capacity);
+  parse->block_capacity = 16;
+  parse->block_starts =
+      counted_malloc(sizeof(size_t) * (parse->block_capacity + 1));
+  parse->block_count = 0;
+}
+
+void free_deflate_parse(DEFLATE_PARSE *parse) {
+  counted_free(parse->block_starts);
+  free_lz77_store(&parse->store);
+}
+
+size_t find_block(const DEFLATE_PARSE *parse, size_t symbol) {
+  size_t low = 0;
+  size_t high = parse->block_count;
+  while (high - low > 1) {
+    size_t middle = (low + high) / 2;
+    if (parse->block_starts[middle] <= symbol) {
+      low = middle;
+    } else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+// Length of the match at position with the given distance, at most limit
+size_t match_length(const unsigned char *data, size_t position,
+                    size_t distance, size_t limit) {
+  size_t length = 0;
+  if (distance == 0 || distance > position) {
+    return 0;
+  }
+  while (length < limit && length < 258 &&
+         data[position + length] == data[position + length - distance]) {
+    length++;
+  }
+  return length;
+}
+
+// Data position of symbol i, rebuilding the checkpoints up to it
+size_t symbol_position(PARSE_STATE *state, size_t i) {
+  const uint32_t *entries = state->parse.store.entries;
+  size_t interval = POSITION_CHECKPOINT_INTERVAL;
+  size_t checkpoint = i / interval;
+  for (size_t k = state->valid_checkpoints; k <= checkpoint; k++) {
+    size_t position = state->checkpoints[k - 1];
+    for (size_t j = (k - 1) * interval; j < k * interval; j++) {
+      position += lz77_symbol_length(entries[j]);
+    }
+    state->checkpoints[k] = position;
+  }
+  state->valid_checkpoints = max(state->valid_checkpoints, checkpoint + 1);
+
+  size_t position = state->checkpoints[checkpoint];
+  for (size_t j = checkpoint * interval; j < i; j++) {
+    position += lz77_symbol_length(entries[j]);
+  }
+  return position;
+}
+
+// Replaces the symbols [first, last) of block with the given ones, which
+// cover the same data
+void replace_symbols(PARSE_STATE *state, size_t block, size_t first,
+                     size_t last, const uint32_t *entries, size_t count) {
+  LZ77_STORE *store = &state->parse.store;
+  size_t capacity = store->capacity;
+  reserve_lz77_store(store, store->size - (last - first) + count);
+  if (store->capacity != capacity) {
+    size_t checkpoint_count =
+        store->capacity / POSITION_CHECKPOINT_INTERVAL + 1;
+    state->checkpoints = counted_realloc(state->checkpoints,
+                                         sizeof(size_t) * checkpoint_count);
+  }
+
+  memmove(store->entries + first + count, store->entries + last,
+          sizeof(uint32_t) * (store->size - last));
+  memcpy(store->entries + first, entries, sizeof(uint32_t) * count);
+  store->size = store->size - (last - first) + count;
+  state->valid_checkpoints = min(state->valid_checkpoints,
+                                 first / POSITION_CHECKPOINT_INTERVAL + 1);
+
+  for (size_t b = block + 1; b <= state->parse.block_count; b++) {
+    state->parse.block_starts[b] = state->parse.block_starts[b] + count - last +
+                                   first;
+  }
+}
+
+// Proposes a new parse of the data covered by a random symbol: a literal, a
+// candidate match or a resized match, with the following symbols repaired to
+// cover the rest. Fills the replacement and returns the number of symbols,
+// 0 if the move does not apply.
+size_t propose_parse_move(const PARSE_ANNEALING_CONTEXT *context,
+                          PARSE_STATE *state, uint64_t *random_state,
+                          size_t *block, size_t *first, size_t *last,
+                          uint32_t *entries) {
+  const LZ77_STORE *store = &state->parse.store;
+  const unsigned char *data = context->data;
+  size_t i = next_random(random_state) % store->size;
+  *block = find_block(&state->parse, i);
+  size_t block_end = state->parse.block_starts[*block + 1];
+  size_t end_position = symbol_position(state, block_end);
+  size_t position = symbol_position(state, i);
+
+  size_t count = 0;
+  size_t covered = position;
+  int move = next_random(random_state) % 3;
+  if (move == 0) {
+    if (lz77_dist(store->entries[i]) == 0) {
+      return 0;
+    }
+    entries[count++] = lz77_entry(data[position], 0);
+    covered++;
+  } else if (move == 1) {
+    uint16_t dists[MATCH_CANDIDATES_PER_POSITION];
+    uint16_t lengths[MATCH_CANDIDATES_PER_POSITION];
+    size_t candidate_count =
+        find_match_candidates(context->candidates, position, dists, lengths);
+    if (candidate_count == 0) {
+      return 0;
+    }
+    size_t slot = next_random(random_state) % candidate_count;
+    size_t max_length = min((size_t)lengths[slot], end_position - position);
+    if (max_length < 3) {
+      return 0;
+    }
+    // Longest matches are the usual choice, shorter ones leave room for the
+    // next symbol
+    size_t length = next_random(random_state) % 2 == 0
+                        ? max_length
+                        : 3 + next_random(random_state) % (max_length - 2);
+    entries[count++] = lz77_entry(length, dists[slot]);
+    covered += length;
+  } else {
+    uint16_t dist = lz77_dist(store->entries[i]);
+    uint16_t old_length = lz77_litlen(store->entries[i]);
+    if (dist == 0) {
+      return 0;
+    }
+    // Moves the end of the match by a few bytes
+    size_t max_length =
+        match_length(data, position, dist, end_position - position);
+    int shift = (int)(next_random(random_state) % 9) - 4;
+    int length = min(max(old_length + shift, 3), (int)max_length);
+    if (length == old_length) {
+      return 0;
+    }
+    entries[count++] = lz77_entry(length, dist);
+    covered += length;
+  }
+
+  // Repair the symbol the new one ends in, which starts at j_position
+  size_t j = i;
+  size_t j_position = position;
+  while (j < block_end &&
+         j_position + lz77_symbol_length(store->entries[j]) <= covered) {
+    j_position += lz77_symbol_length(store->entries[j]);
+    j++;
+  }
+  *first = i;
+  *last = j;
+  if (j < block_end && j_position < covered) {
+    size_t rest = j_position + lz77_symbol_length(store->entries[j]) - covered;
+    uint16_t dist = lz77_dist(store->entries[j]);
+    size_t extended = 0;
+    if (dist == 0 || rest < 3) {
+      // A following match may take over the rest by starting earlier
+      uint16_t next_dist =
+          j + 1 < block_end ? lz77_dist(store->entries[j + 1]) : 0;
+      if (next_dist != 0) {
+        size_t length = rest + lz77_litlen(store->entries[j + 1]);
+        if (length <= 258 &&
+            match_length(data, covered, next_dist, length) == length) {
+          entries[count++] = lz77_entry(length, next_dist);
+          extended = 1;
+        }
+      }
+      for (size_t k = 0; k < rest && extended == 0; k++) {
+        entries[count++] = lz77_entry(data[covered + k], 0);
+      }
+    } else {
+      entries[count++] = lz77_entry(rest, dist);
+    }
+    *last = j + 1 + extended;
+  }
+  return count;
+}
+
+// Moves, splits or merges block boundaries. Returns false if the move does
+// not apply, otherwise the boundaries and frequencies of the affected blocks
+// are in the given state copies. Frequencies are derived from those of the
+// current blocks, only the shorter half of a split and the symbols a boundary
+// moves over are counted.
+bool propose_block_move(const PARSE_STATE *state, uint64_t *random_state,
+                        size_t *block, size_t *boundaries,
+                        DEFLATE_BLOCK_FREQUENCIES *frequencies,
+                        int *block_change) {
+  const DEFLATE_PARSE *parse = &state->parse;
+  int move = next_random(random_state) % 3;
+  *block = next_random(random_state) % parse->block_count;
+  size_t start = parse->block_starts[*block];
+  size_t end = parse->block_starts[*block + 1];
+
+  if (move == 0) {
+    // Split a block in two
+    if (end - start < 2) {
+      return false;
+    }
+    size_t split = start + 1 + next_random(random_state) % (end - start - 1);
+    boundaries[0] = start;
+    boundaries[1] = split;
+    boundaries[2] = end;
+    *block_change = 1;
+  } else {
+    if (*block + 1 == parse->block_count) {
+      return false;
+    }
+    size_t next_end = parse->block_starts[*block + 2];
+    if (move == 1) {
+      // Merge a block with the next one
+      boundaries[0] = start;
+      boundaries[1] = next_end;
+      *block_change = -1;
+    } else {
+      // Shift the boundary to the next block
+      int shift = (int)(next_random(random_state) % 33) - 16;
+      if (shift == 0 || (shift < 0 && (size_t)-shift >= end - start) ||
+          (shift > 0 && (size_t)shift >= next_end - end)) {
+        return false;
+      }
+      boundaries[0] = start;
+      boundaries[1] = end + shift;
+      boundaries[2] = next_end;
+      *block_change = 0;
+    }
+  }
+
+  const DEFLATE_BLOCK_FREQUENCIES *current = &state->frequencies[*block];
+  if (*block_change == 1) {
+    size_t shorter = boundaries[1] - start <= end - boundaries[1] ? 0 : 1;
+    count_lz77_symbols(&frequencies[shorter], &parse->store,
+                       boundaries[shorter], boundaries[shorter + 1]);
+    frequencies[1 - shorter] = *current;
+    add_block_frequencies(&frequencies[1 - shorter], &frequencies[shorter],
+                          -1);
+  } else {
+    frequencies[0] = *current;
+    frequencies[1] = current[1];
+    if (*block_change == -1) {
+      add_block_frequencies(&frequencies[0], &frequencies[1], 1);
+    } else {
+      int sign = boundaries[1] > end ? 1 : -1;
+      for (size_t i = min(end, boundaries[1]); i < max(end, boundaries[1]);
+           i++) {
+        count_lz77_symbol(&frequencies[0], parse->store.entries[i], sign);
+        count_lz77_symbol(&frequencies[1], parse->store.entries[i], -sign);
+      }
+    }
+  }
+  return true;
+}
+
+// Applies an accepted block move
+void apply_block_move(PARSE_STATE *state, size_t block,
+                      const size_t *boundaries,
+                      const DEFLATE_BLOCK_FREQUENCIES *frequencies,
+                      const size_t *bits, int block_change) {
+  DEFLATE_PARSE *parse = &state->parse;
+  size_t new_block_count = block_change == -1 ? 1 : 2;
+  size_t old_block_count = block_change == 1 ? 1 : 2;
+
+  // Later blocks move by the number of added or removed blocks
+  if (new_block_count > old_block_count &&
+      parse->block_count == parse->block_capacity) {
+    reserve_deflate_blocks(parse, parse->block_count + 1);
+    state->frequencies =
+        counted_realloc(state->frequencies, sizeof(DEFLATE_BLOCK_FREQUENCIES) *
+                                                parse->block_capacity);
+    state->block_bits =
+        counted_realloc(state->block_bits,
+                        sizeof(size_t) * parse->block_capacity);
+  }
+  size_t moved = parse->block_count - block - old_block_count;
+  memmove(parse->block_starts + block + new_block_count + 1,
+          parse->block_starts + block + old_block_count + 1,
+          sizeof(size_t) * moved);
+  memmove(state->frequencies + block + new_block_count,
+          state->frequencies + block + old_block_count,
+          sizeof(DEFLATE_BLOCK_FREQUENCIES) * moved);
+  memmove(state->block_bits + block + new_block_count,
+          state->block_bits + block + old_block_count, sizeof(size_t) * moved);
+  parse->block_count += new_block_count - old_block_count;
+
+  for (size_t b = 0; b < new_block_count; b++) {
+    parse->block_starts[block + b] = boundaries[b];
+    state->frequencies[block + b] = frequencies[b];
+    state->block_bits[block + b] = bits[b];
+  }
+  parse->block_starts[block + new_block_count] = boundaries[new_block_count];
+}
+
+// Anneals the LZ77 parse and block boundaries starting from the given parse.
+// Each move only changes one or two blocks, which are scored from updated
+// symbol frequencies with exact deflate block sizes.
+void run_parse_annealing_job(void *argument) {
+  PARSE_ANNEALING_JOB *job = argument;
+  const PARSE_ANNEALING_CONTEXT *context = job->context;
+
+  // Moves change the number of symbols by little, the store grows if needed
+  size_t symbol_count = context->start->store.size;
+  PARSE_STATE state;
+  init_deflate_parse(&state.parse, symbol_count + symbol_count / 8);
+  copy_deflate_parse(&state.parse, context->start);
+  state.checkpoints =
+      counted_malloc(sizeof(size_t) *
+             (state.parse.store.capacity / POSITION_CHECKPOINT_INTERVAL + 1));
+  state.checkpoints[0] = 0;
+  state.valid_checkpoints = 1;
+  state.frequencies = counted_malloc(sizeof(DEFLATE_BLOCK_FREQUENCIES) *
+                             state.parse.block_capacity);
+  state.block_bits =
+      counted_malloc(sizeof(size_t) * state.parse.block_capacity);
+
+  state.bits = 0;
+  for (size_t b = 0; b < state.parse.block_count; b++) {
+    count_lz77_symbols(&state.frequencies[b], &state.parse.store,
+                       state.parse.block_starts[b],
+                       state.parse.block_starts[b + 1]);
+    state.block_bits[b] = deflate_block_bits(&state.frequencies[b], NULL);
+    state.bits += state.block_bits[b];
+  }
+
+  init_deflate_parse(&job->best, state.parse.store.capacity);
+  copy_deflate_parse(&job->best, &state.parse);
+  job->bits = state.bits;
+
+  uint32_t entries[520];
+  uint64_t random_state = job->seed;
+  for (int iteration = 0; iteration < context->iterations; iteration++) {
+    if (compression_cancelled(context->task)) {
+      break;
+    }
+    // Estimate adds the zlib header and Adler-32
+    if (job->reports_progress && iteration % 1024 == 0) {
+      report_compression_progress(context->task, COMPRESSION_PHASE_ANNEALING,
+                                  iteration, (job->bits + 7) / 8 + 6);
+    }
+
+    double temperature =
+        0.5 * (1.0 - (double)iteration / (double)context->iterations);
+    bool block_move = next_random(&random_state) % 16 == 0;
+
+    size_t block = 0;
+    size_t bits = 0;
+    size_t old_bits = 0;
+    size_t first = 0;
+    size_t last = 0;
+    size_t count = 0;
+    size_t boundaries[3];
+    size_t new_block_bits[2];
+    int block_change = 0;
+    DEFLATE_BLOCK_FREQUENCIES frequencies[2];
+    if (block_move) {
+      if (!propose_block_move(&state, &random_state, &block, boundaries,
+                              frequencies, &block_change)) {
+        continue;
+      }
+      size_t new_block_count = block_change == -1 ? 1 : 2;
+      size_t old_block_count = block_change == 1 ? 1 : 2;
+      for (size_t b = 0; b < new_block_count; b++) {
+        new_block_bits[b] = deflate_block_bits(&frequencies[b], NULL);
+        bits += new_block_bits[b];
+      }
+      for (size_t b = 0; b < old_block_count; b++) {
+        old_bits += state.block_bits[block + b];
+      }
+    } else {
+      count = propose_parse_move(context, &state, &random_state, &block,
+                                 &first, &last, entries);
+      if (count == 0) {
+        continue;
+      }
+      frequencies[0] = state.frequencies[block];
+      for (size_t i = first; i < last; i++) {
+        count_lz77_symbol(&frequencies[0], state.parse.store.entries[i], -1);
+      }
+      for (size_t i = 0; i < count; i++) {
+        count_lz77_symbol(&frequencies[0], entries[i], 1);
+      }
+      bits = deflate_block_bits(&frequencies[0], NULL);
+      old_bits = state.block_bits[block];
+    }
+
+    if (!annealing_accepts(bits, old_bits, temperature, &random_state)) {
+      continue;
+    }
+
+    if (block_move) {
+      apply_block_move(&state, block, boundaries, frequencies, new_block_bits,
+                       block_change);
+    } else {
+      replace_symbols(&state, block, first, last, entries, count);
+      state.frequencies[block] = frequencies[0];
+      state.block_bits[block] = bits;
+    }
+    state.bits = state.bits - old_bits + bits;
+
+    if (state.bits < job->bits) {
+      job->bits = state.bits;
+      copy_deflate_parse(&job->best, &state.parse);
+    }
+  }
+
+  counted_free(state.block_bits);
+  counted_free(state.frequencies);
+  counted_free(state.checkpoints);
+  free_deflate_parse(&state.parse);
+}
+
+// Re-encodes compressed image data after annealing its LZ77 parse and block
+// boundaries on all threads, starting from the parse of the given zlib
+// stream. Keeps the smaller stream that passes the round trip check.
+void anneal_compressed_image(IMAGE *image, unsigned char **compressed_data,
+                             unsigned long *compressed_data_size,
+                             USER_OPTIONS *user_options,
+                             COMPRESSION_STATISTICS *compression_statistics,
+                             COMPRESSION_TASK *task) {
+  DEFLATE_PARSE start;
+  if (!parse_deflate_stream(*compressed_data, *compressed_data_size,
+                            image->size, &start)) {
+    printf("Failed to parse compressed image data, not annealed\n");
+    return;
+  }
+
+  MATCH_CANDIDATES candidates;
+  init_match_candidates(image->data, image->size, &candidates);
+
+  PARSE_ANNEALING_CONTEXT context = {image->data,
+                                     &candidates,
+                                     &start,
+                                     user_options->anneal_iterations,
+                                     task};
+  size_t job_count = search_chain_count(user_options);
+  PARSE_ANNEALING_JOB *jobs =
+      counted_malloc(sizeof(PARSE_ANNEALING_JOB) * job_count);
+  for (size_t i = 0; i < job_count; i++) {
+    jobs[i].context = &context;
+    jobs[i].seed = search_chain_seed(i);
+    jobs[i].reports_progress = i == 0 && task != NULL;
+    jobs[i].bits = SIZE_MAX;
+  }
+
+  run_parallel(run_parse_annealing_job, jobs, sizeof(PARSE_ANNEALING_JOB),
+               job_count, user_options->thread_count);
+
+  size_t best_job = 0;
+  for (size_t i = 1; i < job_count; i++) {
+    if (jobs[i].bits < jobs[best_job].bits) {
+      best_job = i;
+    }
+  }
+
+  unsigned char *annealed_data = NULL;
+  unsigned long annealed_data_size = 0;
+  write_zlib_stream(&jobs[best_job].best, *compressed_data, image->data,
+                    image->size, &annealed_data, &annealed_data_size);
+  if (annealed_data_size < *compressed_data_size &&
+      verify_image_round_trip(image, annealed_data, annealed_data_size)) {
+    compression_statistics->annealing_saved_bytes =
+        *compressed_data_size - annealed_data_size;
+    counted_free(*compressed_data);
+    *compressed_data = annealed_data;
+    *compressed_data_size = annealed_data_size;
+  } else {
+    counted_free(annealed_data);
+  }
+
+  for (size_t i = 0; i < job_count; i++) {
+    free_deflate_parse(&jobs[i].best);
+  }
+  counted_free(jobs);
+  free_match_candidates(&candidates);
+  counted_free(start.block_starts);
+  free_lz77_store(&start.store);
+}
+
+// Keeps compressed image data if it is the smallest so far
+void offer_compression_result(COMPRESSION_TASK *task,
+                              unsigned char *compressed_data,
+                              unsigned long compressed_data_size,
+                              COMPRESSION_PHASE phase, int iteration) {
+  if (task->compressed_data == NULL ||
+      compressed_data_size < task->compressed_data_size) {
+    counted_free(task->compressed_data);
+    task->compressed_data = compressed_data;
+    task->compressed_data_size = compressed_data_size;
+  } else {
+    counted_free(compressed_data);
+  }
+  report_compression_progress(task, phase, iteration,
+                              task->compressed_data_size);
+}
+
+// Compresses with zlib, which is quick enough to not be cancelled
+void offer_zlib_compression_result(COMPRESSION_TASK *task) {
+  USER_OPTIONS zlib_options = task->user_options;
+  zlib_options.no_zopfli = true;
+  unsigned char *compressed_data = NULL;
+  unsigned long compressed_data_size = 0;
+  if (compress_image(task->image, &zlib_options, &compressed_data,
+                     &compressed_data_size)) {
+    offer_compression_result(task, compressed_data, compressed_data_size,
+                             COMPRESSION_PHASE_DEFLATE, 0);
+  }
+}
+
+// Compresses with zlib first so that a cancelled task always has a result,
+// then with zopfli and the LZ77 parse annealing as selected. If zopfli is the
+// only phase zlib only runs when zopfli is cancelled. Zopfli has no progress
+// or cancellation hooks, it runs as one call that a cancel waits for.
+int run_compression_task(void *argument) {
+  COMPRESSION_TASK *task = argument;
+  USER_OPTIONS *user_options = &task->user_options;
+
+  bool zopfli_only = !user_options->no_zopfli && !user_options->anneal_parse;
+  if (!zopfli_only) {
+    offer_zlib_compression_result(task);
+  }
+
+  if (!user_options->no_zopfli && !compression_cancelled(task)) {
+    report_compression_progress(task, COMPRESSION_PHASE_ZOPFLI, 0,
+                                task->compressed_data != NULL
+                                    ? task->compressed_data_size
+                                    : SIZE_MAX);
+    unsigned char *compressed_data = NULL;
+    unsigned long compressed_data_size = 0;
+    if (compress_image(task->image, user_options, &compressed_data,
+                       &compressed_data_size)) {
+      offer_compression_result(task, compressed_data, compressed_data_size,
+                               COMPRESSION_PHASE_ZOPFLI,
+                               user_options->zopfli_iterations);
+    }
+  }
+  if (task->compressed_data == NULL) {
+    offer_zlib_compression_result(task);
+  }
+
+  if (user_options->anneal_parse && task->compressed_data != NULL &&
+      !compression_cancelled(task)) {
+    anneal_compressed_image(task->image, &task->compressed_data,
+                            &task->compressed_data_size, user_options,
+                            task->compression_statistics, task);
+  }
+
+  task->compression_statistics->cancelled = compression_cancelled(task);
+  report_compression_progress(task, COMPRESSION_PHASE_DONE, 0,
+                              task->compressed_data_size);
+  atomic_store(&task->done, true);
+  if (task->completion_callback != NULL) {
+    task->completion_callback(task, task->callback_context);
+  }
+  return 0;
+}
+
+// Starts compressing the image data without blocking. The image and the
+// statistics have to stay valid until the task is finished. Callbacks may be
+// NULL. Returns NULL if the thread could not be started.
+COMPRESSION_TASK *submit_compression(
+    IMAGE *image, const USER_OPTIONS *user_options,
+    COMPRESSION_STATISTICS *compression_statistics,
+    void (*progress_callback)(const COMPRESSION_PROGRESS *progress,
+                              void *context),
+    void (*completion_callback)(COMPRESSION_TASK *task, void *context),
+    void *callback_context) {
+  COMPRESSION_TASK *task = counted_calloc(1, sizeof(COMPRESSION_TASK));
+  task->image = image;
+  task->user_options = *user_options;
+  task->compression_statistics = compression_statistics;
+  task->progress_callback = progress_callback;
+  task->completion_callback = completion_callback;
+  task->callback_context = callback_context;
+  task->progress.best_size = SIZE_MAX;
+  atomic_init(&task->cancelled, false);
+  atomic_init(&task->done, false);
+
+  if (mtx_init(&task->progress_mutex, mtx_plain) != thrd_success) {
+    counted_free(task);
+    return NULL;
+  }
+  if (thrd_create(&task->thread, run_compression_task, task) !=
+      thrd_success) {
+    mtx_destroy(&task->progress_mutex);
+    counted_free(task);
+    return NULL;
+  }
+  return task;
+}
+
+// Returns true once the task is done, the progress snapshot is copied if
+// requested
+bool poll_compression(COMPRESSION_TASK *task, COMPRESSION_PROGRESS *progress) {
+  if (progress != NULL) {
+    mtx_lock(&task->progress_mutex);
+    *progress = task->progress;
+    mtx_unlock(&task->progress_mutex);
+  }
+  return atomic_load(&task->done);
+}
+
+void cancel_compression(COMPRESSION_TASK *task) {
+  atomic_store(&task->cancelled, true);
+}
+
+// Waits for the task, hands over the smallest compressed image data (best
+// so far if cancelled) and frees the task. Returns false if there is none.
+bool finish_compression(COMPRESSION_TASK *task,
+                        unsigned char **compressed_data,
+                        unsigned long *compressed_data_size) {
+  thrd_join(task->thread, NULL);
+  mtx_destroy(&task->progress_mutex);
+
+  *compressed_data = task->compressed_data;
+  *compressed_data_size = task->compressed_data_size;
+  bool success = task->compressed_data != NULL;
+  counted_free(task);
+  return success;
+}
+
+void print_compression_progress(const COMPRESSION_PROGRESS *progress,
+                                void *context) {
+  (void)context;
+  if (progress->best_size == SIZE_MAX) {
+    printf("Progress: %s, iteration %d, no result yet\n",
+           COMPRESSION_PHASE_NAMES[progress->phase], progress->iteration);
+    return;
+  }
+  printf("Progress: %s, iteration %d, best %lu bytes\n",
+         COMPRESSION_PHASE_NAMES[progress->phase], progress->iteration,
+         progress->best_size);
+}
+
+// Set by Ctrl+C, the running compression is cancelled and its best result
+// so far written. A second Ctrl+C ends the process.
+atomic_bool interrupt_requested;
+
+void handle_interrupt(int signal_number) {
+  atomic_store(&interrupt_requested, true);
+  signal(signal_number, SIG_DFL);
+}
+
+bool write_image_as_png(IMAGE *image, USER_OPTIONS *user_options,
+                       COMPRESSION_STATISTICS *compression_statistics) {
+  begin_memory_phase(MEMORY_PHASE_COMPRESSION);
+  COMPRESSION_TASK *task = submit_compression(
+      image, user_options, compression_statistics,
+      user_options->progress ? print_compression_progress : NULL, NULL, NULL);
+  if (task == NULL) {
+    printf("Failed to start compression\n");
+    return false;
+  }
+
+  // Ctrl+C cancels the compression instead of ending the process
+  atomic_store(&interrupt_requested, false);
+  signal(SIGINT, handle_interrupt);
+  struct timespec poll_interval = {0, 1000000};
+  while (!poll_compression(task, NULL)) {
+    if (atomic_load(&interrupt_requested)) {
+      cancel_compression(task);
+    }
+    thrd_sleep(&poll_interval, NULL);
+  }
+  signal(SIGINT, SIG_DFL);
+
+  unsigned long compressed_data_size = 0;
+  unsigned char *compressed_data = NULL;
+  if (!finish_compression(task, &compressed_data, &compressed_data_size)) {
+    return false;
+  }
+
+  begin_memory_phase(MEMORY_PHASE_OUTPUT);
+  bool success = write_compressed_image_as_png(
+      image, compressed_data, compressed_data_size, user_options,
+      compression_statistics);
+
+  counted_free(compressed_data);
+  return success;
+}
+
+// Single-row fast path for small javascript: encodes straight into a
+// caller-provided buffer with a reusable zlib deflate state, so an encode
+// makes no heap allocations once the encoder is initialized
+typedef struct FAST_ENCODER {
+  z_stream stream;
+  // Selects the single-row bootstrap per encode, see use_single_row_readback
+  double readback_cost;
+} FAST_ENCODER;
+
+bool init_fast_encoder(FAST_ENCODER *encoder, double readback_cost) {
+  memset(encoder, 0, sizeof(FAST_ENCODER));
+  init_zlib_stream(&encoder->stream);
+  encoder->readback_cost = readback_cost;
+  return deflateInit(&encoder->stream, 9 /* level */) == Z_OK;
+}
+
+void free_fast_encoder(FAST_ENCODER *encoder) {
+  deflateEnd(&encoder->stream);
+}
+
+// Longest single-row unpack code, the row width has at most 4 digits
+size_t max_single_row_unpack_code_length() {
+  return max(strlen(SINGLE_ROW_IMAGE_HTML_UNPACK),
+             single_row_readback_unpack_code_length(SINGLE_ROW_MAX_LENGTH));
+}
+
+// Output buffer size that fits the fast path PNG of any javascript shorter
+// than SINGLE_ROW_MAX_LENGTH
+size_t fast_encode_bound() {
+  return sizeof(PNG_HEADER) + (12 + 13) +
+         (12 + max_single_row_unpack_code_length()) +
+         (12 + compressBound(SINGLE_ROW_MAX_LENGTH + 1)) + 12;
+}
+
+// Encodes javascript shorter than SINGLE_ROW_MAX_LENGTH as a single-row PNG
+// with the given format hacks. The output buffer needs fast_encode_bound()
+// bytes. Returns the PNG size or 0 on failure.
+size_t fast_encode_png(FAST_ENCODER *encoder, const char *javascript,
+                       size_t javascript_length, unsigned int format_hacks,
+                       unsigned char *output, size_t output_size) {
+  if (javascript_length >= (size_t)SINGLE_ROW_MAX_LENGTH ||
+      output_size < fast_encode_bound()) {
+    return 0;
+  }
+
+  unsigned char *position = output;
+  memcpy(position, PNG_HEADER, sizeof(PNG_HEADER));
+  position += sizeof(PNG_HEADER);
+
+  // Row is the 'no filtering' indicator, the javascript and its \0 end marker
+  PNG_IHDR png_ihdr = {htonl(javascript_length + 1), htonl(1), 8, 0, 0, 0, 0};
+  position = append_png_chunk(position, "IHDR", (unsigned char *)&png_ihdr,
+                              2 * sizeof(unsigned int) + 5,
+                              format_hacks & FORMAT_HACK_OMIT_IHDR_CRC, false);
+
+  // The one readback bootstrap is formatted in place of the chunk data
+  bool jawh_crc_overflow = format_hacks & FORMAT_HACK_JAWH_CRC_OVERFLOW;
+  const char *unpack_code = SINGLE_ROW_IMAGE_HTML_UNPACK;
+  size_t unpack_code_length = strlen(SINGLE_ROW_IMAGE_HTML_UNPACK);
+  if (use_single_row_readback(javascript_length + 1,
+                              encoder->readback_cost)) {
+    unpack_code = (const char *)position + 8;
+    unpack_code_length =
+        snprintf((char *)position + 8, max_single_row_unpack_code_length() + 1,
+                 SINGLE_ROW_READBACK_IMAGE_HTML_UNPACK,
+                 (unsigned int)javascript_length + 1);
+  }
+  position = append_png_chunk(position, "jawh",
+                              (const unsigned char *)unpack_code,
+                              unpack_code_length, jawh_crc_overflow,
+                              jawh_crc_overflow);
+
+  // Deflate in place behind the IDAT chunk header, zlib keeps its own copy
+  // of the row pieces so none is assembled
+  static const unsigned char zero = 0;
+  z_stream *stream = &encoder->stream;
+  deflateReset(stream);
+  stream->next_out = position + 8;
+  stream->avail_out = output + output_size - stream->next_out - 12;
+  stream->next_in = (unsigned char *)&zero;
+  stream->avail_in = 1;
+  deflate(stream, Z_NO_FLUSH);
+  stream->next_in = (unsigned char *)javascript;
+  stream->avail_in = javascript_length;
+  deflate(stream, Z_NO_FLUSH);
+  stream->next_in = (unsigned char *)&zero;
+  stream->avail_in = 1;
+  if (deflate(stream, Z_FINISH) != Z_STREAM_END) {
+    return 0;
+  }
+
+  // Trailing Adler-32 of the zlib stream can be dropped
+  size_t compressed_data_size = stream->total_out;
+  if (format_hacks & FORMAT_HACK_OMIT_ADLER32) {
+    compressed_data_size -= 4;
+  }
+  position = append_png_chunk(position, "IDAT", position + 8,
+                              compressed_data_size,
+                              format_hacks & FORMAT_HACK_OMIT_IDAT_CRC, false);
+
+  if (!(format_hacks & FORMAT_HACK_OMIT_IEND)) {
+    position = append_png_chunk(position, "IEND", NULL, 0, false, false);
+  }
+  return position - output;
+}
+
+int compare_doubles(const void *a, const void *b) {
+  double value_a = *(const double *)a;
+  double value_b = *(const double *)b;
+  return (value_a > value_b) - (value_a < value_b);
+}
+
+// Measures the fast path latency over the given number of encodes, the
+// output buffer holds the last result. Returns the PNG size or 0 on failure.
+size_t benchmark_fast_path(FAST_ENCODER *encoder, const char *javascript,
+                           size_t javascript_length, unsigned int format_hacks,
+                           unsigned char *output, size_t output_size,
+                           int runs, double *p50, double *p99) {
+  double *latencies = counted_malloc(sizeof(double) * runs);
+  size_t png_size = 0;
+  for (int i = 0; i < runs; i++) {
+    struct timespec start;
+    timespec_get(&start, TIME_UTC);
+    png_size = fast_encode_png(encoder, javascript, javascript_length,
+                               format_hacks, output, output_size);
+    latencies[i] = milliseconds_since(&start) * 1000.0;
+  }
+
+  qsort(latencies, runs, sizeof(double), compare_doubles);
+  *p50 = latencies[(runs - 1) / 2];
+  *p99 = latencies[(size_t)((runs - 1) * 0.99)];
+  counted_free(latencies);
+  return png_size;
+}
+
+// Writes javascript shorter than SINGLE_ROW_MAX_LENGTH with the fast path,
+// optionally reporting its latency over repeated encodes
+bool write_javascript_with_fast_path(
+    const char *javascript, USER_OPTIONS *user_options,
+    COMPRESSION_STATISTICS *compression_statistics) {
+  size_t javascript_length = strlen(javascript);
+  compression_statistics->javascript_size = javascript_length;
+
+  FAST_ENCODER encoder;
+  if (!init_fast_encoder(&encoder, user_options->readback_cost)) {
+    printf("Failed to initialize deflate\n");
+    return false;
+  }
+
+  size_t output_size = fast_encode_bound();
+  unsigned char *output = counted_malloc(output_size);
+  size_t png_size = 0;
+  if (user_options->fast_path_benchmark_runs > 0) {
+    png_size = benchmark_fast_path(
+        &encoder, javascript, javascript_length, user_options->format_hacks,
+        output, output_size, user_options->fast_path_benchmark_runs,
+        &compression_statistics->fast_path_p50,
+        &compression_statistics->fast_path_p99);
+    compression_statistics->fast_path_runs =
+        user_options->fast_path_benchmark_runs;
+  } else {
+    png_size = fast_encode_png(&encoder, javascript, javascript_length,
+                               user_options->format_hacks, output,
+                               output_size);
+  }
+  free_fast_encoder(&encoder);
+
+  bool success = png_size > 0;
+  if (!success) {
+    printf("Failed to deflate image data\n");
+  } else {
+    success = write_binary_file(user_options->png_path, output, png_size);
+    if (!success) {
+      printf("Failed to write destination png file '%s'\n",
+             user_options->png_path);
+    }
+  }
+  counted_free(output);
+
+  compression_statistics->png_size = png_size;
+  compression_statistics->format_hacks = user_options->format_hacks;
+  compression_statistics->row_width = javascript_length + 1;
+  compression_statistics->single_row_bootstrap =
+      use_single_row_readback(javascript_length + 1,
+                              user_options->readback_cost)
+          ? "one readback"
+          : "per pixel";
+  compression_statistics->fast_path = true;
+  return success;
+}
+
+// Reads a big-endian 32 bit value as stored in PNG chunks
+uint32_t read_png_uint32(const unsigned char *data) {
+  uint32_t value;
+  memcpy(&value, data, 4);
+  return ntohl(value);
+}
+
+// Whether a chunk's data is followed by its valid CRC32
+bool png_chunk_crc_matches(const unsigned char *chunk, size_t data_size,
+                           const unsigned char *end) {
+  if ((size_t)(end - chunk) < 8 + data_size + 4) {
+    return false;
+  }
+  return crc32(0L, chunk + 4, 4 + data_size) ==
+         read_png_uint32(chunk + 8 + data_size);
+}
+
+// Parses a file written by zopfli-pnginator, with or without format hacks,
+// and recovers its image data and unpack code. The format hacks the file uses
+// are stored if format_hacks is not NULL. Returns NULL if the file is not one.
+IMAGE *read_pnginator_file(const unsigned char *file, size_t file_size,
+                           unsigned int *format_hacks) {
+  unsigned int hacks = 0;
+  const unsigned char *end = file + file_size;
+  const unsigned char *chunk = file + sizeof(PNG_HEADER);
+  if (file_size < sizeof(PNG_HEADER) + 8 + 13 ||
+      memcmp(file, PNG_HEADER, sizeof(PNG_HEADER)) != 0 ||
+      read_png_uint32(chunk) != 13 || memcmp(chunk + 4, "IHDR", 4) != 0) {
+    return NULL;
+  }
+
+  // Only 8 bit grayscale images without filtering or interlacing are ours
+  const unsigned char *ihdr = chunk + 8;
+  size_t width = read_png_uint32(ihdr);
+  size_t height = read_png_uint32(ihdr + 4);
+  if (width == 0 || height == 0 || ihdr[8] != 8 || ihdr[9] != 0 ||
+      ihdr[10] != 0 || ihdr[11] != 0 || ihdr[12] != 0) {
+    return NULL;
+  }
+  bool ihdr_crc = png_chunk_crc_matches(chunk, 13, end);
+  hacks |= ihdr_crc ? 0 : FORMAT_HACK_OMIT_IHDR_CRC;
+  chunk += 8 + 13 + (ihdr_crc ? 4 : 0);
+
+  // Custom chunk either has a CRC32 or overflows into its place
+  if (end - chunk < 8 || memcmp(chunk + 4, "jawh", 4) != 0) {
+    return NULL;
+  }
+  size_t jawh_size = read_png_uint32(chunk);
+  if ((size_t)(end - chunk) < 8 + jawh_size + 4) {
+    return NULL;
+  }
+  bool jawh_crc = png_chunk_crc_matches(chunk, jawh_size, end);
+  hacks |= jawh_crc ? 0 : FORMAT_HACK_JAWH_CRC_OVERFLOW;
+  size_t unpack_code_length = jawh_size + (jawh_crc ? 0 : 4);
+  char *unpack_code = counted_malloc(unpack_code_length + 1);
+  memcpy(unpack_code, chunk + 8, unpack_code_length);
+  unpack_code[unpack_code_length] = '\0';
+  chunk += 8 + jawh_size + 4;
+
+  // Image data may lack its CRC32 and the Adler-32 of the zlib stream, it is
+  // complete once all rows are inflated
+  IMAGE *image = NULL;
+  size_t compressed_data_size = 0;
+  if (end - chunk >= 8 && memcmp(chunk + 4, "IDAT", 4) == 0) {
+    compressed_data_size =
+        min(read_png_uint32(chunk), (size_t)(end - chunk) - 8);
+
+    // Without its CRC32 the IDAT chunk ends the file, otherwise IEND follows
+    const unsigned char *iend = chunk + 8 + compressed_data_size + 4;
+    if (iend > end) {
+      hacks |= FORMAT_HACK_OMIT_IDAT_CRC | FORMAT_HACK_OMIT_IEND;
+    } else if (end - iend < 8 || memcmp(iend + 4, "IEND", 4) != 0) {
+      hacks |= FORMAT_HACK_OMIT_IEND;
+    }
+
+    image = counted_malloc(sizeof(IMAGE));
+    image->width = width;
+    image->height = height;
+    image->size = (width + 1) * height;
+    image->data = counted_malloc(image->size);
+    image->payload_size = 0;
+    image->unpack_code = unpack_code;
+
+    z_stream stream;
+    init_zlib_stream(&stream);
+    stream.next_in = (unsigned char *)chunk + 8;
+    stream.avail_in = compressed_data_size;
+    stream.next_out = image->data;
+    stream.avail_out = image->size;
+    bool inflated = inflateInit(&stream) == Z_OK;
+    if (inflated) {
+      int result = inflate(&stream, Z_FINISH);
+      inflated = (result == Z_STREAM_END || result == Z_BUF_ERROR) &&
+                 stream.total_out == image->size;
+      // Stream ends early without its Adler-32
+      hacks |= result == Z_STREAM_END ? 0 : FORMAT_HACK_OMIT_ADLER32;
+      inflateEnd(&stream);
+    }
+
+    if (!inflated) {
+      counted_free(image->data);
+      counted_free(image);
+      image = NULL;
+    }
+  }
+
+  if (image == NULL) {
+    counted_free(unpack_code);
+  }
+  if (format_hacks != NULL) {
+    *format_hacks = hacks;
+  }
+  return image;
+}
+
+// Bootstrap decode benchmark: a harness for any javascript shell (node, qjs,
+// d8) that runs the unpack code of a written file against a canvas shim,
+// times it and checks that it yields the packed javascript. It is the header
+// followed by the shim and the runner. Header arguments are the file path,
+// image width and height, run count, base64 pixels, unpack code and expected
+// javascript.
+const char *BOOTSTRAP_BENCHMARK_HEADER =
+    "// Bootstrap decode benchmark for %s written by zopfli-pnginator\n"
+    "var WIDTH = %lu, HEIGHT = %lu, RUNS = %d;\n"
+    "var PIXELS = '%s';\n"
+    "var UNPACK_CODE = %s;\n"
+    "var EXPECTED = %s;\n"
+    "\n";
+
+const char *BOOTSTRAP_BENCHMARK_SHIM =
+    "var global = typeof globalThis != 'undefined' ? globalThis : this;\n"
+    "global.self = global.self || global;\n"
+    "var log = typeof console != 'undefined' ? function (text) {\n"
+    "  console.log(text);\n"
+    "} : print;\n"
+    "var now = typeof performance != 'undefined' ? function () {\n"
+    "  return performance.now();\n"
+    "} : function () {\n"
+    "  return Date.now();\n"
+    "};\n"
+    "\n"
+    "// Shells without TextDecoder get a UTF-8 decoder\n"
+    "if (!global.TextDecoder) {\n"
+    "  global.TextDecoder = function () {};\n"
+    "  global.TextDecoder.prototype.decode = function (bytes) {\n"
+    "    var text = '';\n"
+    "    for (var i = 0; i < bytes.length;) {\n"
+    "      var c = bytes[i++];\n"
+    "      var extra = c > 239 ? 3 : c > 223 ? 2 : c > 191 ? 1 : 0;\n"
+    "      for (c &= [255, 31, 15, 7][extra]; extra--;) {\n"
+    "        c = c << 6 | bytes[i++] & 63;\n"
+    "      }\n"
+    "      text += String.fromCodePoint(c);\n"
+    "    }\n"
+    "    return text;\n"
+    "  };\n"
+    "}\n"
+    "\n"
+    "function decodeBase64(text) {\n"
+    "  var digits = 'ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz' +\n"
+    "               '0123456789+/';\n"
+    "  var values = [], bytes = new Uint8Array(text.length * 3 >> 2);\n"
+    "  for (var i = 0; i < 64; i++) {\n"
+    "    values[digits.charCodeAt(i)] = i;\n"
+    "  }\n"
+    "  for (var i = 0, bits = 0, count = 0, n = 0; i < text.length; i++) {\n"
+    "    bits = (bits << 6 | values[text.charCodeAt(i)]) & 65535;\n"
+    "    if ((count += 6) >= 8) {\n"
+    "      bytes[n++] = bits >> (count -= 8) & 255;\n"
+    "    }\n"
+    "  }\n"
+    "  return bytes;\n"
+    "}\n"
+    "\n"
+    "// Canvas shim like a browser canvas: drawImage writes opaque gray\n"
+    "// pixels into a persistent RGBA buffer, getImageData copies them out.\n"
+    "// Setting the size clears it. Counts the bytes of the buffers it\n"
+    "// allocates.\n"
+    "var counters;\n"
+    "function Canvas() {\n"
+    "  this.w = 300;\n"
+    "  this.h = 150;\n"
+    "  this.buffer = null;\n"
+    "}\n"
+    "Object.defineProperty(Canvas.prototype, 'width', {\n"
+    "  get: function () { return this.w; },\n"
+    "  set: function (value) { this.w = value; this.buffer = null; }\n"
+    "});\n"
+    "Object.defineProperty(Canvas.prototype, 'height', {\n"
+    "  get: function () { return this.h; },\n"
+    "  set: function (value) { this.h = value; this.buffer = null; }\n"
+    "});\n"
+    "Canvas.prototype.pixels = function () {\n"
+    "  if (!this.buffer) {\n"
+    "    this.buffer = new Uint8ClampedArray(this.w * this.h * 4);\n"
+    "    counters.bytes += this.buffer.length;\n"
+    "  }\n"
+    "  return this.buffer;\n"
+    "};\n"
+    "Canvas.prototype.getContext = function () {\n"
+    "  var canvas = this;\n"
+    "  return {\n"
+    "    drawImage: function (image, x, y) {\n"
+    "      counters.draws++;\n"
+    "      var buffer = canvas.pixels();\n"
+    "      var left = Math.max(x, 0);\n"
+    "      var right = Math.min(x + image.width, canvas.w);\n"
+    "      var bottom = Math.min(y + image.height, canvas.h);\n"
+    "      for (var row = Math.max(y, 0); row < bottom && left < right;\n"
+    "           row++) {\n"
+    "        var source = ((row - y) * image.width + left - x) * 4;\n"
+    "        buffer.set(image.rgba.subarray(source,\n"
+    "                                       source + (right - left) * 4),\n"
+    "                   (row * canvas.w + left) * 4);\n"
+    "      }\n"
+    "    },\n"
+    "    getImageData: function (x, y, w, h) {\n"
+    "      counters.reads++;\n"
+    "      var buffer = canvas.pixels();\n"
+    "      var data = new Uint8ClampedArray(w * h * 4);\n"
+    "      counters.bytes += data.length;\n"
+    "      var left = Math.max(x, 0), right = Math.min(x + w, canvas.w);\n"
+    "      var bottom = Math.min(y + h, canvas.h);\n"
+    "      for (var row = Math.max(y, 0); row < bottom && left < right;\n"
+    "           row++) {\n"
+    "        var source = (row * canvas.w + left) * 4;\n"
+    "        data.set(buffer.subarray(source, source + (right - left) * 4),\n"
+    "                 ((row - y) * w + left - x) * 4);\n"
+    "      }\n"
+    "      return {data: data, width: w, height: h};\n"
+    "    }\n"
+    "  };\n"
+    "};\n"
+    "\n";
+
+const char *BOOTSTRAP_BENCHMARK_RUNNER =
+    "var pixels = decodeBase64(PIXELS);\n"
+    "var image = {width: WIDTH, height: HEIGHT,\n"
+    "             rgba: new Uint8ClampedArray(pixels.length * 4)};\n"
+    "for (var i = 0; i < pixels.length; i++) {\n"
+    "  image.rgba[i * 4] = image.rgba[i * 4 + 1] = image.rgba[i * 4 + 2] =\n"
+    "      pixels[i];\n"
+    "  image.rgba[i * 4 + 3] = 255;\n"
+    "}\n"
+    "\n"
+    "// The unpack code hands the javascript to done instead of evaluating it\n"
+    "var unpack = Function('done', UNPACK_CODE);\n"
+    "var times = [], result;\n"
+    "for (var run = 0; run < RUNS; run++) {\n"
+    "  counters = {bytes: 0, draws: 0, reads: 0};\n"
+    "  global.c = new Canvas();\n"
+    "  var start = now();\n"
+    "  unpack.call(image, function (javascript) { result = javascript; });\n"
+    "  times.push(now() - start);\n"
+    "}\n"
+    "times.sort(function (a, b) { return a - b; });\n"
+    "log('Decode time: ' + times[RUNS - 1 >> 1].toFixed(3) +\n"
+    "    ' ms median, ' + times[0].toFixed(3) + ' ms fastest of ' + RUNS +\n"
+    "    ' runs');\n"
+    "log('Canvas allocations: ' + counters.bytes + ' bytes per run (' +\n"
+    "    counters.draws + ' drawImage, ' + counters.reads +\n"
+    "    ' getImageData calls)');\n"
+    "if (result !== EXPECTED) {\n"
+    "  throw new Error('Decoded javascript differs from the packed one');\n"
+    "}\n"
+    "log('Decoded javascript: ' + result.length + ' characters, correct');\n";
+
+// Runs of the bootstrap decode benchmark, the median and fastest are reported
+const int BOOTSTRAP_BENCHMARK_RUNS = 20;
+
+// Base64 without padding, the benchmark harness decodes it itself
+char *encode_base64(const unsigned char *data, size_t size) {
+  static const char DIGITS[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  char *text = counted_malloc((size + 2) / 3 * 4 + 1);
+  size_t length = 0;
+  uint32_t bits = 0;
+  int count = 0;
+  for (size_t i = 0; i < size; i++) {
+    bits = (bits << 8 | data[i]) & 0xffff;
+    for (count += 8; count >= 6;) {
+      count -= 6;
+      text[length++] = DIGITS[(bits >> count) & 63];
+    }
+  }
+  if (count > 0) {
+    text[length++] = DIGITS[(bits << (6 - count)) & 63];
+  }
+  text[length] = '\0';
+  return text;
+}
+
+// Quotes text as a single-quoted javascript string, everything but printable
+// ASCII is escaped. UTF-8 sequences become one character each, other bytes
+// are taken as Latin-1.
+char *create_javascript_string_literal(const char *text) {
+  char *literal = counted_malloc(strlen(text) * 6 + 3);
+  size_t length = 0;
+  literal[length++] = '\'';
+  for (const unsigned char *position = (const unsigned char *)text;
+       *position != '\0';) {
+    uint32_t code_point;
+    size_t sequence_length = decode_utf8(position, &code_point);
+    if (sequence_length == 0) {
+      code_point = *position;
+      sequence_length = 1;
+    }
+    position += sequence_length;
+
+    if (code_point == '\\' || code_point == '\'') {
+      literal[length++] = '\\';
+      literal[length++] = code_point;
+    } else if (code_point >= 0x20 && code_point < 0x7f) {
+      literal[length++] = code_point;
+    } else if (code_point < 0x10000) {
+      length += sprintf(literal + length, "\\u%04x", code_point);
+    } else {
+      code_point -= 0x10000;
+      length += sprintf(literal + length, "\\u%04x\\u%04x",
+                        0xd800 + (code_point >> 10),
+                        0xdc00 + (code_point & 0x3ff));
+    }
+  }
+  literal[length++] = '\'';
+  literal[length] = '\0';
+  return literal;
+}
+
+// Writes the bootstrap decode benchmark for the written file. Its pixels and
+// unpack code are read back from the file, so the benchmark covers what is
+// shipped. The expected javascript is the text as the bootstrap yields it.
+bool write_bootstrap_benchmark(const char *javascript,
+                               USER_OPTIONS *user_options,
+                               COMPRESSION_STATISTICS *compression_statistics) {
+  size_t png_size = 0;
+  unsigned char *png = read_binary_file(user_options->png_path, &png_size);
+  IMAGE *image = png != NULL ? read_pnginator_file(png, png_size, NULL) : NULL;
+  counted_free(png);
+
+  // The unpack code is the onload attribute, the evaluation of the
+  // javascript is replaced by the harness callback and the code starting
+  // after it (WebAssembly instantiation) is left out, as is the function
+  // around it that receives the module bytes, see WASM_DECODE_CODE
+  char *onload = image != NULL ? strstr(image->unpack_code, "onload=") : NULL;
+  char *eval = onload != NULL ? strstr(onload, "(1,eval)(e)") : NULL;
+  char *wasm_eval =
+      onload != NULL ? strstr(onload, "(function(z){(1,eval)(e)") : NULL;
+  eval = wasm_eval != NULL ? wasm_eval : eval;
+  bool unfiltered = image != NULL;
+  for (size_t y = 0; unfiltered && y < image->height; y++) {
+    unfiltered = image->data[y * (image->width + 1)] == 0;
+  }
+  if (eval == NULL || !unfiltered) {
+    printf("Failed to read back png file '%s' for the bootstrap benchmark\n",
+           user_options->png_path);
+    if (image != NULL) {
+      counted_free(image->unpack_code);
+      counted_free(image->data);
+      counted_free(image);
+    }
+    return false;
+  }
+  strcpy(eval, "done(e)");
+
+  // Pixels without the filter type byte of each row
+  for (size_t y = 0; y < image->height; y++) {
+    memmove(image->data + y * image->width,
+            image->data + y * (image->width + 1) + 1, image->width);
+  }
+  char *pixels = encode_base64(image->data, image->width * image->height);
+  char *unpack_code = create_javascript_string_literal(onload + 7);
+
+  // Escapes chosen for non-ASCII text are part of the decoded javascript
+  const char *text_encoding = compression_statistics->text_encoding;
+  char *escaped_javascript =
+      text_encoding != NULL && strcmp(text_encoding, "escapes") == 0
+          ? escape_non_ascii(javascript)
+          : NULL;
+  char *expected = create_javascript_string_literal(
+      escaped_javascript != NULL ? escaped_javascript : javascript);
+
+  FILE *harness = fopen(user_options->bootstrap_benchmark_path, "w");
+  bool success = harness != NULL;
+  if (success) {
+    fprintf(harness, BOOTSTRAP_BENCHMARK_HEADER, user_options->png_path,
+            image->width, image->height, BOOTSTRAP_BENCHMARK_RUNS, pixels,
+            unpack_code, expected);
+    fputs(BOOTSTRAP_BENCHMARK_SHIM, harness);
+    fputs(BOOTSTRAP_BENCHMARK_RUNNER, harness);
+    success = !ferror(harness);
+    success = fclose(harness) == 0 && success;
+  }
+  if (!success) {
+    printf("Failed to write bootstrap benchmark '%s'\n",
+           user_options->bootstrap_benchmark_path);
+  }
+  compression_statistics->bootstrap_benchmark_path =
+      success ? user_options->bootstrap_benchmark_path : NULL;
+
+  counted_free(expected);
+  counted_free(escaped_javascript);
+  counted_free(unpack_code);
+  counted_free(pixels);
+  counted_free(image->unpack_code);
+  counted_free(image->data);
+  counted_free(image);
+  return success;
+}
+
+// Loader of two-stage loading, runs ahead of the first stage javascript. It
+// starts fetching all follow-on images at once and stores a promise of each
+// one's payload bytes in L, in stage order. Images are read in tiles of rows
+// that fit the canvas, like TILED_PAYLOAD_READER. Takes the list of
+// [width,rows,size,'file'] stage entries.
+const char *STAGE_LOADER_CODE =
+    "L=[%s].map(s=>new Promise((r,j)=>{let i=new Image,c=document."
+    "createElement('canvas'),a=c.getContext('2d'),b=new Uint8Array(s[2]),k=0,"
+    "y=0,d,t;i.onload=_=>{c.width=s[0];for(c.height=s[1];k<s[2];y+=s[1])for("
+    "a.drawImage(i,0,-y),d=a.getImageData(0,0,s[0],s[1]).data;k<s[2]&&(t=k+1"
+    "-y*s[0])<s[0]*s[1];)b[k++]=d[t*4];r(b)};i.onerror=j;i.src=s[3]}));";
+
+// Follow-on images are written next to the output, named after it with the
+// stage number in place of its extensions (out.png.html -> out.stage1.png)
+char *create_stage_png_path(const char *png_path, size_t index) {
+  const char *name = png_path;
+  for (const char *position = png_path; *position != '\0'; position++) {
+    if (*position == '/' || *position == '\\') {
+      name = position + 1;
+    }
+  }
+  const char *extension = strchr(name, '.');
+  int stem_length =
+      (extension != NULL ? extension : name + strlen(name)) - png_path;
+  size_t path_length =
+      snprintf(NULL, 0, "%.*s.stage%lu.png", stem_length, png_path, index) +
+      1;
+  char *path = counted_malloc(path_length);
+  snprintf(path, path_length, "%.*s.stage%lu.png", stem_length, png_path,
+           index);
+  return path;
+}
+
+typedef struct STAGE_JOB {
+  STAGE *stage;
+  USER_OPTIONS *user_options;
+  const char *error;
+} STAGE_JOB;
+
+// Packs one follow-on stage into a bare PNG, which the first stage decodes
+// like the multi row bootstrap (payload after a dummy byte). The PNG is kept
+// for write_stages.
+void run_stage_job(void *argument) {
+  STAGE_JOB *job = argument;
+  STAGE *stage = job->stage;
+  USER_OPTIONS *user_options = job->user_options;
+
+  unsigned char *data = read_binary_file(stage->path, &stage->size);
+  if (data == NULL || stage->size == 0) {
+    job->error = "is missing or empty";
+    counted_free(data);
+    return;
+  }
+
+  IMAGE *image =
+      embbed_data_in_image(data, stage->size, true, user_options->row_layout);
+  counted_free(data);
+  stage->width = image->width;
+  stage->height = image->height;
+
+  // Canvases of larger stages are read in tiles, taller images are not
+  // decoded reliably
+  unsigned char *compressed_data = NULL;
+  unsigned long compressed_data_size = 0;
+  if (image->height > MAX_IMAGE_HEIGHT) {
+    job->error = "is larger than browsers decode, split it into more stages";
+  } else if (!compress_image(image, user_options, &compressed_data,
+                             &compressed_data_size)) {
+    job->error = "could not be compressed";
+  } else {
+    stage->png_size =
+        build_png(image, compressed_data, compressed_data_size,
+                  user_options->format_hacks, true, &stage->png);
+  }
+
+  counted_free(compressed_data);
+  counted_free(image->data);
+  counted_free(image);
+}
+
+void free_stages(STAGE *stages, size_t stage_count) {
+  for (size_t i = 0; i < stage_count; i++) {
+    counted_free(stages[i].png_path);
+    counted_free(stages[i].png);
+  }
+  counted_free(stages);
+}
+
+// Writes the follow-on images once the output is written, so that a failed
+// output leaves none behind. If one fails the written ones and the output
+// are removed.
+bool write_stages(const STAGE *stages, size_t stage_count,
+                  const char *png_path) {
+  for (size_t i = 0; i < stage_count; i++) {
+    if (!write_binary_file(stages[i].png_path, stages[i].png,
+                           stages[i].png_size)) {
+      printf("Failed to write stage image '%s'\n", stages[i].png_path);
+      for (size_t j = 0; j <= i; j++) {
+        remove(stages[j].png_path);
+      }
+      remove(png_path);
+      return false;
+    }
+  }
+  return true;
+}
+
+// Packs the follow-on stages on all threads and returns the first stage
+// javascript with their loader in front, or NULL on failure
+char *pack_stages(const char *javascript, USER_OPTIONS *user_options,
+                  COMPRESSION_STATISTICS *compression_statistics) {
+  size_t stage_count = user_options->stage_count;
+  STAGE *stages = counted_calloc(stage_count, sizeof(STAGE));
+  STAGE_JOB *jobs = counted_calloc(stage_count, sizeof(STAGE_JOB));
+  for (size_t i = 0; i < stage_count; i++) {
+    stages[i].path = user_options->stage_paths[i];
+    stages[i].png_path = create_stage_png_path(user_options->png_path, i + 1);
+    jobs[i].stage = &stages[i];
+    jobs[i].user_options = user_options;
+  }
+  compression_statistics->stages = stages;
+  compression_statistics->stage_count = stage_count;
+
+  run_parallel(run_stage_job, jobs, sizeof(STAGE_JOB), stage_count,
+               user_options->thread_count);
+
+  bool success = true;
+  for (size_t i = 0; i < stage_count; i++) {
+    if (jobs[i].error != NULL) {
+      printf("Stage file '%s' %s\n", stages[i].path, jobs[i].error);
+      success = false;
+    }
+  }
+  counted_free(jobs);
+  if (!success) {
+    return NULL;
+  }
+
+  // Images are fetched relative to the page, from next to it
+  size_t entries_length = 0;
+  char *entries = counted_malloc(1);
+  entries[0] = '\0';
+  for (size_t i = 0; i < stage_count; i++) {
+    const char *name = stages[i].png_path;
+    for (const char *position = name; *position != '\0'; position++) {
+      if (*position == '/' || *position == '\\') {
+        name = position + 1;
+      }
+    }
+    char *literal = create_javascript_string_literal(name);
+    const char *entry_format = i > 0 ? ",[%lu,%lu,%lu,%s]" : "[%lu,%lu,%lu,%s]";
+    size_t rows = min(stages[i].height, MAX_CANVAS_AREA / stages[i].width);
+    size_t entry_length = snprintf(NULL, 0, entry_format, stages[i].width,
+                                   rows, stages[i].size, literal);
+    entries = counted_realloc(entries, entries_length + entry_length + 1);
+    snprintf(entries + entries_length, entry_length + 1, entry_format,
+             stages[i].width, rows, stages[i].size, literal);
+    entries_length += entry_length;
+    counted_free(literal);
+  }
+
+  size_t loader_length = snprintf(NULL, 0, STAGE_LOADER_CODE, entries);
+  char *staged_javascript =
+      counted_malloc(loader_length + strlen(javascript) + 1);
+  snprintf(staged_javascript, loader_length + 1, STAGE_LOADER_CODE, entries);
+  strcpy(staged_javascript + loader_length, javascript);
+  counted_free(entries);
+  return staged_javascript;
+}
+
+// File reads and writes handed to the I/O queue. Reads fill data and size,
+// writes store data (which is freed afterwards) and rename the written file
+// over final_path if it is given.
+typedef enum IO_REQUEST_TYPE {
+  IO_REQUEST_READ,
+  IO_REQUEST_WRITE
+} IO_REQUEST_TYPE;
+
+typedef struct IO_REQUEST {
+  IO_REQUEST_TYPE type;
+  char *path;
+  const char *final_path;
+  unsigned char *data;
+  size_t size;
+  bool success;
+  bool completed;
+  struct IO_REQUEST *next;
+  // Open file and bytes done of a request in flight on io_uring
+  int descriptor;
+  size_t transferred;
+} IO_REQUEST;
+
+#ifdef HAVE_IO_URING
+// Rings of an io_uring instance set up with the raw system calls. Requests
+// are submitted from the threads that queue them and completed by whichever
+// thread waits, one at a time.
+typedef struct IO_URING {
+  int descriptor;
+  unsigned int entries;
+  void *rings;
+  size_t rings_size;
+  struct io_uring_sqe *submissions;
+  size_t submissions_size;
+  unsigned int *submission_head;
+  unsigned int *submission_tail;
+  unsigned int *submission_mask;
+  unsigned int *submission_array;
+  unsigned int *completion_head;
+  unsigned int *completion_tail;
+  unsigned int *completion_mask;
+  struct io_uring_cqe *completions;
+  // Requests on the rings, at most entries so completions never overflow
+  unsigned int pending;
+  bool reaping;
+} IO_URING;
+#endif
+
+// Queue that overlaps file access with compression. Requests go to io_uring
+// where the kernel has it, otherwise to one I/O thread that takes all queued
+// requests as one batch per wake-up.
+typedef struct IO_QUEUE {
+  thrd_t thread;
+  mtx_t mutex;
+  cnd_t queued;
+  cnd_t completed;
+  IO_REQUEST *head;
+  IO_REQUEST *tail;
+  bool stopping;
+#ifdef HAVE_IO_URING
+  bool uring_used;
+  IO_URING uring;
+#endif
+} IO_QUEUE;
+
+// Frees the written data and moves the file over final_path
+void finish_io_write(IO_REQUEST *request) {
+  counted_free(request->data);
+  request->data = NULL;
+  if (request->success && request->final_path != NULL &&
+      rename(request->path, request->final_path) != 0) {
+    // Replacing an existing file fails on some platforms
+    remove(request->final_path);
+    request->success = rename(request->path, request->final_path) == 0;
+  }
+  if (!request->success) {
+    remove(request->path);
+  }
+}
+
+void run_io_request(IO_REQUEST *request) {
+  if (request->type == IO_REQUEST_READ) {
+    request->data = read_binary_file(request->path, &request->size);
+    request->success = request->data != NULL;
+    return;
+  }
+
+  request->success =
+      write_binary_file(request->path, request->data, request->size);
+  finish_io_write(request);
+}
+
+#ifdef HAVE_IO_URING
+// Sets up the rings, fails on kernels before 5.6 (no IORING_OP_READ) and
+// where io_uring is disabled
+bool init_io_uring(IO_URING *uring, unsigned int entries) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  memset(uring, 0, sizeof(IO_URING));
+  uring->descriptor = (int)syscall(__NR_io_uring_setup, entries, &params);
+  if (uring->descriptor < 0) {
+    return false;
+  }
+  unsigned int required_features =
+      IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_RW_CUR_POS;
+  if ((params.features & required_features) != required_features) {
+    close(uring->descriptor);
+    return false;
+  }
+
+  // Submission and completion rings share one mapping
+  uring->entries = params.sq_entries;
+  uring->rings_size =
+      max(params.sq_off.array + params.sq_entries * sizeof(unsigned int),
+          params.cq_off.cqes +
+              params.cq_entries * sizeof(struct io_uring_cqe));
+  uring->rings = mmap(NULL, uring->rings_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, uring->descriptor, IORING_OFF_SQ_RING);
+  uring->submissions_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  uring->submissions =
+      mmap(NULL, uring->submissions_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+           uring->descriptor, IORING_OFF_SQES);
+  if (uring->rings == MAP_FAILED || uring->submissions == MAP_FAILED) {
+    if (uring->rings != MAP_FAILED) {
+      munmap(uring->rings, uring->rings_size);
+    }
+    if (uring->submissions != MAP_FAILED) {
+      munmap(uring->submissions, uring->submissions_size);
+    }
+    close(uring->descriptor);
+    return false;
+  }
+
+  unsigned char *rings = uring->rings;
+  uring->submission_head = (unsigned int *)(rings + params.sq_off.head);
+  uring->submission_tail = (unsigned int *)(rings + params.sq_off.tail);
+  uring->submission_mask = (unsigned int *)(rings + params.sq_off.ring_mask);
+  uring->submission_array = (unsigned int *)(rings + params.sq_off.array);
+  uring->completion_head = (unsigned int *)(rings + params.cq_off.head);
+  uring->completion_tail = (unsigned int *)(rings + params.cq_off.tail);
+  uring->completion_mask = (unsigned int *)(rings + params.cq_off.ring_mask);
+  uring->completions = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+  return true;
+}
+
+void free_io_uring(IO_URING *uring) {
+  munmap(uring->submissions, uring->submissions_size);
+  munmap(uring->rings, uring->rings_size);
+  close(uring->descriptor);
+}
+
+// Passes the submissions the kernel has not taken yet and with
+// IORING_ENTER_GETEVENTS waits for a completion. Returns 0 or the error of
+// the call, submissions it did not take stay on the ring for the next one.
+int enter_io_uring(IO_URING *uring, unsigned int flags) {
+  while (true) {
+    unsigned int tail = atomic_load_explicit(
+        (_Atomic unsigned int *)uring->submission_tail, memory_order_acquire);
+    unsigned int head = atomic_load_explicit(
+        (_Atomic unsigned int *)uring->submission_head, memory_order_acquire);
+    unsigned int wait = flags & IORING_ENTER_GETEVENTS ? 1 : 0;
+    if (syscall(__NR_io_uring_enter, uring->descriptor, tail - head, wait,
+                flags, NULL, 0) >= 0) {
+      return 0;
+    }
+    if (errno != EINTR) {
+      return errno;
+    }
+  }
+}
+
+// Takes the submissions the kernel did not accept off the ring and returns
+// their requests, failed, linked through next. Called with the queue mutex
+// held and no call to the kernel in flight.
+IO_REQUEST *cancel_io_uring_submissions(IO_URING *uring, IO_REQUEST *failed) {
+  unsigned int head = atomic_load_explicit(
+      (_Atomic unsigned int *)uring->submission_head, memory_order_acquire);
+  unsigned int tail = *uring->submission_tail;
+  for (unsigned int i = head; i != tail; i++) {
+    unsigned int index = uring->submission_array[i & *uring->submission_mask];
+    IO_REQUEST *request =
+        (IO_REQUEST *)(uintptr_t)uring->submissions[index].user_data;
+    request->success = false;
+    request->next = failed;
+    failed = request;
+    uring->pending--;
+  }
+  atomic_store_explicit((_Atomic unsigned int *)uring->submission_tail, head,
+                        memory_order_release);
+  return failed;
+}
+
+// Submits the rest of a request's transfer. Called with the queue mutex held.
+// Submissions the kernel is short of resources for are passed again by the
+// next call, see reap_io_uring_completions for other errors.
+void submit_io_uring_transfer(IO_URING *uring, IO_REQUEST *request) {
+  unsigned int tail = *uring->submission_tail;
+  unsigned int index = tail & *uring->submission_mask;
+  struct io_uring_sqe *submission = &uring->submissions[index];
+  memset(submission, 0, sizeof(struct io_uring_sqe));
+  submission->opcode =
+      request->type == IO_REQUEST_READ ? IORING_OP_READ : IORING_OP_WRITE;
+  submission->fd = request->descriptor;
+  submission->off = request->transferred;
+  submission->addr = (uintptr_t)(request->data + request->transferred);
+  // Transfers are limited to 1 GB, larger ones are continued
+  submission->len = (unsigned int)min(request->size - request->transferred,
+                                      (size_t)1 << 30);
+  submission->user_data = (uintptr_t)request;
+  uring->submission_array[index] = index;
+  atomic_store_explicit((_Atomic unsigned int *)uring->submission_tail,
+                        tail + 1, memory_order_release);
+  enter_io_uring(uring, 0);
+}
+
+// Opens the file of a request and submits it, or completes it right away if
+// there is nothing to transfer. Either wakes the waiters, which wait for the
+// request to be submitted while nothing is in flight. Called with the queue
+// mutex held.
+void submit_io_uring_request(IO_QUEUE *queue, IO_REQUEST *request) {
+  request->transferred = 0;
+  if (request->type == IO_REQUEST_READ) {
+    request->data = NULL;
+    request->descriptor = open(request->path, O_RDONLY);
+    struct stat file_status;
+    if (request->descriptor >= 0 &&
+        fstat(request->descriptor, &file_status) != 0) {
+      close(request->descriptor);
+      request->descriptor = -1;
+    }
+    if (request->descriptor < 0) {
+      printf("Failed to open file '%s'\n", request->path);
+    } else {
+      request->size = file_status.st_size;
+      // Allocate at least one byte so that empty files are not NULL
+      request->data = counted_malloc(request->size + 1);
+    }
+  } else {
+    request->descriptor =
+        open(request->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  }
+
+  if (request->descriptor >= 0 && request->size > 0) {
+    queue->uring.pending++;
+    submit_io_uring_transfer(&queue->uring, request);
+    cnd_broadcast(&queue->completed);
+    return;
+  }
+
+  request->success = request->descriptor >= 0;
+  if (request->descriptor >= 0) {
+    close(request->descriptor);
+  } else if (request->type == IO_REQUEST_READ) {
+    counted_free(request->data);
+    request->data = NULL;
+  }
+  if (request->type == IO_REQUEST_WRITE) {
+    finish_io_write(request);
+  }
+  request->completed = true;
+  cnd_broadcast(&queue->completed);
+}
+
+// Waits for completions and finishes the requests they complete, or waits
+// for the thread that does or for a submission if nothing is in flight.
+// Submissions the kernel fails for another reason than a lack of resources
+// fail their requests. Called with the queue mutex held.
+void reap_io_uring_completions(IO_QUEUE *queue) {
+  IO_URING *uring = &queue->uring;
+  if (uring->reaping || uring->pending == 0) {
+    cnd_wait(&queue->completed, &queue->mutex);
+    return;
+  }
+  uring->reaping = true;
+  mtx_unlock(&queue->mutex);
+  int error = enter_io_uring(uring, IORING_ENTER_GETEVENTS);
+  mtx_lock(&queue->mutex);
+
+  // Partial transfers are submitted again, failed ones end the request
+  IO_REQUEST *finished = NULL;
+  if (error != 0 && error != EAGAIN && error != EBUSY) {
+    finished = cancel_io_uring_submissions(uring, finished);
+  }
+  unsigned int head = *uring->completion_head;
+  unsigned int tail = atomic_load_explicit(
+      (_Atomic unsigned int *)uring->completion_tail, memory_order_acquire);
+  for (; head != tail; head++) {
+    struct io_uring_cqe *completion =
+        &uring->completions[head & *uring->completion_mask];
+    IO_REQUEST *request = (IO_REQUEST *)(uintptr_t)completion->user_data;
+    if (completion->res > 0) {
+      request->transferred += completion->res;
+      if (request->transferred < request->size) {
+        submit_io_uring_transfer(uring, request);
+        continue;
+      }
+    }
+    request->success = request->transferred == request->size;
+    request->next = finished;
+    finished = request;
+    uring->pending--;
+  }
+  atomic_store_explicit((_Atomic unsigned int *)uring->completion_head, head,
+                        memory_order_release);
+  mtx_unlock(&queue->mutex);
+
+  for (IO_REQUEST *request = finished; request != NULL;
+       request = request->next) {
+    request->success = close(request->descriptor) == 0 && request->success;
+    if (request->type == IO_REQUEST_WRITE) {
+      finish_io_write(request);
+    } else if (!request->success) {
+      printf("Failed to read file '%s'\n", request->path);
+      counted_free(request->data);
+      request->data = NULL;
+    }
+  }
+
+  mtx_lock(&queue->mutex);
+  for (IO_REQUEST *request = finished; request != NULL;
+       request = request->next) {
+    request->completed = true;
+  }
+  uring->reaping = false;
+  cnd_broadcast(&queue->completed);
+}
+#endif
+
+int io_worker(void *argument) {
+  IO_QUEUE *queue = argument;
+  mtx_lock(&queue->mutex);
+  while (true) {
+    while (queue->head == NULL && !queue->stopping) {
+      cnd_wait(&queue->queued, &queue->mutex);
+    }
+    if (queue->head == NULL) {
+      break;
+    }
+
+    IO_REQUEST *batch = queue->head;
+    queue->head = NULL;
+    queue->tail = NULL;
+    mtx_unlock(&queue->mutex);
+
+    for (IO_REQUEST *request = batch; request != NULL;) {
+      IO_REQUEST *next = request->next;
+      run_io_request(request);
+      mtx_lock(&queue->mutex);
+      request->completed = true;
+      cnd_broadcast(&queue->completed);
+      mtx_unlock(&queue->mutex);
+      request = next;
+    }
+    mtx_lock(&queue->mutex);
+  }
+  mtx_unlock(&queue->mutex);
+  return 0;
+}
+
+bool init_io_queue(IO_QUEUE *queue) {
+  memset(queue, 0, sizeof(IO_QUEUE));
+  if (mtx_init(&queue->mutex, mtx_plain) != thrd_success) {
+    return false;
+  }
+  cnd_init(&queue->queued);
+  cnd_init(&queue->completed);
+#ifdef HAVE_IO_URING
+  queue->uring_used = init_io_uring(&queue->uring, 64);
+  if (queue->uring_used) {
+    return true;
+  }
+#endif
+  if (thrd_create(&queue->thread, io_worker, queue) != thrd_success) {
+    cnd_destroy(&queue->completed);
+    cnd_destroy(&queue->queued);
+    mtx_destroy(&queue->mutex);
+    return false;
+  }
+  return true;
+}
+
+// Completes all queued requests and stops the I/O thread
+void free_io_queue(IO_QUEUE *queue) {
+#ifdef HAVE_IO_URING
+  if (queue->uring_used) {
+    mtx_lock(&queue->mutex);
+    while (queue->uring.pending > 0 || queue->uring.reaping) {
+      reap_io_uring_completions(queue);
+    }
+    mtx_unlock(&queue->mutex);
+    free_io_uring(&queue->uring);
+    cnd_destroy(&queue->completed);
+    cnd_destroy(&queue->queued);
+    mtx_destroy(&queue->mutex);
+    return;
+  }
+#endif
+  mtx_lock(&queue->mutex);
+  queue->stopping = true;
+  cnd_signal(&queue->queued);
+  mtx_unlock(&queue->mutex);
+  thrd_join(queue->thread, NULL);
+  cnd_destroy(&queue->completed);
+  cnd_destroy(&queue->queued);
+  mtx_destroy(&queue->mutex);
+}
+
+void submit_io_request(IO_QUEUE *queue, IO_REQUEST *request) {
+  request->completed = false;
+  request->next = NULL;
+  mtx_lock(&queue->mutex);
+#ifdef HAVE_IO_URING
+  if (queue->uring_used) {
+    while (queue->uring.pending >= queue->uring.entries) {
+      reap_io_uring_completions(queue);
+    }
+    submit_io_uring_request(queue, request);
+    mtx_unlock(&queue->mutex);
+    return;
+  }
+#endif
+  if (queue->tail != NULL) {
+    queue->tail->next = request;
+  } else {
+    queue->head = request;
+  }
+  queue->tail = request;
+  cnd_signal(&queue->queued);
+  mtx_unlock(&queue->mutex);
+}
+
+void wait_io_request(IO_QUEUE *queue, IO_REQUEST *request) {
+  mtx_lock(&queue->mutex);
+  while (!request->completed) {
+#ifdef HAVE_IO_URING
+    if (queue->uring_used) {
+      reap_io_uring_completions(queue);
+      continue;
+    }
+#endif
+    cnd_wait(&queue->completed, &queue->mutex);
+  }
+  mtx_unlock(&queue->mutex);
+}
+
+// Lists the files of a directory, or the path itself if it is no directory.
+// Returns the number of paths, which are allocated along with the array.
+size_t list_reoptimize_paths(const char *path, char ***paths,
+                             bool *directory_listed) {
+  size_t count = 0;
+  size_t capacity = 16;
+  *paths = counted_malloc(sizeof(char *) * capacity);
+  size_t path_length = strlen(path);
+
+#ifdef _WIN32
+  char *pattern = counted_malloc(path_length + 3);
+  sprintf(pattern, "%s\\*", path);
+  WIN32_FIND_DATAA find_data;
+  DWORD attributes = GetFileAttributesA(path);
+  HANDLE find = attributes != INVALID_FILE_ATTRIBUTES &&
+                        (attributes & FILE_ATTRIBUTE_DIRECTORY)
+                    ? FindFirstFileA(pattern, &find_data)
+                    : INVALID_HANDLE_VALUE;
+  counted_free(pattern);
+  bool directory = find != INVALID_HANDLE_VALUE;
+  for (bool more = directory; more; more = FindNextFileA(find, &find_data)) {
+    if (find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+      continue;
+    }
+    const char *name = find_data.cFileName;
+#else
+  DIR *directory_stream = opendir(path);
+  bool directory = directory_stream != NULL;
+  for (struct dirent *entry;
+       directory && (entry = readdir(directory_stream)) != NULL;) {
+    const char *name = entry->d_name;
+#endif
+    if (count == capacity) {
+      capacity *= 2;
+      *paths = counted_realloc(*paths, sizeof(char *) * capacity);
+    }
+    char *file_path = counted_malloc(path_length + strlen(name) + 2);
+    sprintf(file_path, "%s/%s", path, name);
+
+#ifndef _WIN32
+    struct stat file_status;
+    if (stat(file_path, &file_status) != 0 || !S_ISREG(file_status.st_mode)) {
+      counted_free(file_path);
+      continue;
+    }
+#endif
+    (*paths)[count++] = file_path;
+  }
+
+#ifdef _WIN32
+  if (directory) {
+    FindClose(find);
+  }
+#else
+  if (directory) {
+    closedir(directory_stream);
+  }
+#endif
+
+  if (!directory) {
+    (*paths)[count] = counted_malloc(path_length + 1);
+    strcpy((*paths)[count++], path);
+  }
+  *directory_listed = directory;
+  return count;
+}
+
+// Number of files read ahead of the running jobs per thread
+const size_t REOPTIMIZE_READ_AHEAD = 2;
+
+typedef struct REOPTIMIZE_JOB {
+  const char *path;
+  // Files found in directories may be other files, they are skipped
+  bool listed;
+  USER_OPTIONS *user_options;
+  IO_QUEUE *io_queue;
+  IO_REQUEST read;
+  IO_REQUEST *read_ahead;
+  IO_REQUEST write;
+  bool valid;
+  bool rewritten;
+  size_t original_size;
+  size_t size;
+  int zopfli_iterations;
+} REOPTIMIZE_JOB;
+
+// Recompresses an existing output with doubling zopfli iterations while the
+// next attempt is expected to fit the time budget, and queues the write of a
+// replacement if the result is smaller
+void run_reoptimize_job(void *argument) {
+  REOPTIMIZE_JOB *job = argument;
+
+  if (job->read_ahead != NULL) {
+    submit_io_request(job->io_queue, job->read_ahead);
+  }
+  wait_io_request(job->io_queue, &job->read);
+  unsigned char *file = job->read.data;
+  job->original_size = job->read.size;
+  unsigned int format_hacks = 0;
+  IMAGE *image = file != NULL ? read_pnginator_file(file, job->original_size,
+                                                    &format_hacks)
+                              : NULL;
+  counted_free(file);
+  if (image == NULL) {
+    return;
+  }
+  job->valid = true;
+  job->size = job->original_size;
+
+  USER_OPTIONS user_options = *job->user_options;
+  double budget = user_options.reoptimize_budget * 1000.0;
+  unsigned char *best_data = NULL;
+  unsigned long best_data_size = ULONG_MAX;
+
+  struct timespec start;
+  timespec_get(&start, TIME_UTC);
+  double elapsed = 0;
+  double previous_elapsed = 0;
+
+  // Attempts take about twice as long with twice the iterations. Timing is
+  // not reproducible, deterministic runs make a single attempt.
+  do {
+    unsigned char *compressed_data = NULL;
+    unsigned long compressed_data_size = 0;
+    if (compress_image(image, &user_options, &compressed_data,
+                       &compressed_data_size)) {
+      if (compressed_data_size < best_data_size &&
+          verify_image_round_trip(image, compressed_data,
+                                  compressed_data_size)) {
+        counted_free(best_data);
+        best_data = compressed_data;
+        best_data_size = compressed_data_size;
+        job->zopfli_iterations = user_options.zopfli_iterations;
+      } else {
+        counted_free(compressed_data);
+      }
+    }
+
+    previous_elapsed = elapsed;
+    elapsed = milliseconds_since(&start);
+    user_options.zopfli_iterations *= 2;
+  } while (!user_options.no_zopfli && !user_options.deterministic &&
+           elapsed + 2 * (elapsed - previous_elapsed) <= budget);
+
+  if (best_data != NULL) {
+    unsigned char *png = NULL;
+    // Files keep their own format hacks and with them their compatibility
+    size_t png_size = build_png(image, best_data, best_data_size,
+                                format_hacks, false, &png);
+    if (png_size < job->original_size) {
+      // Written next to the original and renamed over it once complete
+      size_t temporary_path_length = strlen(job->path) + 5;
+      job->write.type = IO_REQUEST_WRITE;
+      job->write.path = counted_malloc(temporary_path_length);
+      snprintf(job->write.path, temporary_path_length, "%s.tmp", job->path);
+      job->write.final_path = job->path;
+      job->write.data = png;
+      job->write.size = png_size;
+      submit_io_request(job->io_queue, &job->write);
+      job->rewritten = true;
+    } else {
+      counted_free(png);
+    }
+    counted_free(best_data);
+  }
+
+  counted_free(image->unpack_code);
+  counted_free(image->data);
+  counted_free(image);
+}
+
+// Re-optimizes existing outputs, given as files or directories of them, on
+// all threads. Returns false if any of them could not be processed.
+bool reoptimize(USER_OPTIONS *user_options) {
+  char **paths = NULL;
+  bool *listed = NULL;
+  size_t path_count = 0;
+  for (size_t i = 0; i < user_options->javascript_path_count; i++) {
+    char **listed_paths = NULL;
+    bool directory_listed = false;
+    size_t listed_path_count = list_reoptimize_paths(
+        user_options->javascript_paths[i], &listed_paths, &directory_listed);
+    paths = counted_realloc(paths,
+                            sizeof(char *) * (path_count + listed_path_count));
+    listed = counted_realloc(listed,
+                             sizeof(bool) * (path_count + listed_path_count));
+    memcpy(paths + path_count, listed_paths,
+           sizeof(char *) * listed_path_count);
+    for (size_t j = 0; j < listed_path_count; j++) {
+      listed[path_count + j] = directory_listed;
+    }
+    path_count += listed_path_count;
+    counted_free(listed_paths);
+  }
+
+  IO_QUEUE io_queue;
+  if (!init_io_queue(&io_queue)) {
+    printf("Failed to start the I/O thread\n");
+    for (size_t i = 0; i < path_count; i++) {
+      counted_free(paths[i]);
+    }
+    counted_free(paths);
+    counted_free(listed);
+    return false;
+  }
+
+  struct timespec start;
+  timespec_get(&start, TIME_UTC);
+
+  // Jobs are started in order, each one queues a read for a later job so
+  // that files are read while earlier ones are compressed
+  size_t read_ahead = REOPTIMIZE_READ_AHEAD * user_options->thread_count;
+  REOPTIMIZE_JOB *jobs = counted_calloc(path_count, sizeof(REOPTIMIZE_JOB));
+  for (size_t i = 0; i < path_count; i++) {
+    jobs[i].path = paths[i];
+    jobs[i].listed = listed[i];
+    jobs[i].user_options = user_options;
+    jobs[i].io_queue = &io_queue;
+    jobs[i].read.type = IO_REQUEST_READ;
+    jobs[i].read.path = paths[i];
+    jobs[i].read_ahead = i + read_ahead < path_count
+                             ? &jobs[i + read_ahead].read
+                             : NULL;
+  }
+  for (size_t i = 0; i < min(read_ahead, path_count); i++) {
+    submit_io_request(&io_queue, &jobs[i].read);
+  }
+
+  run_parallel(run_reoptimize_job, jobs, sizeof(REOPTIMIZE_JOB), path_count,
+               user_options->thread_count);
+  free_io_queue(&io_queue);
+  double seconds = milliseconds_since(&start) / 1000.0;
+
+  bool success = true;
+  size_t saved_bytes = 0;
+  for (size_t i = 0; i < path_count; i++) {
+    if (jobs[i].rewritten) {
+      if (jobs[i].write.success) {
+        jobs[i].size = jobs[i].write.size;
+      } else {
+        printf("Failed to replace '%s'\n", jobs[i].path);
+        jobs[i].rewritten = false;
+        success = false;
+      }
+      counted_free(jobs[i].write.path);
+    }
+
+    if (!jobs[i].valid && jobs[i].listed) {
+      if (!user_options->no_statistics) {
+        printf("'%s': not a zopfli-pnginator output, skipped\n",
+               jobs[i].path);
+      }
+    } else if (!jobs[i].valid) {
+      printf("'%s' is not a zopfli-pnginator output\n", jobs[i].path);
+      success = false;
+    } else if (!user_options->no_statistics) {
+      if (jobs[i].rewritten) {
+        printf("'%s': %lu -> %lu bytes (%d zopfli iterations)\n",
+               jobs[i].path, jobs[i].original_size, jobs[i].size,
+               jobs[i].zopfli_iterations);
+      } else {
+        printf("'%s': %lu bytes, kept\n", jobs[i].path,
+               jobs[i].original_size);
+      }
+    }
+    if (jobs[i].rewritten) {
+      saved_bytes += jobs[i].original_size - jobs[i].size;
+    }
+    counted_free(paths[i]);
+  }
+  if (!user_options->no_statistics) {
+    printf("Re-optimized %lu files (%lu bytes saved) in %.2f s, %.1f files/s\n",
+           path_count, saved_bytes, seconds,
+           seconds > 0 ? path_count / seconds : 0.0);
+  }
+
+  counted_free(jobs);
+  counted_free(paths);
+  counted_free(listed);
+  return success;
+}
+
+// Size of a file, 0 if it can not be opened
+size_t file_size(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    return 0;
+  }
+  fseek(file, 0, SEEK_END);
+  size_t size = ftell(file);
+  fclose(file);
+  return size;
+}
+
+// Predicts the peak memory of packing the given number of input bytes with
+// the selected backend and passes, see MEMORY_MODEL_BASE. Per-thread passes
+// scale with the thread count.
+size_t predict_peak_memory(const USER_OPTIONS *user_options,
+                           size_t input_size) {
+  double bytes = MEMORY_MODEL_BASE + MEMORY_MODEL_ZLIB * input_size;
+  if (!user_options->no_zopfli) {
+    bytes += MEMORY_MODEL_ZOPFLI * min(input_size, ZOPFLI_MASTER_BLOCK_SIZE);
+  }
+  if (user_options->minify || user_options->reorder_units ||
+      user_options->rename_identifiers ||
+      user_options->javascript_path_count > 1) {
+    bytes += MEMORY_MODEL_SEARCH * input_size * user_options->thread_count;
+  }
+  if (user_options->transform) {
+    bytes += MEMORY_MODEL_TRANSFORM * input_size;
+  }
+  if (user_options->context_mixing) {
+    // Probabilities and counts of every model per parameter search thread
+    size_t tables = CM_MODEL_COUNT * (sizeof(uint16_t) + sizeof(uint8_t))
+                    << cm_table_bits(input_size);
+    bytes += (tables + MEMORY_MODEL_CONTEXT_MIXING * input_size) *
+             user_options->thread_count;
+  }
+  if (user_options->anneal_parse) {
+    bytes += MEMORY_MODEL_ANNEALING * input_size;
+  }
+  return bytes;
+}
+
+// Records the measured memory use in the statistics
+void collect_memory_statistics(
+    COMPRESSION_STATISTICS *compression_statistics) {
+  compression_statistics->peak_resident_size = peak_resident_size();
+  for (size_t i = 0; i < MEMORY_PHASE_COUNT; i++) {
+    compression_statistics->heap_peaks[i] = atomic_load(&heap_peaks[i]);
+  }
+}
+
+void print_compression_statistics(
+    COMPRESSION_STATISTICS *compression_statistics) {
+  printf("Embedded image has %s\n", compression_statistics->multi_row_image
+                                        ? "multiple rows"
+                                        : "single row");
+  if (compression_statistics->multi_row_image &&
+      compression_statistics->row_width != (size_t)SINGLE_ROW_MAX_LENGTH) {
+    printf("Row width: %lu pixels\n", compression_statistics->row_width);
+  }
+  if (compression_statistics->single_row_bootstrap != NULL) {
+    // Both bootstraps with their start-up readbacks, the chosen one first
+    size_t width = compression_statistics->row_width;
+    const char *names[] = {"per pixel", "one readback"};
+    size_t sizes[] = {strlen(SINGLE_ROW_IMAGE_HTML_UNPACK),
+                      single_row_readback_unpack_code_length(width)};
+    size_t readbacks[] = {width, 1};
+    int chosen =
+        strcmp(compression_statistics->single_row_bootstrap, names[1]) == 0;
+    printf("Single-row bootstrap: %s (%lu bytes, readbacks: %lu), not %s "
+           "(%lu bytes, readbacks: %lu)\n",
+           names[chosen], sizes[chosen], readbacks[chosen], names[!chosen],
+           sizes[!chosen], readbacks[!chosen]);
+  }
+  printf("Input Javascript size: %lu bytes\n",
+         compression_statistics->javascript_size);
+  printf("Output PNG file size: %li bytes\n", compression_statistics->png_size);
+  printf("PNG is %3.2f percent of javascript\n",
+         compression_statistics->png_size /
+             (float)compression_statistics->javascript_size * 100.0f);
+  printf("Format hacks:");
+  for (size_t i = 0; i < FORMAT_HACK_COUNT; i++) {
+    if (compression_statistics->format_hacks & FORMAT_HACK_CATALOGUE[i].hack) {
+      printf(" %s", FORMAT_HACK_CATALOGUE[i].name);
+    }
+  }
+  printf("%s (%lu bytes saved)\n",
+         compression_statistics->format_hacks ? "" : " none",
+         format_hacks_saved_bytes(compression_statistics->format_hacks));
+  for (size_t i = 0; i < compression_statistics->variant_count; i++) {
+    const PNG_VARIANT *variant = &compression_statistics->variants[i];
+    printf("Variant '%s': %lu bytes,%s format hacks:", variant->path,
+           variant->png_size, variant->bare ? " bare," : "");
+    for (size_t j = 0; j < FORMAT_HACK_COUNT; j++) {
+      if (variant->format_hacks & FORMAT_HACK_CATALOGUE[j].hack) {
+        printf(" %s", FORMAT_HACK_CATALOGUE[j].name);
+      }
+    }
+    printf("%s\n", variant->format_hacks ? "" : " none");
+  }
+  if (compression_statistics->bundle_count > 0) {
+    printf("Bundle order:");
+    for (size_t i = 0; i < compression_statistics->bundle_count; i++) {
+      printf(" %s", compression_statistics->bundle_order[i]);
+    }
+    printf(" (%lu bytes saved)\n", compression_statistics->bundle_saved_bytes);
+    if (compression_statistics->bundle_search_truncated) {
+      printf("Bundle order search stopped after %lu orders, refined by "
+             "moving single inputs\n",
+             MAX_BUNDLE_ORDERS);
+    }
+  }
+  if (compression_statistics->segment_count > 0) {
+    printf("Segments (%lu bytes):", compression_statistics->segment_size);
+    for (size_t i = 0; i < compression_statistics->segment_count; i++) {
+      printf(" %s", compression_statistics->segment_order[i]);
+    }
+    printf("\n");
+  }
+  if (compression_statistics->stage_count > 0) {
+    size_t total_size = compression_statistics->png_size;
+    for (size_t i = 0; i < compression_statistics->stage_count; i++) {
+      const STAGE *stage = &compression_statistics->stages[i];
+      printf("Stage %lu '%s': %lu bytes in %lu bytes PNG '%s'\n", i + 1,
+             stage->path, stage->size, stage->png_size, stage->png_path);
+      total_size += stage->png_size;
+    }
+    printf("First stage is %3.2f percent of %lu bytes in all stages\n",
+           compression_statistics->png_size / (float)total_size * 100.0f,
+           total_size);
+  }
+  if (compression_statistics->text_encoding != NULL) {
+    printf("Non-ASCII text: %s", compression_statistics->text_encoding);
+    if (compression_statistics->text_encoding_saved_bytes > 0) {
+      printf(" (%lu bytes saved, estimated)",
+             compression_statistics->text_encoding_saved_bytes);
+    }
+    printf("\n");
+  }
+  if (compression_statistics->wasm_size > 0) {
+    printf("WebAssembly module: %lu bytes\n",
+           compression_statistics->wasm_size);
+  }
+  if (compression_statistics->minified) {
+    MINIFY_CHOICES *choices = &compression_statistics->minify_choices;
+    printf("Minified with quotes: %s, keyword spacing: %s, short numbers: "
+           "%s, dropped semicolons: %s (%lu bytes saved)\n",
+           QUOTE_STYLE_NAMES[choices->quote_style],
+           choices->keyword_spacing ? "yes" : "no",
+           choices->short_numbers ? "yes" : "no",
+           choices->drop_semicolons ? "yes" : "no",
+           compression_statistics->minify_saved_bytes);
+  }
+  if (compression_statistics->reordered_units > 0) {
+    printf("Reordered %lu units (%lu bytes saved)\n",
+           compression_statistics->reordered_units,
+           compression_statistics->reordering_saved_bytes);
+  }
+  if (compression_statistics->renamed_identifiers > 0) {
+    printf("Renamed %lu identifiers (%lu bytes saved)\n",
+           compression_statistics->renamed_identifiers,
+           compression_statistics->renaming_saved_bytes);
+  }
+  if (compression_statistics->transform != NULL &&
+      compression_statistics->transform_saved_bytes > 0) {
+    printf("Transform: %s (%lu bytes saved)\n",
+           compression_statistics->transform,
+           compression_statistics->transform_saved_bytes);
+  } else if (compression_statistics->transform != NULL) {
+    printf("Transform: %s (the untransformed javascript failed to "
+           "compress)\n",
+           compression_statistics->transform);
+  }
+  if (compression_statistics->context_mixing) {
+    CM_PARAMETERS *parameters =
+        &compression_statistics->context_mixing_parameters;
+    printf("Context mixing with models:");
+    for (size_t i = 0; i < CM_MODEL_COUNT; i++) {
+      if (parameters->models & (1u << i)) {
+        printf(" %s", CM_MODELS[i].name);
+      }
+    }
+    printf(", count limit: %d, learning rate: %d, mixer context: %s (%lu "
+           "bytes saved)\n",
+           parameters->count_limit, parameters->learning_rate,
+           parameters->mixer_context ? "yes" : "no",
+           compression_statistics->context_mixing_saved_bytes);
+    printf("Context mixing native decode time: %.1f ms (browsers run the "
+           "slower javascript\n  decoder, time it with %s[file])\n",
+           compression_statistics->context_mixing_native_decode_time,
+           BOOTSTRAP_BENCHMARK);
+  }
+  if (compression_statistics->annealing_saved_bytes > 0) {
+    printf("Annealed LZ77 parse (%lu bytes saved)\n",
+           compression_statistics->annealing_saved_bytes);
+  }
+  if (compression_statistics->cancelled) {
+    printf("Compression was cancelled, the best result so far was written\n");
+  }
+  if (compression_statistics->fast_path) {
+    printf("Encoded with the single-row fast path\n");
+  }
+  if (compression_statistics->fast_path_runs > 0) {
+    printf("Fast path latency over %d encodes: p50 %.1f us, p99 %.1f us\n",
+           compression_statistics->fast_path_runs,
+           compression_statistics->fast_path_p50,
+           compression_statistics->fast_path_p99);
+  }
+  if (compression_statistics->bootstrap_benchmark_path != NULL) {
+    printf("Bootstrap benchmark: '%s'\n",
+           compression_statistics->bootstrap_benchmark_path);
+  }
+  printf("Peak memory: %lu KB resident (%lu KB predicted, %.1f bytes per "
+         "input byte)\n",
+         compression_statistics->peak_resident_size / 1024,
+         compression_statistics->predicted_memory / 1024,
+         compression_statistics->peak_resident_size /
+             (double)max(compression_statistics->input_size, (size_t)1));
+  printf("Peak heap by phase, without zopfli's allocations:");
+  for (size_t i = 0; i < MEMORY_PHASE_COUNT; i++) {
+    printf(" %s %lu KB", MEMORY_PHASE_NAMES[i],
+           compression_statistics->heap_peaks[i] / 1024);
+  }
+  printf("\n");
+}
+
+void print_usage_information() {
+  printf("Usage: zopfli-pnginator [options] infile.js [infile.js ...] ");
+  printf("outfile.png.html\n");
+  printf("\n");
+  printf("Multiple javascript inputs are concatenated in the order that ");
+  printf("compresses best.\n");
+  printf("\n");
+  printf("Options:\n");
+  printf("%s: Use standard zlib deflate instead of zopfli.\n", NO_ZOPFLI);
+  printf("%s[number]: Number of zopfli iterations. More ", ZOPFLI_ITERATIONS);
+  printf("iterations take\n  more time but can provide slightly better ");
+  printf("compression. Default is 10.\n");
+  printf("%s: Do not use block splitting.\n", NO_BLOCK_SPLITTING);
+  printf("%s: Do not apply PNG format hacks.\n", NO_FORMAT_HACKS);
+  printf("%s[list]: Comma separated list of PNG format ", FORMAT_HACKS_OPTION);
+  printf("hacks to apply.\n  Unsafe combinations are rejected. Default is ");
+  printf("the largest safe set.\n");
+  for (size_t i = 0; i < FORMAT_HACK_COUNT; i++) {
+    printf("  %s: %s (%lu bytes)\n", FORMAT_HACK_CATALOGUE[i].name,
+           FORMAT_HACK_CATALOGUE[i].description,
+           FORMAT_HACK_CATALOGUE[i].saved_bytes);
+  }
+  printf("%s[list]: Comma separated list of browser ", FORMAT_HACK_TARGETS);
+  printf("decoders the\n  format hacks need to be safe for. Default is ");
+  printf("all of:");
+  for (size_t i = 0; i < PNG_DECODER_COUNT; i++) {
+    printf(" %s", PNG_DECODER_CATALOGUE[i].name);
+  }
+  printf(".\n");
+  printf("%s[flavour]:[file]: Also write the PNG with ", VARIANT);
+  printf("different framing,\n  reusing the compressed image data. The ");
+  printf("flavour is a comma separated\n  list of format hacks, 'safe' ");
+  printf("for the largest safe set, 'none', and\n  'bare' for a plain PNG ");
+  printf("without the bootstrap. May be repeated.\n");
+  printf("%s[file]:[file,...]: Javascript input depends on ", DEPENDS);
+  printf("the listed inputs\n  and has to come after them when bundling.\n");
+  printf("%s[file]: Pack a binary segment alongside the ", SEGMENT_OPTION);
+  printf("javascript. Segments\n  are available as Uint8Arrays in the global ");
+  printf("array S, in command line order.\n");
+  printf("%s[file]: Pack the file as a follow-on image ", STAGE_OPTION);
+  printf("of its own, written\n  next to the output as [name].stage[n].png. ");
+  printf("The javascript starts fetching\n  all stages at once, L[n] is a ");
+  printf("promise of the bytes of stage n as\n  Uint8Array, in command line ");
+  printf("order. Stages have to be served from the\n  page's origin, ");
+  printf("larger ones than %lu bytes split into several.\n",
+         MAX_IMAGE_HEIGHT * SINGLE_ROW_MAX_LENGTH - 1);
+  printf("%s[file]: Pack a WebAssembly module, the ", WASM);
+  printf("javascript inputs are\n  optional glue. The glue runs first and ");
+  printf("may set the imports in I, the\n  instance is stored in W and ");
+  printf("passed to the function R if the glue\n  defines it. Segments are ");
+  printf("rejected, transforms and context mixing are\n  not used.\n");
+  printf("%s: Minify javascript, formatting choices are ", MINIFY);
+  printf("made by compressed\n  size.\n");
+  printf("%s: Reorder top-level function declarations ", REORDER_UNITS);
+  printf("and units marked\n  with %s (up to %s) ", REORDER_UNIT_MARKER,
+         REORDER_END_MARKER);
+  printf("to the order that compresses best.\n");
+  printf("%s[number]: Number of reordering search ", REORDER_ITERATIONS);
+  printf("iterations per thread.\n  Default is 2000.\n");
+  printf("%s: Rename declared identifiers to the names ", RENAME_IDENTIFIERS);
+  printf("that compress\n  best. Names must not be accessed via strings, ");
+  printf("eval or with.\n");
+  printf("%s[number]: Number of renaming search ", RENAME_ITERATIONS);
+  printf("iterations per thread.\n  Default is 2000.\n");
+  printf("%s: Try reversible transforms of the javascript ", TRANSFORM);
+  printf("(%s", PAYLOAD_TRANSFORMS[0].name);
+  for (size_t i = 1; i < PAYLOAD_TRANSFORM_COUNT; i++) {
+    printf(", %s", PAYLOAD_TRANSFORMS[i].name);
+  }
+  printf(")\n  before compression, one is applied if it makes the file ");
+  printf("smaller. Not used\n  with segments.\n");
+  printf("%s: Compress the javascript with a context ", CONTEXT_MIXING);
+  printf("mixing coder tuned\n  to it and unpack it with a javascript ");
+  printf("decoder if that makes the file\n  smaller. Decoding adds to the ");
+  printf("page load time. Not used with segments.\n");
+  printf("%s: Anneal the LZ77 parse and block boundaries ", ANNEAL_PARSE);
+  printf("of the compressed\n  image data on all threads, starting from ");
+  printf("the zopfli or zlib result.\n");
+  printf("%s: Choose the row width of multi row images ", ROW_LAYOUT);
+  printf("so that row\n  boundaries split the fewest matches.\n");
+  printf("%s[number]: Number of annealing iterations ", ANNEAL_ITERATIONS);
+  printf("per thread.\n  Default is 20000.\n");
+  printf("%s: Recompress existing outputs given as files ", REOPTIMIZE);
+  printf("or directories\n  instead of javascript inputs, on all threads. ");
+  printf("Files are only rewritten\n  if they get smaller.\n");
+  printf("%s[seconds]: Time budget per file when ", REOPTIMIZE_BUDGET);
+  printf("re-optimizing, zopfli\n  iterations are doubled while the next ");
+  printf("attempt fits. Default is 60.\n");
+  printf("%s: Show the phase, iteration and best size ", PROGRESS);
+  printf("while compressing.\n  Ctrl+C cancels compressing and writes the ");
+  printf("best result so far, a second Ctrl+C\n  ends the process. ");
+  printf("Zopfli can not be interrupted, a cancel takes effect ");
+  printf("when it\n  finishes.\n");
+  printf("%s: Encode javascript under %d bytes with ", FAST_PATH,
+         SINGLE_ROW_MAX_LENGTH);
+  printf("zlib straight into\n  memory, without the other search ");
+  printf("options.\n");
+  printf("%s[runs]: Measure the p50/p99 latency of the ", FAST_PATH_BENCHMARK);
+  printf("fast path over\n  repeated encodes.\n");
+  printf("%s[bytes]: Output bytes one canvas readback ", READBACK_COST);
+  printf("at start-up is worth.\n  Single-row images read the row in one ");
+  printf("readback instead of one per\n  byte if the saved readbacks ");
+  printf("outweigh the longer bootstrap. Default is 0.\n");
+  printf("%s[file]: Write a javascript harness that ", BOOTSTRAP_BENCHMARK);
+  printf("times the bootstrap of\n  the output against a canvas shim and ");
+  printf("checks what it decodes. Runs\n  offline in node, qjs or d8.\n");
+  printf("%s: Produce the same output for the same ", DETERMINISTIC);
+  printf("input and options\n  with any number of threads. Searches run ");
+  printf("%lu chains, iteration counts\n  are per chain. Re-optimizing ",
+         DETERMINISTIC_SEARCH_CHAINS);
+  printf("makes a single attempt.\n");
+  printf("%s: Print the predicted peak memory for the ", PREDICT_MEMORY);
+  printf("inputs and options\n  and exit, for scheduling packing jobs.\n");
+  printf("%s[number]: Number of threads. Default is ", THREADS);
+  printf("the number of processors.\n");
+  printf("%s: Do not show statistics.\n", NO_STATISTICS);
+}
+
+void process_command_line(USER_OPTIONS *user_options, int argc, char *argv[]) {
+  if (argc < 3) {
+    print_usage_information();
+    return;
+  }
+
+  user_options->javascript_paths = counted_malloc(sizeof(char *) * argc);
+  user_options->dependencies = counted_malloc(sizeof(char *) * argc);
+  user_options->segment_paths = counted_malloc(sizeof(char *) * argc);
+  user_options->stage_paths = counted_malloc(sizeof(char *) * argc);
+  user_options->variants = counted_malloc(sizeof(PNG_VARIANT) * argc);
+
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], NO_ZOPFLI, strlen(NO_ZOPFLI)) == 0) {
+      user_options->no_zopfli = true;
+      continue;
+    }
+
+    if (strncmp(argv[i], ZOPFLI_ITERATIONS, strlen(ZOPFLI_ITERATIONS)) == 0) {
+      char iterations[strlen(argv[i]) - strlen(ZOPFLI_ITERATIONS)];
+      strncpy(iterations, argv[i] + strlen(ZOPFLI_ITERATIONS),
+              sizeof(iterations));
+      user_options->zopfli_iterations = atoi(iterations);
+      continue;
+    }
+
+    if (strncmp(argv[i], NO_BLOCK_SPLITTING, strlen(NO_BLOCK_SPLITTING)) == 0) {
+      user_options->no_blocksplitting = true;
+      continue;
+    }
+
+    if (strncmp(argv[i], NO_FORMAT_HACKS, strlen(NO_FORMAT_HACKS)) == 0) {
+      user_options->auto_format_hacks = false;
+      user_options->format_hacks = 0;
+      continue;
+    }
+
+    if (strncmp(argv[i], FORMAT_HACKS_OPTION, strlen(FORMAT_HACKS_OPTION)) ==
+        0) {
+      if (!parse_format_hacks(argv[i] + strlen(FORMAT_HACKS_OPTION),
+                              &user_options->format_hacks)) {
+        printf("Unknown format hack in '%s'\n", argv[i]);
+        exit(EXIT_FAILURE);
+      }
+      user_options->auto_format_hacks = false;
+      continue;
+    }
+
+    if (strncmp(argv[i], FORMAT_HACK_TARGETS, strlen(FORMAT_HACK_TARGETS)) ==
+        0) {
+      if (!parse_png_decoders(argv[i] + strlen(FORMAT_HACK_TARGETS),
+                              &user_options->format_hack_targets)) {
+        printf("Unknown decoder in '%s'\n", argv[i]);
+        exit(EXIT_FAILURE);
+      }
+      continue;
+    }
+
+    if (strncmp(argv[i], DEPENDS, strlen(DEPENDS)) == 0) {
+      user_options->dependencies[user_options->dependency_count++] =
+          argv[i] + strlen(DEPENDS);
+      continue;
+    }
+
+    if (strncmp(argv[i], STAGE_OPTION, strlen(STAGE_OPTION)) == 0) {
+      user_options->stage_paths[user_options->stage_count++] =
+          argv[i] + strlen(STAGE_OPTION);
+      continue;
+    }
+
+    if (strncmp(argv[i], SEGMENT_OPTION, strlen(SEGMENT_OPTION)) == 0) {
+      user_options->segment_paths[user_options->segment_count++] =
+          argv[i] + strlen(SEGMENT_OPTION);
+      continue;
+    }
+
+    if (strncmp(argv[i], VARIANT, strlen(VARIANT)) == 0) {
+      // 'safe' is resolved against the default targets unless they are
+      // given before
+      if (!parse_png_variant(
+              argv[i] + strlen(VARIANT), user_options->format_hack_targets,
+              &user_options->variants[user_options->variant_count++])) {
+        printf("Invalid variant '%s'\n", argv[i]);
+        exit(EXIT_FAILURE);
+      }
+      continue;
+    }
+
+    if (strncmp(argv[i], WASM, strlen(WASM)) == 0) {
+      user_options->wasm_path = argv[i] + strlen(WASM);
+      continue;
+    }
+
+    if (strncmp(argv[i], MINIFY, strlen(MINIFY)) == 0) {
+      user_options->minify = true;
+      continue;
+    }
+
+    if (strncmp(argv[i], REORDER_UNITS, strlen(REORDER_UNITS)) == 0) {
+      user_options->reorder_units = true;
+      continue;
+    }
+
+    if (strncmp(argv[i], REORDER_ITERATIONS, strlen(REORDER_ITERATIONS)) == 0) {
+      user_options->reorder_iterations =
+          atoi(argv[i] + strlen(REORDER_ITERATIONS));
+      continue;
+    }
+
+    if (strncmp(argv[i], RENAME_IDENTIFIERS, strlen(RENAME_IDENTIFIERS)) == 0) {
+      user_options->rename_identifiers = true;
+      continue;
+    }
+
+    if (strncmp(argv[i], RENAME_ITERATIONS, strlen(RENAME_ITERATIONS)) == 0) {
+      user_options->rename_iterations =
+          atoi(argv[i] + strlen(RENAME_ITERATIONS));
+      continue;
+    }
+
+    if (strncmp(argv[i], TRANSFORM, strlen(TRANSFORM)) == 0) {
+      user_options->transform = true;
+      continue;
+    }
+
+    if (strncmp(argv[i], CONTEXT_MIXING, strlen(CONTEXT_MIXING)) == 0) {
+      user_options->context_mixing = true;
+      continue;
+    }
+
+    if (strncmp(argv[i], ANNEAL_PARSE, strlen(ANNEAL_PARSE)) == 0) {
+      user_options->anneal_parse = true;
+      continue;
+    }
+
+    if (strncmp(argv[i], ROW_LAYOUT, strlen(ROW_LAYOUT)) == 0) {
+      user_options->row_layout = true;
+      continue;
+    }
+
+    if (strncmp(argv[i], ANNEAL_ITERATIONS, strlen(ANNEAL_ITERATIONS)) == 0) {
+      user_options->anneal_iterations =
+          atoi(argv[i] + strlen(ANNEAL_ITERATIONS));
+      continue;
+    }
+
+    if (strncmp(argv[i], REOPTIMIZE_BUDGET, strlen(REOPTIMIZE_BUDGET)) == 0) {
+      user_options->reoptimize_budget =
+          atoi(argv[i] + strlen(REOPTIMIZE_BUDGET));
+      continue;
+    }
+
+    if (strncmp(argv[i], REOPTIMIZE, strlen(REOPTIMIZE)) == 0) {
+      user_options->reoptimize = true;
+      continue;
+    }
+
+    if (strncmp(argv[i], PROGRESS, strlen(PROGRESS)) == 0) {
+      user_options->progress = true;
+      continue;
+    }
+
+    if (strncmp(argv[i], FAST_PATH_BENCHMARK, strlen(FAST_PATH_BENCHMARK)) ==
+        0) {
+      user_options->fast_path = true;
+      user_options->fast_path_benchmark_runs =
+          atoi(argv[i] + strlen(FAST_PATH_BENCHMARK));
+      continue;
+    }
+
+    if (strncmp(argv[i], READBACK_COST, strlen(READBACK_COST)) == 0) {
+      user_options->readback_cost = atof(argv[i] + strlen(READBACK_COST));
+      continue;
+    }
+
+    if (strncmp(argv[i], BOOTSTRAP_BENCHMARK, strlen(BOOTSTRAP_BENCHMARK)) ==
+        0) {
+      user_options->bootstrap_benchmark_path =
+          argv[i] + strlen(BOOTSTRAP_BENCHMARK);
+      continue;
+    }
+
+    if (strncmp(argv[i], FAST_PATH, strlen(FAST_PATH)) == 0) {
+      user_options->fast_path = true;
+      continue;
+    }
+
+    if (strncmp(argv[i], DETERMINISTIC, strlen(DETERMINISTIC)) == 0) {
+      user_options->deterministic = true;
+      continue;
+    }
+
+    if (strncmp(argv[i], THREADS, strlen(THREADS)) == 0) {
+      user_options->thread_count = atoi(argv[i] + strlen(THREADS));
+      continue;
+    }
+
+    if (strncmp(argv[i], PREDICT_MEMORY, strlen(PREDICT_MEMORY)) == 0) {
+      user_options->predict_memory = true;
+      continue;
+    }
+
+    if (strncmp(argv[i], NO_STATISTICS, strlen(NO_STATISTICS)) == 0) {
+      user_options->no_statistics = true;
+      continue;
+    }
+
+    user_options->javascript_paths[user_options->javascript_path_count++] =
+        argv[i];
+  }
+
+  // Last file name is the destination png file, re-optimizing only takes
+  // existing outputs. WebAssembly modules need no javascript.
+  size_t min_javascript_path_count = user_options->wasm_path != NULL ? 0 : 1;
+  if (user_options->javascript_path_count > min_javascript_path_count &&
+      !user_options->reoptimize) {
+    user_options->png_path =
+        user_options->javascript_paths[--user_options->javascript_path_count];
+  }
+}
+
+int main(int argc, char *argv[]) {
+  printf("zopfli-pnginator\n\n");
+
+  USER_OPTIONS user_options = {.zopfli_iterations = 10,
+                               .auto_format_hacks = true,
+                               .format_hack_targets = PNG_DECODER_ALL,
+                               .reorder_iterations = 2000,
+                               .rename_iterations = 2000,
+                               .anneal_iterations = 20000,
+                               .reoptimize_budget = 60};
   process_command_line(&user_options, argc, argv);
-  if (user_options.javascript_path == NULL || user_options.png_path == NULL) {
+  if ((user_options.javascript_path_count == 0 &&
+       user_options.wasm_path == NULL) ||
+      (user_options.png_path == NULL && !user_options.reoptimize)) {
+    exit(EXIT_FAILURE);
+  }
+
+  // The module is the payload, segments would have to share the image
+  if (user_options.wasm_path != NULL && user_options.segment_count > 0) {
+    printf("%s[file] can not be combined with %s[file]\n", SEGMENT_OPTION,
+           WASM);
     exit(EXIT_FAILURE);
   }
 
-  char *javascript = read_text_file(user_options.javascript_path);
+  if (user_options.thread_count <= 0) {
+    user_options.thread_count = get_processor_count();
+  }
+
+  // Apply the largest set of format hacks that is safe for all targeted
+  // decoders or reject an unsafe user selection
+  if (user_options.auto_format_hacks) {
+    user_options.format_hacks =
+        select_safe_format_hacks(user_options.format_hack_targets);
+  } else {
+    const char *reason;
+    if (!check_format_hacks(user_options.format_hacks,
+                            user_options.format_hack_targets, &reason)) {
+      printf("Unsafe combination of format hacks (%s)\n", reason);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // Variants pick their hacks explicitly, only the structural rules apply
+  for (size_t i = 0; i < user_options.variant_count; i++) {
+    const char *reason;
+    if (!check_format_hacks(user_options.variants[i].format_hacks, 0,
+                            &reason)) {
+      printf("Unsafe combination of format hacks for '%s' (%s)\n",
+             user_options.variants[i].path, reason);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (user_options.reoptimize) {
+    bool success = reoptimize(&user_options);
+    counted_free(user_options.variants);
+    counted_free(user_options.segment_paths);
+    counted_free(user_options.stage_paths);
+    counted_free(user_options.dependencies);
+    counted_free(user_options.javascript_paths);
+    return success ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  COMPRESSION_STATISTICS compression_statistics = {0};
+
+  // Predicted from the input file sizes before anything is read
+  for (size_t i = 0; i < user_options.javascript_path_count; i++) {
+    compression_statistics.input_size +=
+        file_size(user_options.javascript_paths[i]);
+  }
+  for (size_t i = 0; i < user_options.segment_count; i++) {
+    compression_statistics.input_size +=
+        file_size(user_options.segment_paths[i]);
+  }
+  for (size_t i = 0; i < user_options.stage_count; i++) {
+    compression_statistics.input_size +=
+        file_size(user_options.stage_paths[i]);
+  }
+  if (user_options.wasm_path != NULL) {
+    compression_statistics.input_size += file_size(user_options.wasm_path);
+  }
+  compression_statistics.predicted_memory =
+      predict_peak_memory(&user_options, compression_statistics.input_size);
+  if (user_options.predict_memory) {
+    printf("Predicted peak memory: %lu KB for %lu input bytes\n",
+           compression_statistics.predicted_memory / 1024,
+           compression_statistics.input_size);
+    counted_free(user_options.variants);
+    counted_free(user_options.segment_paths);
+    counted_free(user_options.stage_paths);
+    counted_free(user_options.dependencies);
+    counted_free(user_options.javascript_paths);
+    return EXIT_SUCCESS;
+  }
+
+  // Several javascript inputs are bundled into one, WebAssembly glue is
+  // optional
+  begin_memory_phase(MEMORY_PHASE_INPUT);
+  char *javascript = NULL;
+  if (user_options.javascript_path_count > 1) {
+    javascript = bundle_javascript(&user_options, &compression_statistics);
+  } else if (user_options.javascript_path_count == 1) {
+    javascript = read_text_file(user_options.javascript_paths[0]);
+  } else {
+    javascript = counted_calloc(1, 1);
+  }
   if (javascript == NULL) {
     exit(EXIT_FAILURE);
   }
 
-  COMPRESSION_STATISTICS compression_statistics;
-  IMAGE *image =
-      embbed_javascript_in_image(javascript, &compression_statistics);
+  begin_memory_phase(MEMORY_PHASE_SEARCH);
+  if (user_options.minify) {
+    char *minified_javascript =
+        minify(javascript, &user_options, &compression_statistics);
+    if (minified_javascript != NULL) {
+      counted_free(javascript);
+      javascript = minified_javascript;
+    }
+  }
+
+  if (user_options.reorder_units) {
+    char *reordered_javascript =
+        reorder_units(javascript, &user_options, &compression_statistics);
+    if (reordered_javascript != NULL) {
+      counted_free(javascript);
+      javascript = reordered_javascript;
+    }
+  }
+
+  if (user_options.rename_identifiers) {
+    char *renamed_javascript =
+        rename_identifiers(javascript, &user_options, &compression_statistics);
+    if (renamed_javascript != NULL) {
+      counted_free(javascript);
+      javascript = renamed_javascript;
+    }
+  }
+
+  // Follow-on stages are packed on their own, the first stage fetches them
+  if (user_options.stage_count > 0) {
+    begin_memory_phase(MEMORY_PHASE_COMPRESSION);
+    char *staged_javascript =
+        pack_stages(javascript, &user_options, &compression_statistics);
+    if (staged_javascript == NULL) {
+      exit(EXIT_FAILURE);
+    }
+    counted_free(javascript);
+    javascript = staged_javascript;
+  }
+
+  // Bootstraps decode bytes as characters, non-ASCII text is escaped unless
+  // the plain embedding can decode it as UTF-8 instead
+  bool utf8_payload = user_options.segment_count == 0 &&
+                      user_options.wasm_path == NULL &&
+                      !user_options.context_mixing &&
+                      !user_options.transform && !user_options.fast_path;
+  if (!is_ascii(javascript)) {
+    char *escaped_javascript = escape_non_ascii(javascript);
+    if (escaped_javascript == NULL &&
+        (!utf8_payload || !is_valid_utf8(javascript))) {
+      printf("Non-ASCII characters in tagged templates need the UTF-8 "
+             "payload of\nvalid UTF-8 javascript without segments, "
+             "WebAssembly, transforms, context\nmixing or the fast path\n");
+      exit(EXIT_FAILURE);
+    }
+    if (!utf8_payload) {
+      counted_free(javascript);
+      javascript = escaped_javascript;
+      compression_statistics.text_encoding = "escapes";
+    } else {
+      counted_free(escaped_javascript);
+    }
+  }
+
+  // Small javascript needs no image, snippets are encoded as they are
+  if (user_options.fast_path && user_options.segment_count == 0 &&
+      user_options.wasm_path == NULL && user_options.variant_count == 0 &&
+      strlen(javascript) < (size_t)SINGLE_ROW_MAX_LENGTH) {
+    begin_memory_phase(MEMORY_PHASE_COMPRESSION);
+    bool success = write_javascript_with_fast_path(javascript, &user_options,
+                                                   &compression_statistics);
+    if (success && user_options.bootstrap_benchmark_path != NULL) {
+      success = write_bootstrap_benchmark(javascript, &user_options,
+                                          &compression_statistics);
+    }
+    if (success) {
+      success = write_stages(compression_statistics.stages,
+                             compression_statistics.stage_count,
+                             user_options.png_path);
+    }
+    collect_memory_statistics(&compression_statistics);
+    if (success && !user_options.no_statistics) {
+      print_compression_statistics(&compression_statistics);
+    }
+    counted_free(javascript);
+    free_stages(compression_statistics.stages,
+                compression_statistics.stage_count);
+    counted_free(compression_statistics.bundle_order);
+    counted_free(user_options.variants);
+    counted_free(user_options.segment_paths);
+    counted_free(user_options.stage_paths);
+    counted_free(user_options.dependencies);
+    counted_free(user_options.javascript_paths);
+    return success ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  // Binary segments, empty ones could not be told apart in the unpack code
+  begin_memory_phase(MEMORY_PHASE_INPUT);
+  SEGMENT *segments =
+      counted_calloc(user_options.segment_count + 1, sizeof(SEGMENT));
+  for (size_t i = 0; i < user_options.segment_count; i++) {
+    segments[i].path = user_options.segment_paths[i];
+    segments[i].data =
+        read_binary_file(segments[i].path, &segments[i].size);
+    if (segments[i].data == NULL || segments[i].size == 0) {
+      printf("Segment file '%s' is missing or empty\n", segments[i].path);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // WebAssembly modules start with their magic number
+  SEGMENT wasm = {user_options.wasm_path, NULL, 0};
+  if (wasm.path != NULL) {
+    wasm.data = read_binary_file(wasm.path, &wasm.size);
+    if (wasm.data == NULL || wasm.size < 8 ||
+        memcmp(wasm.data, "\0asm", 4) != 0) {
+      printf("'%s' is not a WebAssembly module\n", wasm.path);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // Check the image size limit of browsers before compressing, segments and
+  // modules come after the javascript and its \0 end marker
+  size_t payload_size = strlen(javascript);
+  if (wasm.path != NULL) {
+    payload_size += 1 + wasm.size;
+  } else {
+    for (size_t i = 0; i < user_options.segment_count; i++) {
+      payload_size += segments[i].size + (i == 0 ? 1 : 0);
+    }
+  }
+  size_t max_payload_size = MAX_IMAGE_HEIGHT * SINGLE_ROW_MAX_LENGTH - 1;
+  if (payload_size > max_payload_size) {
+    printf("Payload of %lu bytes exceeds the %lu bytes browsers decode from "
+           "an image\n",
+           payload_size, max_payload_size);
+    exit(EXIT_FAILURE);
+  }
 
-  free(javascript);
+  begin_memory_phase(MEMORY_PHASE_IMAGE);
+  IMAGE *image = NULL;
+  if (wasm.path != NULL) {
+    image = embbed_wasm_in_image(javascript, &wasm, &user_options,
+                                 &compression_statistics);
+  } else if (user_options.segment_count > 0) {
+    image = embbed_segments_in_image(javascript, segments,
+                                     user_options.segment_count, &user_options,
+                                     &compression_statistics);
+  } else if (user_options.context_mixing) {
+    image = embbed_context_mixed_javascript_in_image(javascript, &user_options,
+                                                     &compression_statistics);
+  } else if (user_options.transform) {
+    image = embbed_transformed_javascript_in_image(javascript, &user_options,
+                                                   &compression_statistics);
+  } else if (!is_ascii(javascript)) {
+    image = embbed_non_ascii_javascript_in_image(javascript, &user_options,
+                                                 &compression_statistics);
+  } else {
+    image = embbed_javascript_in_image(javascript, &user_options,
+                                       &compression_statistics);
+  }
+
+  if (image->height == 1 && image->unpack_code == NULL) {
+    select_single_row_bootstrap(image, &user_options, &compression_statistics);
+  }
 
   bool success =
       write_image_as_png(image, &user_options, &compression_statistics);
+  if (success && user_options.bootstrap_benchmark_path != NULL) {
+    success = write_bootstrap_benchmark(javascript, &user_options,
+                                        &compression_statistics);
+  }
+  if (success) {
+    success = write_stages(compression_statistics.stages,
+                           compression_statistics.stage_count,
+                           user_options.png_path);
+  }
+  counted_free(javascript);
 
-  free(image->data);
-  free(image);
+  counted_free(image->unpack_code);
+  counted_free(image->data);
+  counted_free(image);
 
+  collect_memory_statistics(&compression_statistics);
   if (success && !user_options.no_statistics) {
     print_compression_statistics(&compression_statistics);
   }
 
+  for (size_t i = 0; i < user_options.segment_count; i++) {
+    counted_free(segments[i].data);
+  }
+  counted_free(segments);
+  counted_free(wasm.data);
+  counted_free(compression_statistics.segment_order);
+  free_stages(compression_statistics.stages,
+              compression_statistics.stage_count);
+  counted_free(compression_statistics.bundle_order);
+  counted_free(user_options.variants);
+  counted_free(user_options.segment_paths);
+  counted_free(user_options.stage_paths);
+  counted_free(user_options.dependencies);
+  counted_free(user_options.javascript_paths);
+
   return success ? EXIT_SUCCESS : EXIT_FAILURE;
 }